@@ -58,6 +58,22 @@
 *   ch = CBUF_Pop(myQ);
 *   @endcode
 *
+*   Producers and consumers which move blocks of data (memcpy, DMA, USB
+*   packets, formatters) can work directly on the buffer storage using
+*   CBUF_PushReserve/CBUF_PushCommit and CBUF_PopPeek/CBUF_PopConsume.
+*   These hand back up to two spans: the first runs from the current index
+*   to the end of m_entry, and the second is the part which wraps around
+*   to the start. The index is only updated once, by the commit/consume.
+*
+*   @code
+*   uint8_t *p1, *p2;
+*   size_t   n1, n2;
+*   size_t   n = CBUF_PushReserve(myQ, len, p1, n1, p2, n2);
+*   memcpy(p1, src, n1);
+*   memcpy(p2, src + n1, n2);
+*   CBUF_PushCommit(myQ, n);
+*   @endcode
+*
 ****************************************************************************/
 
 #if !defined(CBUF_H)
@@ -65,6 +81,8 @@
 
 /* ---- Include Files ---------------------------------------------------- */
 
+#include <stddef.h>
+
 /* ---- Constants and Types ---------------------------------------------- */
 
 /**
@@ -78,7 +96,7 @@
 *   contained in the circular buffer.
 */
 
-#define CBUF_Len(cbuf)              ((typeof(cbuf.m_put_idx))((cbuf.m_put_idx) - (cbuf.m_get_idx)))
+#define CBUF_Len(cbuf)              ((__typeof__(cbuf.m_put_idx))((cbuf.m_put_idx) - (cbuf.m_get_idx)))
 
 /**
 *   Returns the size of the buffer (in entries)
@@ -114,23 +132,54 @@
 */
 #define CBUF_ContigSpace(cbuf)      (CBUF_Wrapped(cbuf) ? CBUF_Space(cbuf) : (CBUF_Size(cbuf) - (cbuf.m_put_idx & CBUF_Mask(cbuf))))
 
+/**
+*   Compiler barrier. Ensures that the entries have been written (or read)
+*   before the index which publishes them is updated.
+*/
+
+#define CBUF_Barrier()              __asm__ volatile ("" ::: "memory")
+
+/**
+*   Ordering between the producer and the consumer. Each side reads the
+*   other side's index and then does CBUF_Acquire before touching the
+*   entries, and does CBUF_Release after touching the entries and before
+*   updating its own index. On a single core Cortex-M the only reordering
+*   to worry about is the compiler's, but on the host the producer and
+*   consumer may be threads running on different CPUs.
+*/
+
+#if defined(__ARM_ARCH_6M__) || defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+#define CBUF_Acquire()              CBUF_Barrier()
+#define CBUF_Release()              CBUF_Barrier()
+#else
+#define CBUF_Acquire()              __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define CBUF_Release()              __atomic_thread_fence(__ATOMIC_RELEASE)
+#endif
+
 /**
 *   Appends an element to the end of the circular buffer. The
 *   element is expected to be of the same type as the @c m_entry
-*   member.
+*   member. The caller has already checked (using CBUF_IsFull or
+*   CBUF_Space) that there's room.
 */
 
 #define CBUF_Push(cbuf, elem) do { \
+    CBUF_Acquire(); \
     (cbuf.m_entry)[cbuf.m_put_idx & CBUF_Mask(cbuf)] = (elem); \
+    CBUF_Release(); \
     cbuf.m_put_idx++; \
 } while (0)
 
 /**
-*   Retrieves an element from the beginning of the circular buffer
+*   Retrieves an element from the beginning of the circular buffer. The
+*   caller has already checked (using CBUF_IsEmpty or CBUF_Len) that there
+*   is one.
 */
 
 #define CBUF_Pop(cbuf) ({ \
+    CBUF_Acquire(); \
     __typeof__(cbuf.m_entry[0]) _elem = (cbuf.m_entry)[cbuf.m_get_idx & CBUF_Mask(cbuf)]; \
+    CBUF_Release(); \
     cbuf.m_get_idx++; \
     _elem; })
 
@@ -189,6 +238,75 @@
 
 #define CBUF_GetPopEntryPtr(cbuf)   &(cbuf.m_entry)[cbuf.m_get_idx & CBUF_Mask(cbuf)]
 
+/**
+*   Reserves space for up to @c len entries to be pushed. @c ptr1 and
+*   @c len1 are set to describe the contiguous space starting at the put
+*   index, and @c ptr2 and @c len2 to describe the space which wraps around
+*   to the beginning of the buffer (@c len2 is zero if there's no wrap).
+*   Returns the total number of entries reserved, which may be less than
+*   @c len if the buffer doesn't have that much space.
+*
+*   Nothing is published until CBUF_PushCommit is called.
+*/
+
+#define CBUF_PushReserve(cbuf, len, ptr1, len1, ptr2, len2) ({ \
+    size_t _total = CBUF_Space(cbuf); \
+    size_t _idx = cbuf.m_put_idx & CBUF_Mask(cbuf); \
+    if (_total > (size_t)(len)) { \
+        _total = (len); \
+    } \
+    CBUF_Acquire(); \
+    (len1) = CBUF_Size(cbuf) - _idx; \
+    if ((len1) > _total) { \
+        (len1) = _total; \
+    } \
+    (len2) = _total - (len1); \
+    (ptr1) = &(cbuf.m_entry)[_idx]; \
+    (ptr2) = &(cbuf.m_entry)[0]; \
+    _total; })
+
+/**
+*   Publishes @c len entries which were previously filled in using the
+*   spans returned by CBUF_PushReserve.
+*/
+
+#define CBUF_PushCommit(cbuf, len) do { \
+    CBUF_Release(); \
+    CBUF_AdvancePushIdxBy(cbuf, len); \
+} while (0)
+
+/**
+*   Describes up to @c len entries waiting to be popped, without removing
+*   them. The spans are returned the same way as CBUF_PushReserve, and the
+*   total number of entries described is returned.
+*/
+
+#define CBUF_PopPeek(cbuf, len, ptr1, len1, ptr2, len2) ({ \
+    size_t _total = CBUF_Len(cbuf); \
+    size_t _idx = cbuf.m_get_idx & CBUF_Mask(cbuf); \
+    if (_total > (size_t)(len)) { \
+        _total = (len); \
+    } \
+    CBUF_Acquire(); \
+    (len1) = CBUF_Size(cbuf) - _idx; \
+    if ((len1) > _total) { \
+        (len1) = _total; \
+    } \
+    (len2) = _total - (len1); \
+    (ptr1) = &(cbuf.m_entry)[_idx]; \
+    (ptr2) = &(cbuf.m_entry)[0]; \
+    _total; })
+
+/**
+*   Removes @c len entries which were previously examined using the spans
+*   returned by CBUF_PopPeek. The space becomes available to the producer.
+*/
+
+#define CBUF_PopConsume(cbuf, len) do { \
+    CBUF_Release(); \
+    CBUF_AdvancePopIdxBy(cbuf, len); \
+} while (0)
+
 /**
 *   Determines if the circular buffer is empty.
 */
@@ -0,0 +1,310 @@
+/****************************************************************************
+*
+*   Since this code originated from code which is public domain, I
+*   hereby declare this code to be public domain as well.
+*
+*   Dave Hylands - dhylands@gmail.com
+*
+****************************************************************************/
+/**
+*
+*   @file   MPCBUF.h
+*
+*   @defgroup   MPCBUF Multiple Producer Circular Buffer
+*   @{
+*
+*   @brief  A circular buffer which may be written to from several contexts.
+*
+*   CBUF assumes one reader and one writer. These macros allow any number
+*   of writers (the main loop and any number of interrupt handlers, or on
+*   the host, threads) along with a single reader, without disabling
+*   interrupts.
+*
+*   The write side is always a reserve followed by a commit. Reserving
+*   claims a contiguous (modulo the wrap) region of the buffer, so what one
+*   writer puts in its region is never interleaved with what another writer
+*   puts in. A count of writers which have reserved but not yet committed is
+*   kept, and the data is only made visible to the reader when the last of
+*   them commits, so the reader always sees whole regions, in the order in
+*   which they were reserved.
+*
+*   The commit index and the writer count are packed into one 32-bit word
+*   (m_state), and the put index is kept in another (m_put_idx). Both are
+*   updated using exclusive loads and stores (LDREX/STREX) on Cortex-M, or
+*   compare-and-swap elsewhere. Taking an exception clears the exclusive
+*   monitor, so an interrupt handler which writes in between a LDREX and
+*   STREX causes the STREX to fail and the update to be retried. A writer
+*   is counted before it moves the put index, so the last writer to commit
+*   can publish everything up to the put index.
+*
+*   Compare-and-swap only fails if the value changed, and a handler which
+*   reserves and commits in between puts the writer count back the way it
+*   found it. So m_state also holds a generation count, which every
+*   reservation bumps. Otherwise the interrupted commit would go on to
+*   publish the put index it read before the handler ran, leaving the
+*   handler's data unpublished.
+*
+*   The indices are 16 bits, so the buffer size must be a power of two no
+*   larger than 32768 entries. Entries are bytes. There can be at most 255
+*   writers at once.
+*
+*   @code
+*   struct
+*   {
+*       volatile uint32_t    m_state;
+*       volatile uint32_t    m_put_idx;
+*       volatile uint32_t    m_get_idx;
+*                uint8_t     m_entry[ 1024 ];
+*
+*   } myQ;
+*
+*   uint8_t *p1, *p2;
+*   size_t   n1, n2;
+*   if (MPCBUF_PushReserve(myQ, len, len, p1, n1, p2, n2) != 0) {
+*       memcpy(p1, src, n1);
+*       memcpy(p2, src + n1, n2);
+*       MPCBUF_PushCommit(myQ);
+*   }
+*   @endcode
+*
+*   The reader uses MPCBUF_PopPeek and MPCBUF_PopConsume, which work just
+*   like their CBUF counterparts.
+*
+****************************************************************************/
+
+#if !defined(MPCBUF_H)
+#define MPCBUF_H
+
+/* ---- Include Files ---------------------------------------------------- */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* ---- Constants and Types ---------------------------------------------- */
+
+#define MPCBUF_IDX_BITS         16
+#define MPCBUF_IDX_MASK         ((1u << MPCBUF_IDX_BITS) - 1)
+#define MPCBUF_WRITERS_SHIFT    16
+#define MPCBUF_WRITERS_MASK     0xffu
+#define MPCBUF_GEN_SHIFT        24
+
+#define MPCBUF_COMMIT(state)    ((state) & MPCBUF_IDX_MASK)
+#define MPCBUF_WRITERS(state)   (((state) >> MPCBUF_WRITERS_SHIFT) & MPCBUF_WRITERS_MASK)
+#define MPCBUF_GEN(state)       ((state) >> MPCBUF_GEN_SHIFT)
+#define MPCBUF_STATE(commit, writers, gen) \
+    (((commit) & MPCBUF_IDX_MASK) \
+     | ((uint32_t)(writers) << MPCBUF_WRITERS_SHIFT) \
+     | ((uint32_t)(gen) << MPCBUF_GEN_SHIFT))
+
+/**
+*   The exclusive access primitives. MPCBUF_StoreExclusive returns true if
+*   the store happened, and false if @c *addr may have been changed since
+*   MPCBUF_LoadExclusive (in which case the caller starts over).
+*/
+
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+
+static inline uint32_t MPCBUF_LoadExclusive(volatile uint32_t *addr)
+{
+    uint32_t val;
+    __asm__ volatile ("ldrex %0, [%1]" : "=r" (val) : "r" (addr) : "memory");
+    return val;
+}
+
+static inline bool MPCBUF_StoreExclusive(volatile uint32_t *addr, uint32_t old, uint32_t val)
+{
+    uint32_t failed;
+    (void)old;
+    __asm__ volatile ("strex %0, %2, [%1]" : "=&r" (failed) : "r" (addr), "r" (val) : "memory");
+    return failed == 0;
+}
+
+static inline void MPCBUF_ClearExclusive(void)
+{
+    __asm__ volatile ("clrex" ::: "memory");
+}
+
+// There's only one core, so only the compiler needs to be kept from
+// reordering things.
+#define MPCBUF_Barrier()        __asm__ volatile ("" ::: "memory")
+
+#else
+
+static inline uint32_t MPCBUF_LoadExclusive(volatile uint32_t *addr)
+{
+    return __atomic_load_n(addr, __ATOMIC_ACQUIRE);
+}
+
+static inline bool MPCBUF_StoreExclusive(volatile uint32_t *addr, uint32_t old, uint32_t val)
+{
+    return __atomic_compare_exchange_n(addr, &old, val, true,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static inline void MPCBUF_ClearExclusive(void)
+{
+}
+
+#define MPCBUF_Barrier()        __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#endif
+
+/**
+*   Finishes a reservation (or a failed attempt at one). When no other
+*   writers have outstanding reservations, everything up to the put index
+*   is published.
+*/
+
+static inline void MPCBUF_Commit(volatile uint32_t *state, volatile uint32_t *put_idx)
+{
+    uint32_t old;
+    uint32_t val;
+
+    // Make sure that the data is written before it can be published.
+    MPCBUF_Barrier();
+    do {
+        old = MPCBUF_LoadExclusive(state);
+
+        // Every writer which has moved the put index has been counted, so
+        // if we're the last one, it's all been written.
+        uint32_t writers = MPCBUF_WRITERS(old) - 1;
+        uint32_t commit = writers == 0 ? *put_idx : MPCBUF_COMMIT(old);
+        val = MPCBUF_STATE(commit, writers, MPCBUF_GEN(old));
+    } while (!MPCBUF_StoreExclusive(state, old, val));
+}
+
+/**
+*   Claims between @c min_len and @c len entries at the put index, and
+*   stores the index of the first one in @c *idx. Returns the number of
+*   entries claimed, or 0 (without claiming anything) if fewer than
+*   @c min_len are available.
+*/
+
+static inline size_t MPCBUF_Reserve(volatile uint32_t *state, volatile uint32_t *put_idx,
+                                    volatile uint32_t *get_idx, size_t size,
+                                    size_t min_len, size_t len, size_t *idx)
+{
+    uint32_t old;
+    size_t   total;
+
+    // Count ourselves as a writer first, so that what we're about to claim
+    // can't be published until we commit. Bumping the generation makes any
+    // commit which read the state before this one start over.
+    do {
+        old = MPCBUF_LoadExclusive(state);
+    } while (!MPCBUF_StoreExclusive(state, old,
+                                    MPCBUF_STATE(MPCBUF_COMMIT(old), MPCBUF_WRITERS(old) + 1,
+                                                 MPCBUF_GEN(old) + 1)));
+
+    do {
+        old = MPCBUF_LoadExclusive(put_idx);
+
+        total = size - ((old - *get_idx) & MPCBUF_IDX_MASK);
+        if (total > len) {
+            total = len;
+        }
+        if (total < min_len || total == 0) {
+            MPCBUF_ClearExclusive();
+            MPCBUF_Commit(state, put_idx);
+            return 0;
+        }
+        *idx = old;
+    } while (!MPCBUF_StoreExclusive(put_idx, old, (old + total) & MPCBUF_IDX_MASK));
+    return total;
+}
+
+/**
+*   Initializes the circular buffer for use.
+*/
+
+#define MPCBUF_Init(cbuf)           do { cbuf.m_state = 0; cbuf.m_put_idx = 0; cbuf.m_get_idx = 0; } while (0)
+
+/**
+*   Returns the number of entries which the buffer can hold.
+*/
+
+#define MPCBUF_Size(cbuf)           (sizeof(cbuf.m_entry) / sizeof(cbuf.m_entry[0]))
+
+#define MPCBUF_Mask(cbuf)           (MPCBUF_Size(cbuf) - 1)
+
+/**
+*   Returns the number of committed entries waiting to be popped.
+*/
+
+#define MPCBUF_Len(cbuf)            ((size_t)((MPCBUF_COMMIT(cbuf.m_state) - cbuf.m_get_idx) & MPCBUF_IDX_MASK))
+
+/**
+*   Returns the number of entries which can currently be reserved.
+*/
+
+#define MPCBUF_Space(cbuf)          (MPCBUF_Size(cbuf) - ((cbuf.m_put_idx - cbuf.m_get_idx) & MPCBUF_IDX_MASK))
+
+#define MPCBUF_IsEmpty(cbuf)        (MPCBUF_Len(cbuf) == 0)
+
+/**
+*   Reserves between @c min_len and @c len entries, and describes them in
+*   two spans the same way as CBUF_PushReserve. Returns the number of
+*   entries reserved, or 0 if fewer than @c min_len are available. Unless
+*   0 is returned, the reservation must be finished by MPCBUF_PushCommit
+*   (and quickly, since nothing reserved after it will be seen by the
+*   reader until then).
+*/
+
+#define MPCBUF_PushReserve(cbuf, min_len, len, ptr1, len1, ptr2, len2) ({ \
+    size_t _idx = 0; \
+    size_t _total = MPCBUF_Reserve(&cbuf.m_state, &cbuf.m_put_idx, &cbuf.m_get_idx, \
+                                   MPCBUF_Size(cbuf), (min_len), (len), &_idx); \
+    _idx &= MPCBUF_Mask(cbuf); \
+    (len1) = MPCBUF_Size(cbuf) - _idx; \
+    if ((len1) > _total) { \
+        (len1) = _total; \
+    } \
+    (len2) = _total - (len1); \
+    (ptr1) = &(cbuf.m_entry)[_idx]; \
+    (ptr2) = &(cbuf.m_entry)[0]; \
+    _total; })
+
+/**
+*   Finishes a reservation made by MPCBUF_PushReserve.
+*/
+
+#define MPCBUF_PushCommit(cbuf)     MPCBUF_Commit(&cbuf.m_state, &cbuf.m_put_idx)
+
+/**
+*   Describes up to @c len committed entries without removing them. Only
+*   the (single) reader may call this.
+*/
+
+#define MPCBUF_PopPeek(cbuf, len, ptr1, len1, ptr2, len2) ({ \
+    size_t _total = MPCBUF_Len(cbuf); \
+    size_t _idx = cbuf.m_get_idx & MPCBUF_Mask(cbuf); \
+    if (_total > (size_t)(len)) { \
+        _total = (len); \
+    } \
+    MPCBUF_Barrier(); \
+    (len1) = MPCBUF_Size(cbuf) - _idx; \
+    if ((len1) > _total) { \
+        (len1) = _total; \
+    } \
+    (len2) = _total - (len1); \
+    (ptr1) = &(cbuf.m_entry)[_idx]; \
+    (ptr2) = &(cbuf.m_entry)[0]; \
+    _total; })
+
+/**
+*   Removes @c len entries which were previously examined using
+*   MPCBUF_PopPeek, making the space available to the writers.
+*/
+
+#define MPCBUF_PopConsume(cbuf, len) do { \
+    MPCBUF_Barrier(); \
+    cbuf.m_get_idx = (cbuf.m_get_idx + (len)) & MPCBUF_IDX_MASK; \
+} while (0)
+
+/* ---- Variable Externs ------------------------------------------------- */
+/* ---- Function Prototypes ---------------------------------------------- */
+
+/** @} */
+
+#endif // MPCBUF_H
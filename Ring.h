@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Single producer, single consumer ring buffer for C++ code. This is the
+// equivalent of the CBUF.h macros, with the same free running index scheme
+// and the same reserve/commit and peek/consume operations, but:
+//
+//	- N being a power of two, and fitting in the index type, is checked at
+//	  compile time.
+//	- The indices are std::atomic, and each side publishes its index with a
+//	  release store and reads the other side's with an acquire load, so the
+//	  compiler (and the CPU, on the host) can't move data accesses across
+//	  them. On Cortex-M4 those compile to plain loads and stores plus a DMB.
+//	- There are bulk push/pop operations, as well as the span accessors.
+//
+//	Ring<uint8_t, 1024> rx;
+//	rx.push(data, len);				// Returns the number pushed
+//	Ring<uint8_t, 1024>::Spans s = rx.pop_peek(64);
+//	send(s.ptr1, s.len1);
+//	rx.pop_consume(s.len1);
+//
+// Only one context may push, and only one may pop (for several producers
+// see MPCBUF.h).
+
+#ifndef RING_H
+#define RING_H
+
+#if !defined(__cplusplus) || __cplusplus < 201703L
+#error Ring.h requires C++17
+#endif
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+template <typename T, std::size_t N, typename Index = std::uint16_t>
+class Ring {
+	static_assert(N != 0 && (N & (N - 1)) == 0, "Ring size must be a power of 2");
+	static_assert(std::is_unsigned<Index>::value, "Ring index must be unsigned");
+	static_assert(N <= (std::size_t(std::numeric_limits<Index>::max()) + 1) / 2,
+				  "Ring size must be no more than half of the index range");
+	static_assert(std::atomic<Index>::is_always_lock_free, "Ring index must be lock free");
+
+public:
+	// Up to two spans describing entries in the ring: the first runs from
+	// the index towards the end of the storage, and the second is the part
+	// which wraps around to the start (len2 is 0 if there's no wrap).
+	struct Spans {
+		T			*ptr1;
+		std::size_t	len1;
+		T			*ptr2;
+		std::size_t	len2;
+
+		std::size_t total() const { return len1 + len2; }
+	};
+
+	static constexpr std::size_t size() { return N; }
+
+	// Number of entries waiting to be popped. Exact when called by the
+	// consumer, and a lower bound elsewhere.
+	std::size_t len() const {
+		return Index(m_put_idx.load(std::memory_order_acquire)
+					 - m_get_idx.load(std::memory_order_relaxed));
+	}
+
+	// Number of entries which can be pushed. Exact when called by the
+	// producer, and a lower bound elsewhere.
+	std::size_t space() const {
+		return N - Index(m_put_idx.load(std::memory_order_relaxed)
+						 - m_get_idx.load(std::memory_order_acquire));
+	}
+
+	bool empty() const { return len() == 0; }
+	bool full() const { return space() == 0; }
+
+	// Producer side.
+
+	bool push(const T &val) {
+		Index put = m_put_idx.load(std::memory_order_relaxed);
+		if (Index(put - m_get_idx.load(std::memory_order_acquire)) == N) {
+			return false;
+		}
+		m_entry[put & MASK] = val;
+		m_put_idx.store(Index(put + 1), std::memory_order_release);
+		return true;
+	}
+
+	// Pushes as many of the len entries as fit, and returns how many.
+	std::size_t push(const T *data, std::size_t len) {
+		Spans s = push_reserve(len);
+		copy(s.ptr1, data, s.len1);
+		copy(s.ptr2, data + s.len1, s.len2);
+		push_commit(s.total());
+		return s.total();
+	}
+
+	// Describes the free space for up to len entries, which can be filled
+	// in place and then published with push_commit.
+	Spans push_reserve(std::size_t len) {
+		Index put = m_put_idx.load(std::memory_order_relaxed);
+		std::size_t avail = N - Index(put - m_get_idx.load(std::memory_order_acquire));
+		return spans(put, len < avail ? len : avail);
+	}
+
+	void push_commit(std::size_t len) {
+		Index put = m_put_idx.load(std::memory_order_relaxed);
+		m_put_idx.store(Index(put + len), std::memory_order_release);
+	}
+
+	// Consumer side.
+
+	bool pop(T &val) {
+		Index get = m_get_idx.load(std::memory_order_relaxed);
+		if (m_put_idx.load(std::memory_order_acquire) == get) {
+			return false;
+		}
+		val = m_entry[get & MASK];
+		m_get_idx.store(Index(get + 1), std::memory_order_release);
+		return true;
+	}
+
+	// Pops up to len entries into data, and returns how many.
+	std::size_t pop(T *data, std::size_t len) {
+		Spans s = pop_peek(len);
+		copy(data, s.ptr1, s.len1);
+		copy(data + s.len1, s.ptr2, s.len2);
+		pop_consume(s.total());
+		return s.total();
+	}
+
+	// Describes up to len entries waiting to be popped, without removing
+	// them. pop_consume removes them.
+	Spans pop_peek(std::size_t len) {
+		Index get = m_get_idx.load(std::memory_order_relaxed);
+		std::size_t avail = Index(m_put_idx.load(std::memory_order_acquire) - get);
+		return spans(get, len < avail ? len : avail);
+	}
+
+	void pop_consume(std::size_t len) {
+		Index get = m_get_idx.load(std::memory_order_relaxed);
+		m_get_idx.store(Index(get + len), std::memory_order_release);
+	}
+
+	// Empties the ring. Neither side may be using it at the time.
+	void clear() {
+		m_get_idx.store(0, std::memory_order_relaxed);
+		m_put_idx.store(0, std::memory_order_relaxed);
+	}
+
+private:
+	static constexpr Index MASK = Index(N - 1);
+
+	Spans spans(Index idx, std::size_t len) {
+		std::size_t start = idx & MASK;
+		std::size_t len1 = N - start;
+		if (len1 > len) {
+			len1 = len;
+		}
+		return Spans{ &m_entry[start], len1, &m_entry[0], len - len1 };
+	}
+
+	static void copy(T *dst, const T *src, std::size_t len) {
+		if constexpr (std::is_trivially_copyable<T>::value) {
+			if (len != 0) {
+				std::memcpy(dst, src, len * sizeof(T));
+			}
+		} else {
+			for (std::size_t i = 0; i < len; i++) {
+				dst[i] = src[i];
+			}
+		}
+	}
+
+	std::atomic<Index>	m_get_idx{0};
+	std::atomic<Index>	m_put_idx{0};
+	T					m_entry[N];
+};
+
+#endif  // RING_H
@@ -0,0 +1,599 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Type safe formatting for C++ code, producing exactly the same output as
+// StrPrintf.
+//
+// The format string is wrapped with STRFMT(), which lets the compiler parse
+// it into a fixed list of operations (literal runs and conversions) when the
+// code is compiled, rather than each time it's printed. The number and types
+// of the arguments are checked against the conversions at compile time too.
+//
+//	StrFormat(buf, sizeof(buf), STRFMT("port %u: %lu bytes\n"), port, bytes);
+//	usb_vcp_format(port, STRFMT("%-8s %5d\n"), name, val);
+//
+// Argument rules (which follow what the C varargs would have been):
+//	%d %u %x %X %o %b  any integer type no bigger than an int
+//	%ld %lu %lx ...    any integer type no bigger than a long
+//	%lld %llu %llx ... any integer type no bigger than a long long
+//	%c and *           any integer type no bigger than an int
+//	%s                 anything which converts to const char *
+//	%e %E %f %F        float or double
+//
+// The %ll and float conversions are passed on to StrPrintf itself.
+
+#ifndef STRFORMAT_H
+#define STRFORMAT_H
+
+#if !defined(__cplusplus) || __cplusplus < 201703L
+#error StrFormat.h requires C++17
+#endif
+
+#include <array>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+#include "StrPrintf.h"
+#include "usb.h"
+
+// Wraps a string literal so that it can be used as a compile time format.
+#define STRFMT(str) ([] { \
+	struct StrFmtLiteral { \
+		static constexpr const char *value() { return str; } \
+	}; \
+	return StrFmtLiteral{}; \
+}())
+
+namespace strfmt {
+
+enum : uint8_t {
+	OPT_RIGHT_JUSTIFY	= 0x01,
+	OPT_ZERO_PAD		= 0x02,
+	OPT_CAPITAL_HEX		= 0x04,
+	OPT_LONG_ARG		= 0x08,
+	OPT_WIDTH_ARG		= 0x10,	// width comes from an argument (*)
+	OPT_PRECISION_ARG	= 0x20,	// precision comes from an argument (.*)
+	OPT_LONG_LONG_ARG	= 0x40,
+};
+
+// Conversions which are handed to StrXPrintf (with the text of the
+// conversion, from the % to the type, as the format) are limited to this
+// length.
+constexpr std::size_t MAX_SPEC_LEN = 31;
+
+// One step of the output. A type of 0 is a literal run of len characters
+// at offset in the format string (invalid conversions, such as %%, are
+// turned into a literal run of the conversion character). For conversions,
+// offset and len cover the whole conversion, starting at the %.
+struct Op {
+	char		type;
+	uint8_t		options;
+	uint8_t		base;
+	short		width;
+	short		precision;
+	uint16_t	offset;
+	uint16_t	len;
+};
+
+enum class ArgKind : uint8_t {
+	Star,
+	Signed,
+	Unsigned,
+	SignedLong,
+	UnsignedLong,
+	Char,
+	String,
+	LongLong,
+	UnsignedLongLong,
+	Float,
+};
+
+// Parses fmt using the same grammar as vStrXPrintf, calling emit for each
+// operation: %[-][#][0][width|*][.precision|*][l|ll]type
+template <typename Emit>
+constexpr void parse(const char *fmt, Emit &&emit) {
+	std::size_t i = 0;
+
+	while (fmt[i] != '\0') {
+		if (fmt[i] != '%') {
+			std::size_t start = i;
+			while (fmt[i] != '\0' && fmt[i] != '%') {
+				i++;
+			}
+			emit(Op{0, 0, 0, 0, -1, uint16_t(start), uint16_t(i - start)});
+			continue;
+		}
+
+		Op op{0, OPT_RIGHT_JUSTIFY, 0, 0, -1, uint16_t(i), 0};
+		i++;
+		if (fmt[i] == '-') {
+			op.options &= ~OPT_RIGHT_JUSTIFY;
+			i++;
+		}
+		if (fmt[i] == '#') {
+			// Only means anything to the float conversions, which pass it
+			// on to StrPrintf.
+			i++;
+		}
+		if (fmt[i] == '0') {
+			op.options |= OPT_ZERO_PAD;
+			i++;
+		}
+		if (fmt[i] == '*') {
+			op.options |= OPT_WIDTH_ARG;
+			i++;
+		} else {
+			while (fmt[i] >= '0' && fmt[i] <= '9') {
+				op.width = short(op.width * 10 + fmt[i] - '0');
+				i++;
+			}
+		}
+		if (fmt[i] == '.') {
+			i++;
+			if (fmt[i] == '*') {
+				op.options |= OPT_PRECISION_ARG;
+				i++;
+			} else {
+				op.precision = 0;
+				while (fmt[i] >= '0' && fmt[i] <= '9') {
+					op.precision = short(op.precision * 10 + fmt[i] - '0');
+					i++;
+				}
+			}
+		}
+		if (fmt[i] == 'l') {
+			op.options |= OPT_LONG_ARG;
+			i++;
+			if (fmt[i] == 'l') {
+				op.options |= OPT_LONG_LONG_ARG;
+				i++;
+			}
+		}
+
+		char c = fmt[i];
+		switch (c) {
+			case 'd': case 'u': op.base = 10; break;
+			case 'x': op.base = 16; break;
+			case 'X': op.base = 16; op.options |= OPT_CAPITAL_HEX; break;
+			case 'o': op.base = 8; break;
+			case 'b': op.base = 2; break;
+			case 'c': case 's': op.options &= ~OPT_ZERO_PAD; break;
+			default: break;
+		}
+		bool is_float = (c == 'e' || c == 'E' || c == 'f' || c == 'F'
+				 || c == 'r' || c == 'R');
+		if (op.base != 0 || c == 'c' || c == 's' || is_float) {
+			op.type = c;
+			i++;
+			op.len = uint16_t(i - op.offset);
+		} else {
+			// Invalid conversion: output the character (if there is one).
+			op.offset = uint16_t(i);
+			if (c != '\0') {
+				op.len = 1;
+				i++;
+			}
+		}
+		emit(op);
+	}
+}
+
+template <typename Fmt>
+constexpr std::size_t num_ops() {
+	std::size_t n = 0;
+	parse(Fmt::value(), [&n](const Op &) { n++; });
+	return n;
+}
+
+template <typename Fmt>
+constexpr std::array<Op, num_ops<Fmt>()> ops() {
+	std::array<Op, num_ops<Fmt>()> ops{};
+	std::size_t n = 0;
+	parse(Fmt::value(), [&ops, &n](const Op &op) { ops[n++] = op; });
+	return ops;
+}
+
+// Calls emit with the kind of each argument which op consumes.
+template <typename Emit>
+constexpr void op_args(const Op &op, Emit &&emit) {
+	if (op.options & OPT_WIDTH_ARG) {
+		emit(ArgKind::Star);
+	}
+	if (op.options & OPT_PRECISION_ARG) {
+		emit(ArgKind::Star);
+	}
+	bool long_arg = (op.options & OPT_LONG_ARG) != 0;
+	bool long_long_arg = (op.options & OPT_LONG_LONG_ARG) != 0;
+	switch (op.type) {
+		case 'd':
+			emit(long_long_arg ? ArgKind::LongLong
+				 : long_arg ? ArgKind::SignedLong : ArgKind::Signed);
+			break;
+		case 'u': case 'x': case 'X': case 'o': case 'b':
+			emit(long_long_arg ? ArgKind::UnsignedLongLong
+				 : long_arg ? ArgKind::UnsignedLong : ArgKind::Unsigned);
+			break;
+		case 'e': case 'E': case 'f': case 'F': case 'r': case 'R':
+			emit(ArgKind::Float);
+			break;
+		case 'c':
+			emit(ArgKind::Char);
+			break;
+		case 's':
+			emit(ArgKind::String);
+			break;
+		default:
+			break;
+	}
+}
+
+template <typename Fmt>
+constexpr std::size_t num_args() {
+	std::size_t n = 0;
+	for (const Op &op : ops<Fmt>()) {
+		op_args(op, [&n](ArgKind) { n++; });
+	}
+	return n;
+}
+
+template <typename Fmt>
+constexpr std::array<ArgKind, num_args<Fmt>()> arg_kinds() {
+	std::array<ArgKind, num_args<Fmt>()> kinds{};
+	std::size_t n = 0;
+	for (const Op &op : ops<Fmt>()) {
+		op_args(op, [&kinds, &n](ArgKind kind) { kinds[n++] = kind; });
+	}
+	return kinds;
+}
+
+// Whether the conversion is passed on to StrXPrintf.
+constexpr bool delegated(const Op &op) {
+	return ((op.options & OPT_LONG_LONG_ARG) && op.base != 0)
+		|| op.type == 'e' || op.type == 'E' || op.type == 'f' || op.type == 'F'
+		|| op.type == 'r' || op.type == 'R';
+}
+
+template <typename Fmt>
+constexpr bool specs_fit() {
+	for (const Op &op : ops<Fmt>()) {
+		if (op.type != 0 && delegated(op) && op.len > MAX_SPEC_LEN) {
+			return false;
+		}
+	}
+	return true;
+}
+
+template <ArgKind K, typename T>
+constexpr bool arg_ok() {
+	if constexpr (K == ArgKind::String) {
+		return std::is_convertible_v<T, const char *>;
+	} else if constexpr (K == ArgKind::Float) {
+		return std::is_floating_point_v<T> && sizeof(T) <= sizeof(double);
+	} else if constexpr (K == ArgKind::LongLong || K == ArgKind::UnsignedLongLong) {
+		return std::is_integral_v<T> && sizeof(T) <= sizeof(long long);
+	} else if constexpr (K == ArgKind::SignedLong || K == ArgKind::UnsignedLong) {
+		return std::is_integral_v<T> && sizeof(T) <= sizeof(long);
+	} else {
+		return std::is_integral_v<T> && sizeof(T) <= sizeof(int);
+	}
+}
+
+// Each argument, converted the same way that va_arg in vStrXPrintf would
+// have done it.
+union Arg {
+	unsigned long		u;
+	unsigned long long	ull;
+	double				d;
+	const char			*s;
+};
+
+template <ArgKind K, typename T>
+inline Arg make_arg(T val) {
+	static_assert(arg_ok<K, T>(), "StrFormat: argument type doesn't match the format");
+	Arg arg;
+	if constexpr (!arg_ok<K, T>()) {
+		arg.u = 0;
+	} else if constexpr (K == ArgKind::String) {
+		arg.s = val;
+	} else if constexpr (K == ArgKind::Float) {
+		arg.d = val;
+	} else if constexpr (K == ArgKind::LongLong) {
+		arg.ull = (unsigned long long)(long long)val;
+	} else if constexpr (K == ArgKind::UnsignedLongLong) {
+		arg.ull = (unsigned long long)val;
+	} else if constexpr (K == ArgKind::Signed || K == ArgKind::Star || K == ArgKind::Char) {
+		arg.u = (unsigned long)(int)val;
+	} else if constexpr (K == ArgKind::Unsigned) {
+		arg.u = (unsigned)val;
+	} else if constexpr (K == ArgKind::SignedLong) {
+		arg.u = (unsigned long)(long)val;
+	} else {
+		arg.u = (unsigned long)val;
+	}
+	return arg;
+}
+
+inline constexpr char decimal_pairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+// Keeps track of the number of characters output, using the same rules as
+// vStrXPrintf and vStrXPrintfChunk.
+class Output {
+public:
+	Output(StrXPrintfFunc out_func, StrXPrintfChunkFunc chunk_func, void *out_parm)
+		: m_out_func(out_func), m_chunk_func(chunk_func), m_out_parm(out_parm) {}
+
+	int count() const { return m_count; }
+
+	// Formats a single conversion using StrXPrintf.
+	template <typename... A>
+	void printf(const char *spec, A... args) {
+		if (m_count < 0) {
+			return;
+		}
+		int n = (m_chunk_func != nullptr)
+			  ? StrXPrintfChunk(m_chunk_func, m_out_parm, spec, args...)
+			  : StrXPrintf(m_out_func, m_out_parm, spec, args...);
+		m_count = (n >= 0) ? m_count + n : n;
+	}
+
+	void run(const char *s, int len) {
+		if (len <= 0) {
+			return;
+		}
+		if (m_chunk_func == nullptr) {
+			while (--len >= 0 && m_count >= 0) {
+				int n = m_out_func(m_out_parm, *s++);
+				m_count = (n >= 0) ? m_count + 1 : n;
+			}
+			return;
+		}
+		if (m_count >= 0) {
+			int n = m_chunk_func(m_out_parm, s, len);
+			m_count = (n >= 0) ? m_count + n : n;
+		}
+	}
+
+	void pad(char c, int len) {
+		static const char spaces[] = "                ";
+		static const char zeros[]  = "0000000000000000";
+		const char *pad = (c == '0') ? zeros : spaces;
+
+		while (len > 0) {
+			int n = len < int(sizeof(spaces) - 1) ? len : int(sizeof(spaces) - 1);
+			run(pad, n);
+			len -= n;
+		}
+	}
+
+	// Same as OutputField in StrPrintf.c
+	void field(uint8_t options, bool minus, short width, short leading_zeros,
+			   const char *s, short len) {
+		short pad_len = width - leading_zeros - len;
+
+		if (minus) {
+			if (options & OPT_ZERO_PAD) {
+				run("-", 1);
+			}
+			pad_len--;
+		}
+		if (options & OPT_RIGHT_JUSTIFY) {
+			pad((options & OPT_ZERO_PAD) ? '0' : ' ', pad_len);
+			pad_len = 0;
+		}
+		if (minus && !(options & OPT_ZERO_PAD)) {
+			run("-", 1);
+		}
+		pad('0', leading_zeros);
+		run(s, len);
+		pad(' ', pad_len);
+	}
+
+private:
+	StrXPrintfFunc		m_out_func;
+	StrXPrintfChunkFunc	m_chunk_func;
+	void				*m_out_parm;
+	int					m_count = 0;
+};
+
+inline void number(Output &out, const Op &op, short width, short precision,
+				   unsigned long x) {
+	char buffer[CHAR_BIT * sizeof(unsigned long) + 1];
+	char *end = buffer + sizeof(buffer);
+	char *s = end;
+	bool minus = false;
+
+	if (op.type == 'd' && (long)x < 0) {
+		minus = true;
+		x = -(long)x;
+	}
+	if (op.base == 10) {
+		while (x >= 100) {
+			unsigned long q = x / 100;
+			const char *pair = &decimal_pairs[(x - q * 100) * 2];
+			*--s = pair[1];
+			*--s = pair[0];
+			x = q;
+		}
+		if (x >= 10) {
+			*--s = decimal_pairs[x * 2 + 1];
+			*--s = decimal_pairs[x * 2];
+		} else {
+			*--s = char('0' + x);
+		}
+	} else {
+		const char *digits = (op.options & OPT_CAPITAL_HEX) ? "0123456789ABCDEF"
+															: "0123456789abcdef";
+		int shift = op.base == 16 ? 4 : op.base == 8 ? 3 : 1;
+		unsigned long mask = (1ul << shift) - 1;
+		do {
+			*--s = digits[x & mask];
+			x >>= shift;
+		} while (x != 0);
+	}
+
+	short len = short(end - s);
+	short leading_zeros = (precision >= 0 && precision > len) ? short(precision - len) : 0;
+	out.field(op.options, minus, width, leading_zeros, s, len);
+}
+
+// Hands a %ll or float conversion to StrXPrintf, along with any * arguments.
+template <typename T>
+inline void delegate(Output &out, const Op &op, const char *fmt,
+					 int width, int precision, T val) {
+	char spec[MAX_SPEC_LEN + 1];
+
+	memcpy(spec, fmt + op.offset, op.len);
+	spec[op.len] = '\0';
+	if ((op.options & OPT_WIDTH_ARG) && (op.options & OPT_PRECISION_ARG)) {
+		out.printf(spec, width, precision, val);
+	} else if (op.options & OPT_WIDTH_ARG) {
+		out.printf(spec, width, val);
+	} else if (op.options & OPT_PRECISION_ARG) {
+		out.printf(spec, precision, val);
+	} else {
+		out.printf(spec, val);
+	}
+}
+
+template <typename Fmt>
+int emit(Output &out, const Arg *argv) {
+	static constexpr auto fmt_ops = ops<Fmt>();
+	const char *fmt = Fmt::value();
+
+	for (const Op &op : fmt_ops) {
+		short width = op.width;
+		short precision = op.precision;
+
+		if (op.options & OPT_WIDTH_ARG) {
+			width = short((argv++)->u);
+		}
+		if (op.options & OPT_PRECISION_ARG) {
+			precision = short((argv++)->u);
+		}
+		if (op.type == 0) {
+			out.run(fmt + op.offset, op.len);
+		} else if (op.type == 'e' || op.type == 'E' || op.type == 'f' || op.type == 'F'
+			   || op.type == 'r' || op.type == 'R') {
+			delegate(out, op, fmt, width, precision, (argv++)->d);
+		} else if ((op.options & OPT_LONG_LONG_ARG) && op.base != 0) {
+			delegate(out, op, fmt, width, precision, (argv++)->ull);
+		} else if (op.type == 'c') {
+			char c = char((argv++)->u);
+			out.field(op.options, false, width, 0, &c, 1);
+		} else if (op.type == 's') {
+			const char *str = (argv++)->s;
+			short len = 0;
+			while (str[len] != '\0' && !(precision >= 0 && len >= precision)) {
+				len++;
+			}
+			out.field(op.options, false, width, 0, str, len);
+		} else {
+			number(out, op, width, precision, (argv++)->u);
+		}
+	}
+	return out.count();
+}
+
+template <typename Fmt, typename... Args, std::size_t... I>
+int format(Output &out, std::index_sequence<I...>, Args... args) {
+	[[maybe_unused]] static constexpr auto kinds = arg_kinds<Fmt>();
+	const Arg argv[sizeof...(Args) + 1] = { make_arg<kinds[I]>(args)..., Arg{0} };
+	return emit<Fmt>(out, argv);
+}
+
+template <typename Fmt, typename... Args>
+int format(Output &out, Args... args) {
+	static_assert(num_args<Fmt>() == sizeof...(Args),
+				  "StrFormat: wrong number of arguments for the format");
+	static_assert(specs_fit<Fmt>(), "StrFormat: conversion is too long");
+	if constexpr (num_args<Fmt>() == sizeof...(Args)) {
+		return format<Fmt>(out, std::index_sequence_for<Args...>{}, args...);
+	} else {
+		return -1;
+	}
+}
+
+struct BufParms {
+	char	*str;
+	int		max_len;
+};
+
+// Same as StrPrintfFunc in StrPrintf.c
+inline int buf_chunk(void *out_parm, const char *s, int len) {
+	BufParms *parms = static_cast<BufParms *>(out_parm);
+	int n = len < parms->max_len ? len : parms->max_len;
+
+	if (n > 0) {
+		memcpy(parms->str, s, n);
+		parms->str += n;
+		*parms->str = '\0';
+		parms->max_len -= n;
+	}
+	return (n < len) ? -1 : n;
+}
+
+inline int vcp_chunk(void *out_parm, const char *s, int len) {
+	usb_vcp_send_strn_cooked(*static_cast<unsigned *>(out_parm), s, len);
+	return len;
+}
+
+}  // namespace strfmt
+
+// C++ equivalent of StrPrintf.
+template <typename Fmt, typename... Args>
+int StrFormat(char *out_str, int max_len, Fmt, Args... args) {
+	strfmt::BufParms parms = { out_str, max_len - 1 };
+	strfmt::Output out(nullptr, strfmt::buf_chunk, &parms);
+	return strfmt::format<Fmt>(out, args...);
+}
+
+// C++ equivalent of StrXPrintf.
+template <typename Fmt, typename... Args>
+int StrXFormat(StrXPrintfFunc out_func, void *out_parm, Fmt, Args... args) {
+	strfmt::Output out(out_func, nullptr, out_parm);
+	return strfmt::format<Fmt>(out, args...);
+}
+
+// C++ equivalent of StrXPrintfChunk.
+template <typename Fmt, typename... Args>
+int StrXFormatChunk(StrXPrintfChunkFunc out_func, void *out_parm, Fmt, Args... args) {
+	strfmt::Output out(nullptr, out_func, out_parm);
+	return strfmt::format<Fmt>(out, args...);
+}
+
+// C++ equivalent of usb_vcp_printf, which writes into the port's TX ring.
+template <typename Fmt, typename... Args>
+void usb_vcp_format(unsigned port, Fmt, Args... args) {
+	strfmt::Output out(nullptr, strfmt::vcp_chunk, &port);
+	strfmt::format<Fmt>(out, args...);
+}
+
+#endif  // STRFORMAT_H
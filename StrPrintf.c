@@ -37,6 +37,7 @@
 
 #include "StrPrintf.h"
 #include <limits.h>
+#include <stdint.h>
 #include <string.h>
 
 #if defined( AVR )
@@ -53,12 +54,24 @@
 #define StrXPrintf  StrXPrintf_P
 #define vStrXPrintf vStrXPrintf_P
 
+#define StrXPrintfChunk  StrXPrintfChunk_P
+#define vStrXPrintfChunk vStrXPrintfChunk_P
+
 #else
 
 #define pgm_read_byte( addr )  *addr
 
 #endif
 
+/*
+ * Set STR_PRINTF_FLOAT to 0 to leave out %e and %f support, to save code
+ * space.
+ */
+
+#if !defined( STR_PRINTF_FLOAT )
+#define STR_PRINTF_FLOAT    1
+#endif
+
 /* ---- Public Variables ------------------------------------------------- */
 /* ---- Private Constants and Types -------------------------------------- */
 
@@ -77,7 +90,8 @@ typedef enum
     MINUS_SIGN = 0x01,      /**< Should we print a minus sign?              */
     RIGHT_JUSTIFY = 0x02,   /**< Should field be right justified?           */
     ZERO_PAD = 0x04,        /**< Should field be zero padded?               */
-    CAPITAL_HEX = 0x08      /**< Did we encounter %X?                       */
+    CAPITAL_HEX = 0x08,     /**< Did we encounter %X?                       */
+    ALT_FORM = 0x10         /**< Did we encounter the # flag?               */
 } FmtOption;
 
 /** @def IsOptionSet( p, x )   Determines if an option has been set.       */
@@ -90,6 +104,37 @@ typedef enum
 #define  SetOption( p, x )       (p)->options = (FmtOption)((p)->options |  (x))
 #define  ClearOption( p, x )     (p)->options = (FmtOption)((p)->options & ~(x))
 
+#if STR_PRINTF_FLOAT
+
+/** Larger precisions for %e and %f are treated as this.                    */
+#define FLOAT_MAX_PRECISION 50
+
+/** Maximum number of significant digits produced for a float (up to 39
+ *  before the decimal point plus the precision).                         */
+#define FLOAT_MAX_DIGITS    (39 + FLOAT_MAX_PRECISION + 1)
+
+/** Size of the buffer used to format a float.                             */
+#define FLOAT_BUFFER_SIZE   (FLOAT_MAX_DIGITS + 8)
+
+/** Number of 32 bit words in a BigNum. The largest value needed to format
+ *  a float exactly is a little over 2^155, and BigShift needs one word
+ *  of headroom.                                                          */
+#define BIGNUM_WORDS        7
+
+/**
+ * Unsigned big number used to format floats exactly. Least significant
+ * word first.
+ */
+
+typedef struct
+{
+    int len;                        /**< Number of words in use.           */
+    uint32_t word[BIGNUM_WORDS];
+
+} BigNum;
+
+#endif  /* STR_PRINTF_FLOAT */
+
 /**
  * Internal structure which is used to allow vStrXPrintf() to be reentrant.
  */
@@ -114,6 +159,10 @@ typedef struct
    /** The function to call to perform the actual output.                  */
     StrXPrintfFunc outFunc;
 
+   /** The function to call to output runs of characters. If this is set,
+    *  then outFunc isn't used.                                            */
+    StrXPrintfChunkFunc chunkFunc;
+
    /** Parameter to pass to the output function.                           */
     void *outParm;
 
@@ -130,11 +179,48 @@ typedef struct
 } StrPrintfParms;
 
 /* ---- Private Variables ------------------------------------------------ */
+
+/** Digit pairs 00 thru 99, used to convert decimal numbers two digits at a time. */
+static const char decimalPairs[200] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const char lowerDigits[] = "0123456789abcdef";
+static const char upperDigits[] = "0123456789ABCDEF";
+
 /* ---- Private Function Prototypes -------------------------------------- */
 
+static int DoPrintf(StrXPrintfFunc outFunc, StrXPrintfChunkFunc chunkFunc,
+                    void *outParm, const char *fmt, va_list args);
 static void OutputChar(Parameters * p, int c);
+static void OutputRun(Parameters * p, const char *s, int len);
+static void OutputPad(Parameters * p, int c, int len);
 static void OutputField(Parameters * p, char *s);
-static int StrPrintfFunc(void *outParm, int ch);
+static int FormatDecimal(char *end, unsigned long x);
+static int FormatPow2(char *end, unsigned long x, int shift, int capital);
+static int FormatDecimalLL(char *end, unsigned long long x);
+static int FormatPow2LL(char *end, unsigned long long x, int shift, int capital);
+#if STR_PRINTF_FLOAT
+static void BigSet(BigNum * a, uint32_t val);
+static void BigMul(BigNum * a, uint32_t mul);
+static void BigShift(BigNum * a, int shift);
+static void BigMulPow10(BigNum * a, int exp10);
+static int BigCmp(const BigNum * a, const BigNum * b);
+static int BigCmpSum(const BigNum * a, const BigNum * b, const BigNum * c);
+static void BigSub(BigNum * a, const BigNum * b);
+static int BigDivDigit(BigNum * r, const BigNum sMul[4]);
+static int FloatDigits(uint32_t bits, int fixed, int precision, char *digits, int *exp10);
+static int FormatFloat(Parameters * p, char *buf, float val, char type, int precision);
+#endif
+static int StrPrintfFunc(void *outParm, const char *s, int len);
 
 /** @} */
 
@@ -218,10 +304,61 @@ vStrPrintf(char *outStr, int maxLen, const char *fmt, va_list args)
     strParm.str = outStr;
     strParm.maxLen = maxLen - 1;        /* Leave space for temrinating null char   */
 
-    return vStrXPrintf(StrPrintfFunc, &strParm, fmt, args);
+    return vStrXPrintfChunk(StrPrintfFunc, &strParm, fmt, args);
 
 } // vStrPrintf
 
+/***************************************************************************/
+/**
+*  Generic printf function which writes formatted data by calling a user
+*  supplied function with runs of characters.
+*
+*  @param   outFunc  (in)  Pointer to function to call to do the actual output.
+*  @param   outParm  (in)  Passed to @a outFunc.
+*  @param   fmt      (in)  Format string (see vStrXPrintf() for sull details).
+*/
+
+int
+StrXPrintfChunk(StrXPrintfChunkFunc outFunc, void *outParm, const char *fmt, ...)
+{
+    int rc;
+    va_list args;
+
+    va_start(args, fmt);
+    rc = vStrXPrintfChunk(outFunc, outParm, fmt, args);
+    va_end(args);
+
+    return rc;
+
+} // StrXPrintfChunk
+
+/***************************************************************************/
+/**
+*  Like vStrXPrintf(), but @a outFunc is called with runs of characters
+*  (literal spans of the format string, whole formatted fields, and runs of
+*  padding) so that it can copy them in bulk.
+*
+*  @a outFunc returns the number of characters it accepted. If it returns a
+*  negative number, then vStrXPrintfChunk will stop calling @a outFunc and
+*  will return the negative value.
+*
+*  @param   outFunc     (in) Pointer to function to call to output characters.
+*  @param   outParm     (in) Passed to @a outFunc.
+*  @param   fmt         (in) Format string (see vStrXPrintf()).
+*  @param   args        (in) Variable length list of arguments.
+*
+*  @return  The number of characters successfully output, or a negative number
+*           if an error occurred.
+*/
+
+int
+vStrXPrintfChunk(StrXPrintfChunkFunc outFunc, void *outParm, const char *fmt,
+                 va_list args)
+{
+    return DoPrintf(NULL, outFunc, outParm, fmt, args);
+
+} // vStrXPrintfChunk
+
 /***************************************************************************/
 /**
 *  Generic, reentrant printf function. This is the workhorse of the StrPrintf
@@ -249,7 +386,7 @@ vStrPrintf(char *outStr, int maxLen, const char *fmt, va_list args)
 *  A format specification has optional, and required fields, in the following
 *  form:
 *
-*     %[flags][width][.precision][l]type
+*     %[flags][width][.precision][l|ll]type
 *
 *  Each field of the format specification is a single character or a number
 *  specifying a particular format option. The simplest format specification
@@ -264,6 +401,8 @@ vStrPrintf(char *outStr, int maxLen, const char *fmt, va_list args)
 *  @b flags may be one of the following:
 *
 *  - - (minus sign) left align the result within the given field width.
+*  - # (hash) For e, E, f, F, r and R, always print a decimal point, even
+*    when no digits follow it (as in C). It's ignored otherwise.
 *  - 0 (zero) Zeros are added until the minimum width is reached.
 *
 *  @b width may be one of the following:
@@ -287,16 +426,29 @@ vStrPrintf(char *outStr, int maxLen, const char *fmt, va_list args)
 *    @a prcision.
 *  - For s, the precision specifies the maximum number of characters to be
 *    printed.
+*  - For e, E, f, F, the precision specifies the number of digits after
+*    the decimal point (values are correctly rounded, with halfway cases
+*    going to even). As in the C library, the default precision is 6.
+*    Precisions above 50 are treated as 50. The argument is a double (as
+*    usual), but it's converted to a float for formatting.
+*  - For r and R, the precision is ignored.
 *
 *  The optional type modifier l (lowercase ell), may be used to specify
 *  that the argument is a long argument. This makes a difference on
 *  architectures where the sizeof an int is different from the sizeof a long.
+*  The type modifier ll specifies a long long argument.
 *
 *  @b type causes the output to be formatted as follows:
 *  - b Unsigned binary integer.
 *  - c Character.
 *  - d Signed decimal integer.
+*  - e Float in the form [-]d.ddde+dd (E uses an upper case E).
+*  - f Float in the form [-]ddd.ddd (F prints INF and NAN in upper case).
 *  - o Unsigned octal integer.
+*  - r Float in the form [-]ddd.ddd, using the shortest string of digits
+*    which reads back as the same single precision float (so 0.1f prints
+*    as 0.1 rather than 0.100000). This isn't a C conversion.
+*  - R Like r, but in the form [-]d.ddde+dd.
 *  - s Null terminated character string.
 *  - u Unsigned Decimal integer.
 *  - x Unsigned hexadecimal integer, using "abcdef".
@@ -312,12 +464,42 @@ vStrPrintf(char *outStr, int maxLen, const char *fmt, va_list args)
 */
 
 int vStrXPrintf(StrXPrintfFunc outFunc, void *outParm, const char *fmt, va_list args)
+{
+    return DoPrintf(outFunc, NULL, outParm, fmt, args);
+
+} // vStrXPrintf
+
+/** @} */
+
+/**
+ * @addtogroup StrPrintfInternal
+ * @{
+ */
+
+/***************************************************************************/
+/**
+*  Does the actual formatting for vStrXPrintf() and vStrXPrintfChunk().
+*
+*  @param   outFunc    (in) Per character output function (or NULL).
+*  @param   chunkFunc  (in) Chunked output function (or NULL).
+*  @param   outParm    (in) Passed to the output function.
+*  @param   fmt        (in) Format string.
+*  @param   args       (in) Variable length list of arguments.
+*
+*  @return  The number of characters successfully output, or a negative number
+*           if an error occurred.
+*/
+
+static int
+DoPrintf(StrXPrintfFunc outFunc, StrXPrintfChunkFunc chunkFunc,
+         void *outParm, const char *fmt, va_list args)
 {
     Parameters p;
     char controlChar;
 
     p.numOutputChars = 0;
     p.outFunc = outFunc;
+    p.chunkFunc = chunkFunc;
     p.outParm = outParm;
 
     controlChar = pgm_read_byte(fmt++);
@@ -344,6 +526,11 @@ int vStrXPrintf(StrXPrintfFunc outFunc, void *outParm, const char *fmt, va_list
                 controlChar = pgm_read_byte(fmt++);
             }
 
+            if (controlChar == '#') {
+                SetOption(&p, ALT_FORM);
+                controlChar = pgm_read_byte(fmt++);
+            }
+
             if (controlChar == '0') {
                 SetOption(&p, ZERO_PAD);
                 controlChar = pgm_read_byte(fmt++);
@@ -388,6 +575,10 @@ int vStrXPrintf(StrXPrintfFunc outFunc, void *outParm, const char *fmt, va_list
             if (controlChar == 'l') {
                 longArg = 1;
                 controlChar = pgm_read_byte(fmt++);
+                if (controlChar == 'l') {
+                    longArg = 2;
+                    controlChar = pgm_read_byte(fmt++);
+                }
             }
 
             /*
@@ -413,6 +604,12 @@ int vStrXPrintf(StrXPrintfFunc outFunc, void *outParm, const char *fmt, va_list
             } else if (controlChar == 's') {
                 base = -2;
                 ClearOption(&p, ZERO_PAD);
+#if STR_PRINTF_FLOAT
+            } else if ((controlChar == 'e') || (controlChar == 'E')
+                       || (controlChar == 'f') || (controlChar == 'F')
+                       || (controlChar == 'r') || (controlChar == 'R')) {
+                base = -3;
+#endif
             }
 
             if (base == 0) {    /* invalid conversion type */
@@ -442,6 +639,57 @@ int vStrXPrintf(StrXPrintfFunc outFunc, void *outParm, const char *fmt, va_list
                         p.editedStringLen++;
                     }
                     OutputField(&p, string);
+#if STR_PRINTF_FLOAT
+                } else if (base == -3) {        /* conversion type e or f */
+                    char buffer[FLOAT_BUFFER_SIZE];
+
+                    /*
+                     * Floats are promoted to double when passed through
+                     * the ..., and then formatted in single precision.
+                     */
+
+                    float val = (float) va_arg(args, double);
+
+                    /*
+                     * As in C, the default precision is 6. r and R are
+                     * formatted like f and e, but always use the shortest
+                     * representation.
+                     */
+
+                    if (controlChar == 'r') {
+                        controlChar = 'f';
+                        precision = -1;
+                    } else if (controlChar == 'R') {
+                        controlChar = 'e';
+                        precision = -1;
+                    } else if (precision < 0) {
+                        precision = 6;
+                    }
+                    p.editedStringLen = FormatFloat(&p, buffer, val, controlChar, precision);
+                    OutputField(&p, buffer);
+#endif
+                } else if (longArg == 2) {      /* conversion type lld, llb, llo or llx */
+                    unsigned long long x;
+                    char buffer[CHAR_BIT * sizeof(unsigned long long) + 1];
+
+                    x = va_arg(args, unsigned long long);
+                    if ((controlChar == 'd') && ((long long) x < 0)) {
+                        SetOption(&p, MINUS_SIGN);
+                        x = -(long long) x;
+                    }
+
+                    if (base == 10) {
+                        p.editedStringLen = FormatDecimalLL(buffer + sizeof(buffer), x);
+                    } else {
+                        p.editedStringLen = FormatPow2LL(buffer + sizeof(buffer), x,
+                                                         base == 16 ? 4 : base == 8 ? 3 : 1,
+                                                         IsOptionSet(&p, CAPITAL_HEX));
+                    }
+
+                    if ((precision >= 0) && (precision > p.editedStringLen)) {
+                        p.leadingZeros = precision - p.editedStringLen;
+                    }
+                    OutputField(&p, buffer + sizeof(buffer) - p.editedStringLen);
                 } else {        /* conversion type d, b, o or x */
                     unsigned long x;
 
@@ -452,7 +700,6 @@ int vStrXPrintf(StrXPrintfFunc outFunc, void *outParm, const char *fmt, va_list
 
                     char buffer[CHAR_BIT * sizeof(unsigned long) + 1];
 
-                    p.editedStringLen = 0;
                     if (longArg) {
                         x = va_arg(args, unsigned long);
                     } else if (controlChar == 'd') {
@@ -466,19 +713,13 @@ int vStrXPrintf(StrXPrintfFunc outFunc, void *outParm, const char *fmt, va_list
                         x = -(long) x;
                     }
 
-                    do {
-                        int c;
-                        c = x % base + '0';
-                        if (c > '9') {
-                            if (IsOptionSet(&p, CAPITAL_HEX)) {
-                                c += 'A' - '9' - 1;
-                            } else {
-                                c += 'a' - '9' - 1;
-                            }
-                        }
-                        buffer[sizeof(buffer) - 1 - p.editedStringLen++] = (char) c;
+                    if (base == 10) {
+                        p.editedStringLen = FormatDecimal(buffer + sizeof(buffer), x);
+                    } else {
+                        p.editedStringLen = FormatPow2(buffer + sizeof(buffer), x,
+                                                       base == 16 ? 4 : base == 8 ? 3 : 1,
+                                                       IsOptionSet(&p, CAPITAL_HEX));
                     }
-                    while ((x /= base) != 0);
 
                     if ((precision >= 0) && (precision > p.editedStringLen)) {
                         p.leadingZeros = precision - p.editedStringLen;
@@ -489,24 +730,26 @@ int vStrXPrintf(StrXPrintfFunc outFunc, void *outParm, const char *fmt, va_list
             }
         } else {
             /*
-             * We're not processing a % output. Just output the character that
-             * was encountered.
+             * We're not processing a % output. Output the run of ordinary
+             * characters up to the next % (or the end of the string).
              */
 
+#if defined( AVR )
             OutputChar(&p, controlChar);
             controlChar = pgm_read_byte(fmt++);
+#else
+            const char *run = fmt - 1;
+
+            while ((controlChar != '%') && (controlChar != '\0')) {
+                controlChar = pgm_read_byte(fmt++);
+            }
+            OutputRun(&p, run, fmt - 1 - run);
+#endif
         }
     }
     return p.numOutputChars;
 
-} // vStrXPrintf
-
-/** @} */
-
-/**
- * @addtogroup StrPrintfInternal
- * @{
- */
+} // DoPrintf
 
 /***************************************************************************/
 /**
@@ -520,6 +763,12 @@ int vStrXPrintf(StrXPrintfFunc outFunc, void *outParm, const char *fmt, va_list
 static void
 OutputChar(Parameters * p, int c)
 {
+    if (p->chunkFunc != NULL) {
+        char ch = (char) c;
+
+        OutputRun(p, &ch, 1);
+        return;
+    }
     if (p->numOutputChars >= 0) {
         int n = (*p->outFunc) (p->outParm, c);
 
@@ -532,6 +781,68 @@ OutputChar(Parameters * p, int c)
 
 } // OutputChar
 
+/***************************************************************************/
+/**
+*  Outputs a run of characters, keeping track of how many characters have
+*  been output. Chunked sinks get the whole run in one call.
+*
+*  @param   p     (mod) State information.
+*  @param   s     (in)  Characters to output.
+*  @param   len   (in)  Number of characters to output.
+*/
+
+static void
+OutputRun(Parameters * p, const char *s, int len)
+{
+    if (len <= 0) {
+        return;
+    }
+    if (p->chunkFunc == NULL) {
+        while (--len >= 0) {
+            OutputChar(p, *s++);
+        }
+        return;
+    }
+    if (p->numOutputChars >= 0) {
+        int n = (*p->chunkFunc) (p->outParm, s, len);
+
+        if (n >= 0) {
+            p->numOutputChars += n;
+        } else {
+            p->numOutputChars = n;
+        }
+    }
+
+} // OutputRun
+
+/***************************************************************************/
+/**
+*  Outputs @a len copies of the padding character @a c.
+*
+*  @param   p     (mod) State information.
+*  @param   c     (in)  Padding character (either '0' or ' ').
+*  @param   len   (in)  Number of characters to output.
+*/
+
+static void
+OutputPad(Parameters * p, int c, int len)
+{
+    static const char spaces[] = "                ";
+    static const char zeros[]  = "0000000000000000";
+    const char *pad = (c == '0') ? zeros : spaces;
+
+    while (len > 0) {
+        int n = len;
+
+        if (n > (int) sizeof(spaces) - 1) {
+            n = sizeof(spaces) - 1;
+        }
+        OutputRun(p, pad, n);
+        len -= n;
+    }
+
+} // OutputPad
+
 /***************************************************************************/
 /**
 *  Outputs a formatted field. This routine assumes that the field has been
@@ -570,9 +881,8 @@ OutputField(Parameters * p, char *s)
          * Right justified: Output the spaces then the field.
          */
 
-        while (--padLen >= 0) {
-            OutputChar(p, p->options & ZERO_PAD ? '0' : ' ');
-        }
+        OutputPad(p, p->options & ZERO_PAD ? '0' : ' ', padLen);
+        padLen = 0;
     }
     if (IsOptionSet(p, MINUS_SIGN) && IsOptionClear(p, ZERO_PAD)) {
         /*
@@ -587,58 +897,720 @@ OutputField(Parameters * p, char *s)
      * Output any leading zeros.
      */
 
-    while (--p->leadingZeros >= 0) {
-        OutputChar(p, '0');
-    }
+    OutputPad(p, '0', p->leadingZeros);
 
     /*
      * Output the field itself.
      */
 
-    while (--p->editedStringLen >= 0) {
-        OutputChar(p, *s++);
-    }
+    OutputRun(p, s, p->editedStringLen);
 
     /*
      * Output any trailing space padding. Note that if we output leading
-     * padding, then padLen will already have been decremented to zero.
+     * padding, then padLen will already have been set to zero.
      */
 
-    while (--padLen >= 0) {
-        OutputChar(p, ' ');
-    }
+    OutputPad(p, ' ', padLen);
 
 } // OutputField
 
+/***************************************************************************/
+/**
+*  Converts a number to decimal, two digits at a time. The digits are stored
+*  backwards from @a end (i.e. the last digit is stored at end[-1]). Division
+*  by the constant 100 is compiled into a multiply.
+*
+*  @param   end   (out) Points just past the end of the buffer.
+*  @param   x     (in)  Number to convert.
+*
+*  @return  The number of digits stored.
+*/
+
+static int
+FormatDecimal(char *end, unsigned long x)
+{
+    char *s = end;
+
+    while (x >= 100) {
+        unsigned long q = x / 100;
+        const char *pair = &decimalPairs[(x - q * 100) * 2];
+
+        *--s = pair[1];
+        *--s = pair[0];
+        x = q;
+    }
+    if (x >= 10) {
+        const char *pair = &decimalPairs[x * 2];
+
+        *--s = pair[1];
+        *--s = pair[0];
+    } else {
+        *--s = (char) ('0' + x);
+    }
+    return end - s;
+
+} // FormatDecimal
+
+/***************************************************************************/
+/**
+*  Converts a number to a power of two base (binary, octal or hex) using
+*  shifts and masks. The digits are stored backwards from @a end.
+*
+*  @param   end     (out) Points just past the end of the buffer.
+*  @param   x       (in)  Number to convert.
+*  @param   shift   (in)  Number of bits per digit (1, 3 or 4).
+*  @param   capital (in)  Non-zero to use upper case hex digits.
+*
+*  @return  The number of digits stored.
+*/
+
+static int
+FormatPow2(char *end, unsigned long x, int shift, int capital)
+{
+    const char *digits = capital ? upperDigits : lowerDigits;
+    unsigned long mask = (1ul << shift) - 1;
+    char *s = end;
+
+    do {
+        *--s = digits[x & mask];
+        x >>= shift;
+    }
+    while (x != 0);
+
+    return end - s;
+
+} // FormatPow2
+
+/***************************************************************************/
+/**
+*  Converts a 64 bit number to decimal. While the number doesn't fit in 32
+*  bits, four digits at a time are divided off using 32 bit divides (which
+*  the Cortex-M4 does in hardware) on 16 bit chunks, rather than calling the
+*  64 bit division routine from the C library.
+*
+*  @param   end   (out) Points just past the end of the buffer.
+*  @param   x     (in)  Number to convert.
+*
+*  @return  The number of digits stored.
+*/
+
+static int
+FormatDecimalLL(char *end, unsigned long long x)
+{
+    char *s = end;
+
+    while ((x >> 32) != 0) {
+        uint32_t hi = (uint32_t) (x >> 32);
+        uint32_t lo = (uint32_t) x;
+        uint32_t qHi = hi / 10000;
+        uint32_t rem = hi - qHi * 10000;
+        uint32_t n, qMid, qLo;
+
+        n = (rem << 16) | (lo >> 16);
+        qMid = n / 10000;
+        rem = n - qMid * 10000;
+
+        n = (rem << 16) | (lo & 0xffff);
+        qLo = n / 10000;
+        rem = n - qLo * 10000;
+
+        x = ((unsigned long long) qHi << 32) | (qMid << 16) | qLo;
+
+        s -= 2;
+        memcpy(s, &decimalPairs[(rem % 100) * 2], 2);
+        s -= 2;
+        memcpy(s, &decimalPairs[(rem / 100) * 2], 2);
+    }
+    return (end - s) + FormatDecimal(s, (unsigned long) x);
+
+} // FormatDecimalLL
+
+/***************************************************************************/
+/**
+*  Converts a 64 bit number to a power of two base (binary, octal or hex).
+*
+*  @param   end     (out) Points just past the end of the buffer.
+*  @param   x       (in)  Number to convert.
+*  @param   shift   (in)  Number of bits per digit (1, 3 or 4).
+*  @param   capital (in)  Non-zero to use upper case hex digits.
+*
+*  @return  The number of digits stored.
+*/
+
+static int
+FormatPow2LL(char *end, unsigned long long x, int shift, int capital)
+{
+    const char *digits = capital ? upperDigits : lowerDigits;
+    unsigned mask = (1u << shift) - 1;
+    char *s = end;
+
+    do {
+        *--s = digits[x & mask];
+        x >>= shift;
+    }
+    while (x != 0);
+
+    return end - s;
+
+} // FormatPow2LL
+
+#if STR_PRINTF_FLOAT
+
+/***************************************************************************/
+/**
+*  Sets a big number to a 32 bit value.
+*/
+
+static void
+BigSet(BigNum * a, uint32_t val)
+{
+    a->word[0] = val;
+    a->len = (val != 0);
+
+} // BigSet
+
+/***************************************************************************/
+/**
+*  Multiplies a big number by a 32 bit value.
+*/
+
+static void
+BigMul(BigNum * a, uint32_t mul)
+{
+    uint32_t carry = 0;
+    int i;
+
+    for (i = 0; i < a->len; i++) {
+        uint64_t prod = (uint64_t) a->word[i] * mul + carry;
+
+        a->word[i] = (uint32_t) prod;
+        carry = (uint32_t) (prod >> 32);
+    }
+    if (carry != 0) {
+        a->word[a->len++] = carry;
+    }
+
+} // BigMul
+
+/***************************************************************************/
+/**
+*  Multiplies a big number by 2 to the power @a shift.
+*/
+
+static void
+BigShift(BigNum * a, int shift)
+{
+    int words = shift / 32;
+    int bits = shift % 32;
+    int i;
+
+    if (a->len == 0) {
+        return;
+    }
+    if (bits == 0) {
+        for (i = a->len - 1; i >= 0; i--) {
+            a->word[i + words] = a->word[i];
+        }
+    } else {
+        a->word[a->len + words] = a->word[a->len - 1] >> (32 - bits);
+        for (i = a->len - 1; i > 0; i--) {
+            a->word[i + words] = (a->word[i] << bits) | (a->word[i - 1] >> (32 - bits));
+        }
+        a->word[words] = a->word[0] << bits;
+        if (a->word[a->len + words] != 0) {
+            a->len++;
+        }
+    }
+    for (i = 0; i < words; i++) {
+        a->word[i] = 0;
+    }
+    a->len += words;
+
+} // BigShift
+
+/***************************************************************************/
+/**
+*  Multiplies a big number by 10 to the power @a exp10.
+*/
+
+static void
+BigMulPow10(BigNum * a, int exp10)
+{
+    static const uint32_t pow10[] = {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+    };
+
+    while (exp10 >= 9) {
+        BigMul(a, pow10[9]);
+        exp10 -= 9;
+    }
+    BigMul(a, pow10[exp10]);
+
+} // BigMulPow10
+
+/***************************************************************************/
+/**
+*  Compares two big numbers.
+*
+*  @return  A negative number, zero, or a positive number depending on
+*           whether a is less than, equal to, or greater than b.
+*/
+
+static int
+BigCmp(const BigNum * a, const BigNum * b)
+{
+    int i;
+
+    if (a->len != b->len) {
+        return a->len - b->len;
+    }
+    for (i = a->len - 1; i >= 0; i--) {
+        if (a->word[i] != b->word[i]) {
+            return (a->word[i] < b->word[i]) ? -1 : 1;
+        }
+    }
+    return 0;
+
+} // BigCmp
+
+/***************************************************************************/
+/**
+*  Compares @a a + @a b against @a c.
+*
+*  @return  A negative number, zero, or a positive number depending on
+*           whether a + b is less than, equal to, or greater than c.
+*/
+
+static int
+BigCmpSum(const BigNum * a, const BigNum * b, const BigNum * c)
+{
+    BigNum sum;
+    const BigNum *big = (a->len >= b->len) ? a : b;
+    const BigNum *small = (a->len >= b->len) ? b : a;
+    uint32_t carry = 0;
+    int i;
+
+    for (i = 0; i < big->len; i++) {
+        uint64_t s = (uint64_t) big->word[i] + (i < small->len ? small->word[i] : 0) + carry;
+
+        sum.word[i] = (uint32_t) s;
+        carry = (uint32_t) (s >> 32);
+    }
+    sum.len = big->len;
+    if (carry != 0) {
+        sum.word[sum.len++] = carry;
+    }
+    return BigCmp(&sum, c);
+
+} // BigCmpSum
+
+/***************************************************************************/
+/**
+*  Subtracts @a b from @a a, which must be at least as big as @a b.
+*/
+
+static void
+BigSub(BigNum * a, const BigNum * b)
+{
+    uint32_t borrow = 0;
+    int i;
+
+    for (i = 0; i < a->len; i++) {
+        uint64_t diff = (uint64_t) a->word[i] - (i < b->len ? b->word[i] : 0) - borrow;
+
+        a->word[i] = (uint32_t) diff;
+        borrow = (uint32_t) (diff >> 63);
+    }
+    while ((a->len > 0) && (a->word[a->len - 1] == 0)) {
+        a->len--;
+    }
+
+} // BigSub
+
+/***************************************************************************/
+/**
+*  Divides @a r by s, which is known to give a single decimal digit.
+*  @a r is replaced by the remainder. Rather than subtracting s up to 9
+*  times, 8s, 4s, 2s and s are tried in turn.
+*
+*  @param   r     (mod) Dividend, replaced by the remainder.
+*  @param   sMul  (in)  s, 2s, 4s and 8s.
+*
+*  @return  The quotient.
+*/
+
+static int
+BigDivDigit(BigNum * r, const BigNum sMul[4])
+{
+    int digit = 0;
+    int i;
+
+    for (i = 3; i >= 0; i--) {
+        if (BigCmp(r, &sMul[i]) >= 0) {
+            BigSub(r, &sMul[i]);
+            digit += 1 << i;
+        }
+    }
+    return digit;
+
+} // BigDivDigit
+
+/***************************************************************************/
+/**
+*  Converts a single precision float into decimal digits. This uses exact
+*  big number arithmetic (in the style of Steele & White's Dragon4), so
+*  the results are correctly rounded.
+*
+*  If @a precision is negative, the shortest string of digits which reads
+*  back as the same float is produced. Otherwise the value is rounded
+*  (halfway cases go to even) to @a precision digits after the decimal
+*  point for %f (@a fixed set), or @a precision + 1 significant digits for
+*  %e.
+*
+*  Trailing zeros aren't stored, so fewer digits than asked for may be
+*  returned.
+*
+*  @param   bits      (in)  The bits of a finite, non-negative float.
+*  @param   fixed     (in)  Non-zero for %f, zero for %e.
+*  @param   precision (in)  Digits to produce, or -1 for shortest.
+*  @param   digits    (out) Significant digits (FLOAT_MAX_DIGITS).
+*  @param   exp10     (out) Value is 0.d1d2d3... times 10 to the power @a exp10.
+*
+*  @return  The number of digits stored.
+*/
+
+static int
+FloatDigits(uint32_t bits, int fixed, int precision, char *digits, int *exp10)
+{
+    BigNum r, s, mPlus, mMinus;
+    BigNum sMul[4];
+    uint32_t mant = bits & 0x7fffff;
+    int exp2 = (int) (bits >> 23);
+    int even;
+    int k;
+    int count;
+    int n = 0;
+
+    if (exp2 == 0) {
+        exp2 = 1;                   /* Denormal */
+    } else {
+        mant |= 0x800000;
+    }
+    exp2 -= 127 + 23;               /* value = mant * 2^exp2 */
+    even = (mant & 1) == 0;
+
+    if (mant == 0) {
+        *exp10 = 1;
+        if (precision < 0) {
+            digits[0] = '0';
+            return 1;
+        }
+        return 0;
+    }
+
+    /*
+     * value = r / s, and the values which read back as the same float lie
+     * strictly between (r - mMinus) / s and (r + mPlus) / s (inclusive when
+     * the mantissa is even). The gap above is twice as big as the one below
+     * when the mantissa is a power of two (except for the smallest exponent).
+     */
+
+    BigSet(&r, mant);
+    BigSet(&s, 1);
+    BigSet(&mPlus, 1);
+    BigSet(&mMinus, 1);
+    if ((mant == 0x800000) && (bits >> 23) > 1) {
+        BigShift(&r, 2);
+        BigShift(&s, 2);
+        BigShift(&mPlus, 1);
+    } else {
+        BigShift(&r, 1);
+        BigShift(&s, 1);
+    }
+    if (exp2 >= 0) {
+        BigShift(&r, exp2);
+        BigShift(&mPlus, exp2);
+        BigShift(&mMinus, exp2);
+    } else {
+        BigShift(&s, -exp2);
+    }
+
+    /*
+     * Estimate k, so that the value is less than 10^k, using
+     * log10(2) ~= 78913 / 2^18, and then correct the estimate.
+     */
+
+    k = ((exp2 + 24) * 78913) >> 18;
+    if (k >= 0) {
+        BigMulPow10(&s, k);
+    } else {
+        BigMulPow10(&r, -k);
+        BigMulPow10(&mPlus, -k);
+        BigMulPow10(&mMinus, -k);
+    }
+    if (precision < 0) {
+        /* Shortest: the upper bound must be below 10^k. */
+
+        while (BigCmpSum(&r, &mPlus, &s) >= (even ? 0 : 1)) {
+            BigMul(&s, 10);
+            k++;
+        }
+        for (;;) {
+            BigNum r10 = r;
+            BigNum mPlus10 = mPlus;
+
+            BigMul(&r10, 10);
+            BigMul(&mPlus10, 10);
+            if (BigCmpSum(&r10, &mPlus10, &s) >= (even ? 0 : 1)) {
+                break;
+            }
+            r = r10;
+            mPlus = mPlus10;
+            BigMul(&mMinus, 10);
+            k--;
+        }
+    } else {
+        while (BigCmp(&r, &s) >= 0) {
+            BigMul(&s, 10);
+            k++;
+        }
+        for (;;) {
+            BigNum r10 = r;
+
+            BigMul(&r10, 10);
+            if (BigCmp(&r10, &s) >= 0) {
+                break;
+            }
+            r = r10;
+            k--;
+        }
+    }
+    *exp10 = k;
+
+    sMul[0] = s;
+    for (n = 1; n < 4; n++) {
+        sMul[n] = sMul[n - 1];
+        BigShift(&sMul[n], 1);
+    }
+    n = 0;
+
+    if (precision < 0) {
+        for (;;) {
+            int low, high, digit;
+
+            BigMul(&r, 10);
+            BigMul(&mPlus, 10);
+            BigMul(&mMinus, 10);
+            digit = BigDivDigit(&r, sMul);
+
+            low = BigCmp(&r, &mMinus) < (even ? 1 : 0);
+            high = BigCmpSum(&r, &mPlus, &s) > (even ? -1 : 0);
+            if (!low && !high) {
+                digits[n++] = (char) ('0' + digit);
+                continue;
+            }
+            if (low && high) {
+                /* Either digit reads back correctly, so pick the closest. */
+
+                BigNum r2 = r;
+                int cmp;
+
+                BigShift(&r2, 1);
+                cmp = BigCmp(&r2, &s);
+                if ((cmp > 0) || ((cmp == 0) && (digit & 1))) {
+                    digit++;
+                }
+            } else if (high) {
+                digit++;
+            }
+            digits[n++] = (char) ('0' + digit);
+            return n;
+        }
+    }
+
+    count = fixed ? k + precision : precision + 1;
+    if (count > FLOAT_MAX_DIGITS) {
+        count = FLOAT_MAX_DIGITS;
+    }
+    if (count < 0) {
+        return 0;
+    }
+    while (n < count) {
+        BigMul(&r, 10);
+        digits[n++] = (char) ('0' + BigDivDigit(&r, sMul));
+        if (r.len == 0) {
+            /* The rest of the digits are all zero. */
+            break;
+        }
+    }
+
+    /*
+     * Round using the remainder: r / s is the fraction of a unit in the
+     * last digit which is left over.
+     */
+
+    BigShift(&r, 1);
+    {
+        int cmp = BigCmp(&r, &s);
+        int last = (n > 0) ? digits[n - 1] - '0' : 0;
+
+        if ((cmp > 0) || ((cmp == 0) && (last & 1))) {
+            int i = n - 1;
+
+            while ((i >= 0) && (digits[i] == '9')) {
+                i--;
+            }
+            if (i < 0) {
+                /* All nines (or no digits at all) rounds up to 1 */
+                digits[0] = '1';
+                n = 1;
+                *exp10 = k + 1;
+                return n;
+            }
+            digits[i]++;
+            n = i + 1;
+        }
+    }
+
+    /* Drop trailing zeros. */
+
+    while ((n > 0) && (digits[n - 1] == '0')) {
+        n--;
+    }
+    return n;
+
+} // FloatDigits
+
+/***************************************************************************/
+/**
+*  Formats a float for %e, %E, %f or %F.
+*
+*  @param   p         (mod) State information (MINUS_SIGN gets set,
+*                           ALT_FORM forces a decimal point).
+*  @param   buf       (out) Where to store the result (FLOAT_BUFFER_SIZE).
+*  @param   val       (in)  Value to format.
+*  @param   type      (in)  Conversion type character.
+*  @param   precision (in)  Precision, or -1 for the shortest representation.
+*
+*  @return  The number of characters stored.
+*/
+
+static int
+FormatFloat(Parameters * p, char *buf, float val, char type, int precision)
+{
+    char digits[FLOAT_MAX_DIGITS];
+    union {
+        float f;
+        uint32_t u;
+    } conv;
+    int fixed = (type == 'f') || (type == 'F');
+    int upper = (type == 'E') || (type == 'F');
+    int exp10;
+    int n;
+    int i;
+    char *s = buf;
+
+    conv.f = val;
+    if (conv.u & 0x80000000) {
+        SetOption(p, MINUS_SIGN);
+        conv.u &= 0x7fffffff;
+    }
+    if (conv.u >= 0x7f800000) {
+        ClearOption(p, ZERO_PAD);
+        memcpy(buf, conv.u == 0x7f800000 ? (upper ? "INF" : "inf")
+                                         : (upper ? "NAN" : "nan"), 3);
+        return 3;
+    }
+    if (precision > FLOAT_MAX_PRECISION) {
+        precision = FLOAT_MAX_PRECISION;
+    }
+
+    n = FloatDigits(conv.u, fixed, precision, digits, &exp10);
+
+    if (fixed) {
+        if (precision < 0) {
+            precision = (n > exp10) ? n - exp10 : 0;
+        }
+        if (exp10 <= 0) {
+            *s++ = '0';
+        }
+        for (i = 0; i < exp10; i++) {
+            *s++ = (i < n) ? digits[i] : '0';
+        }
+        if ((precision > 0) || IsOptionSet(p, ALT_FORM)) {
+            *s++ = '.';
+        }
+        if (precision > 0) {
+            for (i = exp10; i < exp10 + precision; i++) {
+                *s++ = ((i >= 0) && (i < n)) ? digits[i] : '0';
+            }
+        }
+    } else {
+        int e = (n > 0) ? exp10 - 1 : 0;
+
+        if (precision < 0) {
+            precision = n - 1;
+        }
+        *s++ = (n > 0) ? digits[0] : '0';
+        if ((precision > 0) || IsOptionSet(p, ALT_FORM)) {
+            *s++ = '.';
+        }
+        if (precision > 0) {
+            for (i = 1; i <= precision; i++) {
+                *s++ = (i < n) ? digits[i] : '0';
+            }
+        }
+        *s++ = upper ? 'E' : 'e';
+        if (e < 0) {
+            *s++ = '-';
+            e = -e;
+        } else {
+            *s++ = '+';
+        }
+        *s++ = (char) ('0' + e / 10);
+        *s++ = (char) ('0' + e % 10);
+    }
+    return s - buf;
+
+} // FormatFloat
+
+#endif  /* STR_PRINTF_FLOAT */
+
 /***************************************************************************/
 /**
 *  Helper function, used by vStrPrintf() (and indirectly by StrPrintf())
 *  for outputting characters into a user supplied buffer.
 *
 *  @param   outParm  (mod) Pointer to StrPrintfParms structure.
-*  @param   ch       (in)  Character to output.
+*  @param   s        (in)  Characters to output.
+*  @param   len      (in)  Number of characters to output.
 *
-*  @return  1 if the character was stored successfully, -1 if the buffer
+*  @return  The number of characters stored, or -1 if the buffer
 *           was overflowed.
 */
 
 static int
-StrPrintfFunc(void *outParm, int ch)
+StrPrintfFunc(void *outParm, const char *s, int len)
 {
     StrPrintfParms *strParm = (StrPrintfParms *) outParm;
+    int n = len;
 
-    if (strParm->maxLen > 0) {
-        *strParm->str++ = (char) ch;
+    if (n > strParm->maxLen) {
+        n = strParm->maxLen;
+    }
+    if (n > 0) {
+        memcpy(strParm->str, s, n);
+        strParm->str += n;
         *strParm->str = '\0';
-        strParm->maxLen--;
-
-        return 1;
+        strParm->maxLen -= n;
     }
+    if (n < len) {
+        /*
+         * Whoops. We ran out of space.
+         */
 
-    /*
-     * Whoops. We ran out of space.
-     */
-
-    return -1;
+        return -1;
+    }
+    return n;
 
 } // StrPrintfFunc
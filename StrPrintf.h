@@ -5,8 +5,20 @@
 
 #include <stdarg.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef int (*StrXPrintfFunc)(void *outParm, int c);
 
+/*
+ * A chunked sink receives runs of characters (literal spans of the format
+ * string, whole formatted fields, and runs of padding) rather than one
+ * character at a time. It returns the number of characters it accepted, or
+ * a negative number to stop the output.
+ */
+typedef int (*StrXPrintfChunkFunc)(void *outParm, const char *s, int len);
+
 int
 StrPrintf(char* outStr, int maxLen, const char* fmt, ...);
 
@@ -19,3 +31,14 @@ vStrPrintf(char* outStr, int maxLen, const char* fmt, va_list args);
 int
 vStrXPrintf(StrXPrintfFunc outFunc,void* outParm, const char* fmt,
             va_list args);
+
+int
+StrXPrintfChunk(StrXPrintfChunkFunc outFunc, void* outParm, const char* fmt, ...);
+
+int
+vStrXPrintfChunk(StrXPrintfChunkFunc outFunc, void* outParm, const char* fmt,
+                 va_list args);
+
+#ifdef __cplusplus
+}
+#endif
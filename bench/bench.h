@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Timing and reporting shared by the host benchmarks. Every benchmark
+// reports its results as CSV lines of
+//
+//   benchmark,ns_per_op,bytes_per_sec
+//
+// on stdout (bytes_per_sec is 0 for operations which don't move any data),
+// and anything else, such as the results of its correctness checks, on
+// stderr. So the output of one benchmark, or of all of them, can be saved
+// and used as a baseline:
+//
+//   make host-bench > baseline.csv
+//   ... make some changes ...
+//   make host-bench BASELINE=baseline.csv
+//
+// Given a baseline, each line also has the baseline's ns/op and the change
+// from it as a percentage (negative is faster). Benchmark names are unique
+// across all of the benchmarks.
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_MAX_BASELINE	256
+
+typedef struct {
+	char	name[48];
+	double	ns_per_op;
+} bench_baseline_t;
+
+static bench_baseline_t bench_baseline[BENCH_MAX_BASELINE];
+static unsigned bench_num_baseline;
+
+static inline double bench_now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Returns the time per operation (in ns) of ops operations which were
+// started at start (from bench_now_sec).
+static inline double bench_ns_per_op(double start, double ops) {
+	return (bench_now_sec() - start) * 1e9 / ops;
+}
+
+// Lines which aren't results (headers, or anything else which ended up in
+// the file) are skipped.
+static inline int bench_load_baseline(const char *filename) {
+	FILE *fs = fopen(filename, "r");
+	char line[128];
+
+	if (fs == NULL) {
+		perror(filename);
+		return 1;
+	}
+	while (bench_num_baseline < BENCH_MAX_BASELINE && fgets(line, sizeof(line), fs) != NULL) {
+		bench_baseline_t *b = &bench_baseline[bench_num_baseline];
+		if (sscanf(line, "%47[^,],%lf", b->name, &b->ns_per_op) == 2) {
+			bench_num_baseline++;
+		}
+	}
+	fclose(fs);
+	return 0;
+}
+
+// Takes the optional baseline file from the command line, and prints the
+// CSV header. Returns non-zero if the benchmark should exit with an error.
+static inline int bench_init(int argc, char **argv) {
+	if (argc > 2) {
+		fprintf(stderr, "Usage: %s [baseline.csv]\n", argv[0]);
+		return 1;
+	}
+	if (argc == 2 && bench_load_baseline(argv[1]) != 0) {
+		return 1;
+	}
+	printf("benchmark,ns_per_op,bytes_per_sec%s\n",
+		   bench_num_baseline > 0 ? ",baseline_ns_per_op,change_pct" : "");
+	return 0;
+}
+
+static inline void bench_report(const char *name, double ns_per_op, double bytes_per_op) {
+	printf("%s,%.2f,%.0f", name, ns_per_op, bytes_per_op * 1e9 / ns_per_op);
+	for (unsigned i = 0; i < bench_num_baseline; i++) {
+		if (strcmp(bench_baseline[i].name, name) == 0) {
+			printf(",%.2f,%+.1f", bench_baseline[i].ns_per_op,
+				   (ns_per_op / bench_baseline[i].ns_per_op - 1.0) * 100.0);
+			break;
+		}
+	}
+	printf("\n");
+}
+
+#endif // BENCH_H
@@ -0,0 +1,351 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Microbenchmarks for the buffer and formatting code which the firmware
+// spends most of its time in: the CBUF and MPCBUF rings (laid out the same
+// way as the USB buffers in usb.c), the cooked \n to \r\n translation, and
+// StrPrintf. The results are reported the same way as the other host
+// benchmarks (see bench.h), and each is the best of several runs.
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "CBUF.h"
+#include "MPCBUF.h"
+#include "StrPrintf.h"
+#include "cooked.h"
+#include "bench.h"
+
+#define RUNS			5		// Best of
+
+// The same layout as the USB receive buffer.
+static struct {
+	volatile uint32_t	m_get_idx;
+	volatile uint32_t	m_put_idx;
+	uint8_t				m_entry[1024];
+} rx_ring;
+
+// The same layout as the USB transmit buffer.
+static struct {
+	volatile uint32_t	m_state;
+	volatile uint32_t	m_put_idx;
+	volatile uint32_t	m_get_idx;
+	uint8_t				m_entry[16384];
+} tx_ring;
+
+// Keeps the compiler from optimizing the work away.
+static volatile uint32_t sink_total;
+
+// Runs fn (which does ops operations) RUNS times and reports the fastest.
+static void bench(const char *name, void (*fn)(unsigned ops), unsigned ops,
+				  double bytes_per_op) {
+	double best = 0;
+
+	for (unsigned run = 0; run < RUNS; run++) {
+		double start = bench_now_sec();
+		fn(ops);
+		double ns_per_op = bench_ns_per_op(start, ops);
+		if (run == 0 || ns_per_op < best) {
+			best = ns_per_op;
+		}
+	}
+	bench_report(name, best, bytes_per_op);
+}
+
+// ---- Rings ------------------------------------------------------------
+
+// One byte pushed and popped.
+static void cbuf_byte(unsigned ops) {
+	uint32_t total = 0;
+
+	CBUF_Init(rx_ring);
+	for (unsigned i = 0; i < ops; i++) {
+		CBUF_Push(rx_ring, (uint8_t)i);
+		total += CBUF_Pop(rx_ring);
+	}
+	sink_total += total;
+}
+
+static uint8_t packet[64];
+
+// A 64 byte packet pushed and popped using the reserve/commit and
+// peek/consume spans, the way the USB receive path does.
+static void cbuf_packet(unsigned ops) {
+	uint8_t out[64];
+	uint8_t *ptr1;
+	uint8_t *ptr2;
+	size_t len1;
+	size_t len2;
+
+	CBUF_Init(rx_ring);
+	for (unsigned i = 0; i < ops; i++) {
+		size_t len = CBUF_PushReserve(rx_ring, sizeof(packet), ptr1, len1, ptr2, len2);
+		memcpy(ptr1, packet, len1);
+		memcpy(ptr2, packet + len1, len2);
+		CBUF_PushCommit(rx_ring, len);
+
+		len = CBUF_PopPeek(rx_ring, sizeof(out), ptr1, len1, ptr2, len2);
+		memcpy(out, ptr1, len1);
+		memcpy(out + len1, ptr2, len2);
+		CBUF_PopConsume(rx_ring, len);
+		sink_total += out[i & 63];
+	}
+}
+
+// Fills the ring up with 64 byte packets and then empties it again, so
+// that the data is streamed through memory rather than staying in one
+// cache line.
+static void cbuf_fill_drain(unsigned ops) {
+	uint8_t out[64];
+	uint8_t *ptr1;
+	uint8_t *ptr2;
+	size_t len1;
+	size_t len2;
+	const unsigned per_fill = CBUF_Size(rx_ring) / sizeof(packet);
+
+	CBUF_Init(rx_ring);
+	for (unsigned i = 0; i < ops; i += per_fill) {
+		for (unsigned n = 0; n < per_fill; n++) {
+			size_t len = CBUF_PushReserve(rx_ring, sizeof(packet), ptr1, len1, ptr2, len2);
+			memcpy(ptr1, packet, len1);
+			memcpy(ptr2, packet + len1, len2);
+			CBUF_PushCommit(rx_ring, len);
+		}
+		for (unsigned n = 0; n < per_fill; n++) {
+			size_t len = CBUF_PopPeek(rx_ring, sizeof(out), ptr1, len1, ptr2, len2);
+			memcpy(out, ptr1, len1);
+			memcpy(out + len1, ptr2, len2);
+			CBUF_PopConsume(rx_ring, len);
+			sink_total += out[n & 63];
+		}
+	}
+}
+
+// Writes len bytes into tx_ring in one reservation, the way usb_vcp_write
+// does.
+static void tx_write(const void *data, size_t len) {
+	uint8_t *ptr1;
+	uint8_t *ptr2;
+	size_t len1;
+	size_t len2;
+
+	len = MPCBUF_PushReserve(tx_ring, 0, len, ptr1, len1, ptr2, len2);
+	if (len == 0) {
+		return;
+	}
+	memcpy(ptr1, data, len1);
+	memcpy(ptr2, (const uint8_t *)data + len1, len2);
+	MPCBUF_PushCommit(tx_ring);
+}
+
+// Takes everything out of tx_ring, 64 bytes at a time, the way the USB
+// transmitter does.
+static void tx_drain(void) {
+	uint8_t *ptr1;
+	uint8_t *ptr2;
+	size_t len1;
+	size_t len2;
+
+	while (MPCBUF_PopPeek(tx_ring, 64, ptr1, len1, ptr2, len2) != 0) {
+		(void)ptr2;
+		sink_total += ptr1[0];
+		MPCBUF_PopConsume(tx_ring, len1 + len2);
+	}
+}
+
+// A 64 byte packet written to and read from the transmit ring.
+static void mpcbuf_packet(unsigned ops) {
+	MPCBUF_Init(tx_ring);
+	for (unsigned i = 0; i < ops; i++) {
+		tx_write(packet, sizeof(packet));
+		tx_drain();
+	}
+}
+
+// ---- Cooked output ----------------------------------------------------
+
+static void tx_write_run(void *arg, const char *str, size_t len) {
+	(void)arg;
+	tx_write(str, len);
+}
+
+static const char log_text[] =
+	"line 42: 17 bytes at 123456 ms\n"
+	"port 0 tx: 262144 bytes 4096 packets\n"
+	"[   12345] usb        connected\n";
+
+// The text goes through cooked_write into the transmit ring, the way that
+// usb_vcp_send_strn_cooked does it.
+static void cooked(unsigned ops) {
+	MPCBUF_Init(tx_ring);
+	for (unsigned i = 0; i < ops; i++) {
+		cooked_write(tx_write_run, NULL, log_text, sizeof(log_text) - 1);
+		tx_drain();
+	}
+}
+
+// ---- StrPrintf --------------------------------------------------------
+
+// printf_xxx times vStrXPrintf on its own, writing into a CBUF a character
+// at a time. usb_printf_xxx times the whole of usb_vcp_printf: the chunked
+// vStrXPrintfChunk, the cooked translation and the transmit ring.
+
+static int char_sink(void *out_param, int ch) {
+	(void)out_param;
+	if (!CBUF_IsFull(rx_ring)) {
+		CBUF_Push(rx_ring, ch);
+	}
+	return 1;
+}
+
+static int chunk_sink(void *out_param, const char *str, int len) {
+	(void)out_param;
+	cooked_write(tx_write_run, NULL, str, len);
+	return len;
+}
+
+static int char_printf(const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	int rc = vStrXPrintf(char_sink, NULL, fmt, args);
+	va_end(args);
+	return rc;
+}
+
+static int usb_chunk_printf(const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	int rc = vStrXPrintfChunk(chunk_sink, NULL, fmt, args);
+	va_end(args);
+	return rc;
+}
+
+typedef int (*printf_func_t)(const char *fmt, ...);
+
+// Formats one value, varying it so that short and long numbers show up.
+// Returns the number of characters output.
+typedef int (*format_func_t)(printf_func_t pf, unsigned i);
+
+static int fmt_d(printf_func_t pf, unsigned i) {
+	return pf("%d", (int)(i * 2654435761u >> (i & 31)));
+}
+
+static int fmt_u(printf_func_t pf, unsigned i) {
+	return pf("%u", i * 2654435761u >> (i & 31));
+}
+
+static int fmt_x(printf_func_t pf, unsigned i) {
+	return pf("%x", i * 2654435761u >> (i & 31));
+}
+
+static int fmt_08lX(printf_func_t pf, unsigned i) {
+	return pf("%08lX", (unsigned long)(i * 2654435761u >> (i & 31)));
+}
+
+static int fmt_lld(printf_func_t pf, unsigned i) {
+	return pf("%lld", (long long)(i * 2654435761u >> (i & 31)) * 1000003);
+}
+
+static int fmt_s(printf_func_t pf, unsigned i) {
+	return pf("%-10s", (i & 1) ? "usb" : "connected");
+}
+
+static int fmt_f(printf_func_t pf, unsigned i) {
+	return pf("%.3f", (double)((float)(i * 2654435761u >> (i & 31)) * 0.001f));
+}
+
+static int fmt_log(printf_func_t pf, unsigned i) {
+	return pf("port %u tx: %lu bytes %lu packets\n", i & 1,
+			  (unsigned long)i * 64, (unsigned long)i);
+}
+
+static const struct {
+	const char		*name;
+	format_func_t	format;
+} format_case[] = {
+	{ "d",		fmt_d },
+	{ "u",		fmt_u },
+	{ "x",		fmt_x },
+	{ "08lX",	fmt_08lX },
+	{ "lld",	fmt_lld },
+	{ "-10s",	fmt_s },
+	{ ".3f",	fmt_f },
+	{ "log",	fmt_log },
+};
+
+#define NUM_FORMATS	(sizeof(format_case) / sizeof(format_case[0]))
+
+// bench() only passes the op count, so the case being run is kept here.
+static format_func_t format_func;
+
+static void printf_char(unsigned ops) {
+	CBUF_Init(rx_ring);
+	for (unsigned i = 0; i < ops; i++) {
+		format_func(char_printf, i);
+		rx_ring.m_get_idx = rx_ring.m_put_idx;
+	}
+}
+
+static void usb_printf(unsigned ops) {
+	MPCBUF_Init(tx_ring);
+	for (unsigned i = 0; i < ops; i++) {
+		format_func(usb_chunk_printf, i);
+		tx_drain();
+	}
+}
+
+// Returns the average number of characters output per call.
+static double format_len(format_func_t format, unsigned ops) {
+	unsigned long total = 0;
+
+	CBUF_Init(rx_ring);
+	for (unsigned i = 0; i < ops; i++) {
+		total += format(char_printf, i);
+		rx_ring.m_get_idx = rx_ring.m_put_idx;
+	}
+	return (double)total / ops;
+}
+
+int main(int argc, char **argv) {
+	if (bench_init(argc, argv) != 0) {
+		return 1;
+	}
+	for (unsigned i = 0; i < sizeof(packet); i++) {
+		packet[i] = i;
+	}
+
+	bench("cbuf_byte", cbuf_byte, 4000000, 1);
+	bench("cbuf_packet64", cbuf_packet, 1000000, 64);
+	bench("cbuf_fill_drain64", cbuf_fill_drain, 1000000, 64);
+	bench("mpcbuf_packet64", mpcbuf_packet, 1000000, 64);
+	bench("cooked_write", cooked, 500000, sizeof(log_text) - 1);
+
+	for (unsigned i = 0; i < NUM_FORMATS; i++) {
+		char name[32];
+		unsigned ops = 200000;
+		double len = format_len(format_case[i].format, ops);
+
+		format_func = format_case[i].format;
+		snprintf(name, sizeof(name), "printf_%s", format_case[i].name);
+		bench(name, printf_char, ops, len);
+		snprintf(name, sizeof(name), "usb_printf_%s", format_case[i].name);
+		bench(name, usb_printf, ops, len);
+	}
+	return 0;
+}
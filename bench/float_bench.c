@@ -0,0 +1,275 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host benchmark for the %e, %f and %ll conversions in StrPrintf.
+//
+// Before timing anything, the output is checked against glibc's snprintf
+// (which rounds exactly) for random floats and 64 bit integers. With the
+// # flag (and no precision) StrPrintf produces the shortest output which
+// reads back as the same float, so those results are checked by reading
+// them back with strtof, and by making sure that glibc can't do it with
+// fewer digits. Then StrPrintf and snprintf are both timed (see bench.h for
+// the output format).
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "StrPrintf.h"
+#include "bench.h"
+
+#define NUM_RANDOM	200000
+#define ITERATIONS	1000000
+
+static int errors;
+static int checks;
+
+static uint64_t rand_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t rand64(void) {
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 7;
+	rand_state ^= rand_state << 17;
+	return rand_state;
+}
+
+static float bits_to_float(uint32_t bits) {
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+static void report(const char *fmt, const char *expected, const char *actual) {
+	if (errors < 20) {
+		fprintf(stderr, "'%s': expected '%s' got '%s'\n", fmt, expected, actual);
+	}
+	errors++;
+}
+
+// Compares StrPrintf against snprintf for a format taking one float.
+static void check_float(const char *fmt, float val) {
+	char expected[128];
+	char actual[128];
+
+	snprintf(expected, sizeof(expected), fmt, (double)val);
+	StrPrintf(actual, sizeof(actual), fmt, (double)val);
+	checks++;
+	if (strcmp(expected, actual) != 0) {
+		report(fmt, expected, actual);
+	}
+}
+
+// Counts the significant digits in the mantissa of a %e formatted number.
+static int num_digits(const char *str) {
+	int n = 0;
+	for (; *str != '\0' && *str != 'e'; str++) {
+		if (*str >= '0' && *str <= '9') {
+			n++;
+		}
+	}
+	return n;
+}
+
+static void check_shortest(float val) {
+	char actual[128];
+	char expected[128];
+
+	// %r and %R should both read back exactly.
+	StrPrintf(actual, sizeof(actual), "%r", (double)val);
+	checks++;
+	if (strtof(actual, NULL) != val) {
+		snprintf(expected, sizeof(expected), "%.9g", (double)val);
+		report("%r", expected, actual);
+	}
+	StrPrintf(actual, sizeof(actual), "%R", (double)val);
+	checks++;
+	if (strtof(actual, NULL) != val) {
+		snprintf(expected, sizeof(expected), "%.9g", (double)val);
+		report("%R", expected, actual);
+		return;
+	}
+
+	// Find the fewest digits glibc needs to round trip, which should be
+	// the same as the number of digits we used.
+	for (int prec = 0; prec < 9; prec++) {
+		snprintf(expected, sizeof(expected), "%.*e", prec, (double)val);
+		if (strtof(expected, NULL) == val) {
+			break;
+		}
+	}
+	if (val != 0 && num_digits(actual) != num_digits(expected)) {
+		report("%R (shortest)", expected, actual);
+	}
+}
+
+static void check_long_long(const char *fmt, unsigned long long val) {
+	char expected[128];
+	char actual[128];
+
+	snprintf(expected, sizeof(expected), fmt, val);
+	StrPrintf(actual, sizeof(actual), fmt, val);
+	checks++;
+	if (strcmp(expected, actual) != 0) {
+		report(fmt, expected, actual);
+	}
+}
+
+static void check_all(void) {
+	static const char *const prec_fmt[] = {
+		"%.0e", "%.1e", "%.2e", "%.3e", "%.6e", "%.8e", "%.12e", "%.30e",
+		"%.0f", "%.1f", "%.2f", "%.3f", "%.6f", "%.10f", "%.20f", "%.45f",
+	};
+	static const char *const field_fmt[] = {
+		"%12.3f", "%-12.3f|", "%012.3f", "%12.2e", "%-14.4E|", "%015.5e",
+		"%.3F", "%3.0f", "%08.2f", "%f", "%e", "%12E", "%#f", "%#e", "%#.0f",
+		"%#.0E", "%-#8.0f|", "%#012.0e",
+	};
+	static const float special[] = {
+		0.0f, -0.0f, 1.0f, -1.0f, 0.5f, 0.1f, 0.125f, 2.5f, 3.5f, 9.5f,
+		99.99f, 1e10f, 1.5e-7f, 16777216.0f, 3.4028235e38f, 1.17549435e-38f,
+		1.4e-45f, 0.3f, 123456.789f, 9.999999e-5f,
+	};
+	static const char *const ll_fmt[] = {
+		"%lld", "%llu", "%llx", "%llX", "%llo", "%25lld", "%-25llu|", "%025lld",
+		"%.22llu",
+	};
+
+	for (size_t i = 0; i < sizeof(special) / sizeof(special[0]); i++) {
+		for (size_t j = 0; j < sizeof(prec_fmt) / sizeof(prec_fmt[0]); j++) {
+			check_float(prec_fmt[j], special[i]);
+		}
+		for (size_t j = 0; j < sizeof(field_fmt) / sizeof(field_fmt[0]); j++) {
+			check_float(field_fmt[j], special[i]);
+		}
+		check_shortest(special[i]);
+	}
+
+	static const char *const special_fmt[] = { "%f", "%e", "%F", "%E", "%-6e|", "%06f" };
+	for (size_t j = 0; j < sizeof(special_fmt) / sizeof(special_fmt[0]); j++) {
+		check_float(special_fmt[j], INFINITY);
+		check_float(special_fmt[j], -INFINITY);
+		check_float(special_fmt[j], NAN);
+		check_float(special_fmt[j], -NAN);
+	}
+
+	for (int i = 0; i < NUM_RANDOM; i++) {
+		uint32_t bits = (uint32_t)rand64();
+		if ((bits & 0x7f800000) == 0x7f800000) {
+			continue;	// inf and nan are checked above
+		}
+		float val = bits_to_float(bits);
+		check_float(prec_fmt[i % 8], val);
+		// %f of big numbers is long, so only do those with small precisions.
+		check_float(fabsf(val) < 1e20f ? prec_fmt[8 + i % 8] : "%.3f", val);
+		check_shortest(val);
+	}
+
+	static const unsigned long long ll_special[] = {
+		0, 1, 9, 10, 9999, 10000, 4294967295ull, 4294967296ull,
+		999999999999ull, 18446744073709551615ull, 9223372036854775807ull,
+		9223372036854775808ull,
+	};
+	for (size_t i = 0; i < sizeof(ll_special) / sizeof(ll_special[0]); i++) {
+		for (size_t j = 0; j < sizeof(ll_fmt) / sizeof(ll_fmt[0]); j++) {
+			check_long_long(ll_fmt[j], ll_special[i]);
+		}
+	}
+	for (int i = 0; i < NUM_RANDOM; i++) {
+		unsigned long long val = rand64() >> (i % 64);
+		check_long_long(ll_fmt[i % 5], val);
+	}
+}
+
+static volatile char sink;
+
+static const float bench_float[] = {
+	3.14159f, -0.001234f, 22.5f, 1013.25f, 6.02e23f, 1e-10f, 0.1f, 42.0f,
+};
+#define NUM_FLOATS	(sizeof(bench_float) / sizeof(bench_float[0]))
+
+// Names skip the % (and any .), so "%.3f" is reported as float_strprintf_3f.
+static void report_time(const char *func_name, const char *fmt, double ns_per_op, size_t bytes) {
+	char name[48];
+	int len = snprintf(name, sizeof(name), "float_%s_", func_name);
+	for (const char *p = fmt; *p != '\0' && len < (int)sizeof(name) - 1; p++) {
+		if (*p != '%' && *p != '.') {
+			name[len++] = *p;
+		}
+	}
+	name[len] = '\0';
+	bench_report(name, ns_per_op, (double)bytes / ITERATIONS);
+}
+
+static void time_float(const char *fmt) {
+	char buf[128];
+	size_t bytes = 0;
+	double start = bench_now_sec();
+	for (unsigned i = 0; i < ITERATIONS; i++) {
+		bytes += StrPrintf(buf, sizeof(buf), fmt, (double)bench_float[i % NUM_FLOATS]);
+		sink = buf[0];
+	}
+	report_time("strprintf", fmt, bench_ns_per_op(start, ITERATIONS), bytes);
+
+	bytes = 0;
+	start = bench_now_sec();
+	for (unsigned i = 0; i < ITERATIONS; i++) {
+		bytes += snprintf(buf, sizeof(buf), fmt, (double)bench_float[i % NUM_FLOATS]);
+		sink = buf[0];
+	}
+	report_time("snprintf", fmt, bench_ns_per_op(start, ITERATIONS), bytes);
+}
+
+static void time_long_long(const char *fmt) {
+	char buf[128];
+	size_t bytes = 0;
+	double start = bench_now_sec();
+	for (unsigned i = 0; i < ITERATIONS; i++) {
+		bytes += StrPrintf(buf, sizeof(buf), fmt, 0x123456789abcdefull * i);
+		sink = buf[0];
+	}
+	report_time("strprintf", fmt, bench_ns_per_op(start, ITERATIONS), bytes);
+
+	bytes = 0;
+	start = bench_now_sec();
+	for (unsigned i = 0; i < ITERATIONS; i++) {
+		bytes += snprintf(buf, sizeof(buf), fmt, 0x123456789abcdefull * i);
+		sink = buf[0];
+	}
+	report_time("snprintf", fmt, bench_ns_per_op(start, ITERATIONS), bytes);
+}
+
+int main(int argc, char **argv) {
+	check_all();
+	if (errors) {
+		fprintf(stderr, "%d of %d checks failed\n", errors, checks);
+		return 1;
+	}
+	fprintf(stderr, "%%e, %%f and %%ll match glibc for all %d checks\n", checks);
+
+	if (bench_init(argc, argv) != 0) {
+		return 1;
+	}
+	time_float("%.3f");
+	time_float("%.6e");
+	time_float("%f");
+	time_float("%e");
+	time_long_long("%llu");
+	time_long_long("%llx");
+	return 0;
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host benchmark for the integer conversions in StrPrintf (%d, %u, %x and
+// %08lX). The output is checked against the C library's snprintf, whose
+// timing is also reported for reference (see bench.h for the output
+// format). The same conversions can be timed on the board (in cycles) using
+// the "fmtbench" command in usb-serial.c.
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "StrPrintf.h"
+#include "bench.h"
+
+#define ITERATIONS	1000000
+
+// A spread of small and large values, so that both short and long numbers
+// get converted.
+static const long bench_value[] = {
+	0, 7, -42, 1234, -98765, 3000000, 0x7fffffffL, -0x7fffffffL - 1,
+};
+#define NUM_VALUES	(sizeof(bench_value) / sizeof(bench_value[0]))
+
+typedef struct {
+	const char	*name;
+	const char	*fmt;
+	int			long_arg;
+} bench_case_t;
+
+static const bench_case_t bench_case[] = {
+	{ "%d",    "%d",    0 },
+	{ "%u",    "%u",    0 },
+	{ "%x",    "%x",    0 },
+	{ "%08lX", "%08lX", 1 },
+};
+#define NUM_CASES	(sizeof(bench_case) / sizeof(bench_case[0]))
+
+// Keeps the compiler from optimizing the formatting away.
+static volatile char sink;
+
+static int format_strprintf(char *buf, size_t len, const bench_case_t *bc, long val) {
+	if (bc->long_arg) {
+		return StrPrintf(buf, len, bc->fmt, (unsigned long)(uint32_t)val);
+	}
+	return StrPrintf(buf, len, bc->fmt, (int)val);
+}
+
+static int format_libc(char *buf, size_t len, const bench_case_t *bc, long val) {
+	if (bc->long_arg) {
+		return snprintf(buf, len, bc->fmt, (unsigned long)(uint32_t)val);
+	}
+	return snprintf(buf, len, bc->fmt, (int)val);
+}
+
+typedef int (*format_func_t)(char *buf, size_t len, const bench_case_t *bc, long val);
+
+static void time_case(const char *func_name, const bench_case_t *bc, format_func_t format) {
+	char name[48];
+	char buf[32];
+	size_t bytes = 0;
+	double start = bench_now_sec();
+	for (unsigned i = 0; i < ITERATIONS; i++) {
+		bytes += format(buf, sizeof(buf), bc, bench_value[i % NUM_VALUES]);
+		sink = buf[0];
+	}
+	double ns_per_op = bench_ns_per_op(start, ITERATIONS);
+
+	// The names skip the %.
+	snprintf(name, sizeof(name), "intfmt_%s_%s", func_name, bc->name + 1);
+	bench_report(name, ns_per_op, (double)bytes / ITERATIONS);
+}
+
+static int check_case(const bench_case_t *bc) {
+	char expected[32];
+	char actual[32];
+	int errors = 0;
+
+	for (size_t i = 0; i < NUM_VALUES; i++) {
+		format_libc(expected, sizeof(expected), bc, bench_value[i]);
+		format_strprintf(actual, sizeof(actual), bc, bench_value[i]);
+		if (strcmp(expected, actual) != 0) {
+			fprintf(stderr, "%s: %ld formatted as '%s', expected '%s'\n",
+					bc->name, bench_value[i], actual, expected);
+			errors++;
+		}
+	}
+	return errors;
+}
+
+int main(int argc, char **argv) {
+	int errors = 0;
+
+	for (size_t i = 0; i < NUM_CASES; i++) {
+		errors += check_case(&bench_case[i]);
+	}
+	if (errors) {
+		return 1;
+	}
+
+	if (bench_init(argc, argv) != 0) {
+		return 1;
+	}
+	for (size_t i = 0; i < NUM_CASES; i++) {
+		time_case("strprintf", &bench_case[i], format_strprintf);
+		time_case("snprintf", &bench_case[i], format_libc);
+	}
+	return 0;
+}
@@ -0,0 +1,306 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host stress test for MPCBUF.h. Several producer threads write records
+// into one small buffer while a consumer thread checks that every record
+// arrives whole (never interleaved with another) and that each producer's
+// records arrive in order, with none missing. On the host the exclusive
+// load/store pair is replaced by compare-and-swap, which has the same
+// retry behaviour. The time per record is reported (see bench.h for the
+// output format).
+//
+// A second test has a timer signal handler writing into a buffer at any
+// point in the main thread's writes, the way an interrupt handler would on
+// the board (and does in the simulator). Whenever the main thread has
+// finished a write, everything written so far must have been published.
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "MPCBUF.h"
+#include "bench.h"
+
+#define NUM_PRODUCERS	4
+#define RECORDS			1000000		// Per producer
+#define RECORD_HEADER	4			// length, producer, sequence (2 bytes)
+#define MAX_PAYLOAD		40
+
+static struct {
+	volatile uint32_t	m_state;
+	volatile uint32_t	m_put_idx;
+	volatile uint32_t	m_get_idx;
+	uint8_t				m_entry[256];
+} ring;
+
+static volatile int producers_done;
+
+static uint8_t payload_byte(unsigned producer, unsigned seq, unsigned i) {
+	return (uint8_t)(producer * 73 + seq * 31 + i * 7);
+}
+
+static void *producer(void *arg) {
+	unsigned id = (unsigned)(uintptr_t)arg;
+	uint8_t record[RECORD_HEADER + MAX_PAYLOAD];
+
+	for (unsigned seq = 0; seq < RECORDS; seq++) {
+		size_t payload = (seq * 13 + id) % (MAX_PAYLOAD + 1);
+		size_t len = RECORD_HEADER + payload;
+
+		record[0] = len;
+		record[1] = id;
+		record[2] = seq & 0xff;
+		record[3] = (seq >> 8) & 0xff;
+		for (size_t i = 0; i < payload; i++) {
+			record[RECORD_HEADER + i] = payload_byte(id, seq, i);
+		}
+
+		uint8_t *ptr1;
+		uint8_t *ptr2;
+		size_t len1;
+		size_t len2;
+		while (MPCBUF_PushReserve(ring, len, len, ptr1, len1, ptr2, len2) == 0) {
+			// Full, wait for the consumer.
+			sched_yield();
+		}
+		memcpy(ptr1, record, len1);
+		memcpy(ptr2, record + len1, len2);
+		MPCBUF_PushCommit(ring);
+	}
+	return NULL;
+}
+
+// Returns the number of errors found.
+static unsigned long consume(unsigned long *records, unsigned long *bytes) {
+	uint8_t record[RECORD_HEADER + MAX_PAYLOAD];
+	size_t have = 0;
+	unsigned next_seq[NUM_PRODUCERS] = { 0 };
+	unsigned long errors = 0;
+
+	while (1) {
+		int done = producers_done;
+		uint8_t *ptr1;
+		uint8_t *ptr2;
+		size_t len1;
+		size_t len2;
+
+		// Only take what's needed to finish the header or record, so that
+		// records are checked as they arrive.
+		size_t need = have < RECORD_HEADER ? RECORD_HEADER - have : record[0] - have;
+		size_t len = MPCBUF_PopPeek(ring, need, ptr1, len1, ptr2, len2);
+		if (len == 0) {
+			if (done) {
+				break;
+			}
+			sched_yield();
+			continue;
+		}
+		memcpy(&record[have], ptr1, len1);
+		memcpy(&record[have + len1], ptr2, len2);
+		have += len;
+		MPCBUF_PopConsume(ring, len);
+
+		if (have == RECORD_HEADER
+			&& (record[0] < RECORD_HEADER || record[0] > sizeof(record)
+				|| record[1] >= NUM_PRODUCERS)) {
+			fprintf(stderr, "bad record header %u %u\n", record[0], record[1]);
+			return errors + 1;
+		}
+		if (have < RECORD_HEADER || have < record[0]) {
+			continue;
+		}
+		unsigned id = record[1];
+		unsigned seq = record[2] | (record[3] << 8);
+		if (seq != (next_seq[id] & 0xffff)) {
+			fprintf(stderr, "producer %u: got record %u, expected %u\n",
+					id, seq, next_seq[id] & 0xffff);
+			errors++;
+		}
+		for (size_t i = RECORD_HEADER; i < have; i++) {
+			if (record[i] != payload_byte(id, next_seq[id], i - RECORD_HEADER)) {
+				fprintf(stderr, "producer %u record %u: bad payload\n", id, seq);
+				errors++;
+				break;
+			}
+		}
+		next_seq[id]++;
+		(*records)++;
+		*bytes += have;
+		have = 0;
+		if (errors > 10) {
+			break;
+		}
+	}
+	for (unsigned id = 0; id < NUM_PRODUCERS; id++) {
+		if (next_seq[id] != RECORDS) {
+			fprintf(stderr, "producer %u: got %u records, expected %u\n",
+					id, next_seq[id], RECORDS);
+			errors++;
+		}
+	}
+	return errors;
+}
+
+static void *join_producers(void *arg) {
+	pthread_t *thread = arg;
+
+	for (unsigned id = 0; id < NUM_PRODUCERS; id++) {
+		pthread_join(thread[id], NULL);
+	}
+	producers_done = 1;
+	return NULL;
+}
+
+#define INTERRUPT_TEST_SEC	2.0
+#define INTERRUPT_PERIOD_US	50
+#define INTERRUPT_RECORD	8
+
+static struct {
+	volatile uint32_t	m_state;
+	volatile uint32_t	m_put_idx;
+	volatile uint32_t	m_get_idx;
+	uint8_t				m_entry[256];
+} irq_ring;
+
+static volatile unsigned long irq_signals;
+
+static void irq_push(uint8_t val) {
+	uint8_t *ptr1;
+	uint8_t *ptr2;
+	size_t len1;
+	size_t len2;
+
+	if (MPCBUF_PushReserve(irq_ring, INTERRUPT_RECORD, INTERRUPT_RECORD,
+						   ptr1, len1, ptr2, len2) != 0) {
+		memset(ptr1, val, len1);
+		memset(ptr2, val, len2);
+		MPCBUF_PushCommit(irq_ring);
+	}
+}
+
+static void irq_handler(int sig) {
+	(void)sig;
+
+	irq_push(0xee);
+	irq_signals++;
+}
+
+// Returns the number of errors found.
+static unsigned long interrupt_test(void) {
+	struct sigaction sa;
+	struct itimerval timer;
+	double start;
+	unsigned long writes = 0;
+	unsigned long stranded = 0;
+	unsigned long torn = 0;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = irq_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGALRM, &sa, NULL);
+
+	// The timer plays the part of a peripheral interrupt. It's asynchronous
+	// to the main thread, so the handler can land anywhere in irq_push.
+	memset(&timer, 0, sizeof(timer));
+	timer.it_interval.tv_usec = INTERRUPT_PERIOD_US;
+	timer.it_value.tv_usec = INTERRUPT_PERIOD_US;
+
+	MPCBUF_Init(irq_ring);
+	setitimer(ITIMER_REAL, &timer, NULL);
+
+	start = bench_now_sec();
+	while (bench_now_sec() - start < INTERRUPT_TEST_SEC) {
+		irq_push(0x11);
+		writes++;
+
+		// Nobody else is part way through a write, so the commit index has
+		// to have caught up with the put index. Any write from the handler
+		// would publish data that was left behind, so it only counts if the
+		// state didn't change while it was being checked.
+		uint32_t state = irq_ring.m_state;
+		uint32_t put_idx = irq_ring.m_put_idx;
+		if (state == irq_ring.m_state
+			&& (MPCBUF_WRITERS(state) != 0 || MPCBUF_COMMIT(state) != put_idx)) {
+			stranded++;
+		}
+
+		// The main thread is also the reader.
+		uint8_t *ptr1;
+		uint8_t *ptr2;
+		size_t len1;
+		size_t len2;
+		uint8_t record[INTERRUPT_RECORD];
+		while (MPCBUF_PopPeek(irq_ring, INTERRUPT_RECORD, ptr1, len1, ptr2, len2)
+			   == INTERRUPT_RECORD) {
+			memcpy(record, ptr1, len1);
+			memcpy(record + len1, ptr2, len2);
+			MPCBUF_PopConsume(irq_ring, INTERRUPT_RECORD);
+			if (memcmp(record, record + 1, INTERRUPT_RECORD - 1) != 0) {
+				torn++;
+			}
+		}
+	}
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_REAL, &timer, NULL);
+	signal(SIGALRM, SIG_IGN);
+
+	if (stranded || torn) {
+		fprintf(stderr, "interrupt test: %lu writes left unpublished, %lu torn records\n",
+				stranded, torn);
+		return stranded + torn;
+	}
+	fprintf(stderr, "MPCBUF passed: %lu writes interrupted by %lu signal handler writes\n",
+			writes, irq_signals);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	pthread_t thread[NUM_PRODUCERS];
+	unsigned long records = 0;
+	unsigned long bytes = 0;
+
+	if (bench_init(argc, argv) != 0) {
+		return 1;
+	}
+	MPCBUF_Init(ring);
+
+	double start = bench_now_sec();
+	for (unsigned id = 0; id < NUM_PRODUCERS; id++) {
+		pthread_create(&thread[id], NULL, producer, (void *)(uintptr_t)id);
+	}
+
+	// The consumer needs to know when to stop, so a helper joins the
+	// producers while this thread consumes.
+	pthread_t joiner;
+	pthread_create(&joiner, NULL, join_producers, thread);
+
+	unsigned long errors = consume(&records, &bytes);
+	pthread_join(joiner, NULL);
+	double ns_per_record = bench_ns_per_op(start, records);
+
+	if (errors) {
+		return 1;
+	}
+	fprintf(stderr, "MPCBUF passed: %lu records from %d producers\n", records, NUM_PRODUCERS);
+	bench_report("mpcbuf_threads_record", ns_per_record, (double)bytes / records);
+
+	return interrupt_test() != 0;
+}
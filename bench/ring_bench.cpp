@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host benchmark comparing the Ring template with the CBUF macros, for
+// single entry and bulk (64 byte, like a USB packet) operations on a 1024
+// byte buffer with 16-bit indices, which is what usb.c uses. A producer
+// and consumer thread are then run against a Ring, and against the CBUF
+// macros, to check that nothing is lost, duplicated or reordered. See
+// bench.h for the output format.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#include "CBUF.h"
+#include "Ring.h"
+#include "bench.h"
+
+#define ITERATIONS	1000000
+#define PACKET		64
+
+static struct {
+	volatile uint16_t	m_get_idx;
+	volatile uint16_t	m_put_idx;
+	uint8_t				m_entry[1024];
+} cbuf;
+
+static Ring<uint8_t, 1024> ring;
+
+// Keeps the compiler from optimizing the buffers away.
+static volatile uint32_t sink;
+
+// Each test pushes and then pops 8 entries per iteration (or 8 packets for
+// the bulk tests), and returns the time per entry (or packet).
+
+static double cbuf_single() {
+	uint32_t total = 0;
+	double start = bench_now_sec();
+	for (unsigned i = 0; i < ITERATIONS; i++) {
+		for (unsigned j = 0; j < 8; j++) {
+			if (!CBUF_IsFull(cbuf)) {
+				CBUF_Push(cbuf, (uint8_t)(i + j));
+			}
+		}
+		for (unsigned j = 0; j < 8; j++) {
+			if (!CBUF_IsEmpty(cbuf)) {
+				total += CBUF_Pop(cbuf);
+			}
+		}
+	}
+	sink = total;
+	return bench_ns_per_op(start, ITERATIONS * 8.0);
+}
+
+static double ring_single() {
+	uint32_t total = 0;
+	double start = bench_now_sec();
+	for (unsigned i = 0; i < ITERATIONS; i++) {
+		for (unsigned j = 0; j < 8; j++) {
+			ring.push((uint8_t)(i + j));
+		}
+		for (unsigned j = 0; j < 8; j++) {
+			uint8_t val;
+			if (ring.pop(val)) {
+				total += val;
+			}
+		}
+	}
+	sink = total;
+	return bench_ns_per_op(start, ITERATIONS * 8.0);
+}
+
+static double cbuf_bulk() {
+	uint8_t packet[PACKET];
+	uint32_t total = 0;
+
+	memset(packet, 'x', sizeof(packet));
+	double start = bench_now_sec();
+	for (unsigned i = 0; i < ITERATIONS; i++) {
+		for (unsigned j = 0; j < 8; j++) {
+			uint8_t *ptr1;
+			uint8_t *ptr2;
+			size_t len1;
+			size_t len2;
+			size_t len = CBUF_PushReserve(cbuf, sizeof(packet), ptr1, len1, ptr2, len2);
+			memcpy(ptr1, packet, len1);
+			memcpy(ptr2, packet + len1, len2);
+			CBUF_PushCommit(cbuf, len);
+		}
+		for (unsigned j = 0; j < 8; j++) {
+			uint8_t *ptr1;
+			uint8_t *ptr2;
+			size_t len1;
+			size_t len2;
+			size_t len = CBUF_PopPeek(cbuf, sizeof(packet), ptr1, len1, ptr2, len2);
+			memcpy(packet, ptr1, len1);
+			memcpy(packet + len1, ptr2, len2);
+			CBUF_PopConsume(cbuf, len);
+			total += packet[i % PACKET];
+		}
+	}
+	sink = total;
+	return bench_ns_per_op(start, ITERATIONS * 8.0);
+}
+
+static double ring_bulk() {
+	uint8_t packet[PACKET];
+	uint32_t total = 0;
+
+	memset(packet, 'x', sizeof(packet));
+	double start = bench_now_sec();
+	for (unsigned i = 0; i < ITERATIONS; i++) {
+		for (unsigned j = 0; j < 8; j++) {
+			ring.push(packet, sizeof(packet));
+		}
+		for (unsigned j = 0; j < 8; j++) {
+			ring.pop(packet, sizeof(packet));
+			total += packet[i % PACKET];
+		}
+	}
+	sink = total;
+	return bench_ns_per_op(start, ITERATIONS * 8.0);
+}
+
+// Gives a CBUF the same push/pop interface as Ring, so that check_threads
+// can be run on both.
+class CbufSeq {
+public:
+	bool push(uint32_t val) {
+		if (CBUF_IsFull(m_buf)) {
+			return false;
+		}
+		CBUF_Push(m_buf, val);
+		return true;
+	}
+
+	size_t push(const uint32_t *data, size_t len) {
+		uint32_t *ptr1;
+		uint32_t *ptr2;
+		size_t len1;
+		size_t len2;
+		len = CBUF_PushReserve(m_buf, len, ptr1, len1, ptr2, len2);
+		memcpy(ptr1, data, len1 * sizeof(*data));
+		memcpy(ptr2, data + len1, len2 * sizeof(*data));
+		CBUF_PushCommit(m_buf, len);
+		return len;
+	}
+
+	size_t pop(uint32_t *data, size_t len) {
+		uint32_t *ptr1;
+		uint32_t *ptr2;
+		size_t len1;
+		size_t len2;
+		len = CBUF_PopPeek(m_buf, len, ptr1, len1, ptr2, len2);
+		memcpy(data, ptr1, len1 * sizeof(*data));
+		memcpy(data + len1, ptr2, len2 * sizeof(*data));
+		CBUF_PopConsume(m_buf, len);
+		return len;
+	}
+
+private:
+	struct {
+		volatile uint16_t	m_get_idx;
+		volatile uint16_t	m_put_idx;
+		uint32_t			m_entry[256];
+	} m_buf = {};
+};
+
+// Sends a counting sequence from one thread to another, using a mix of
+// single and bulk operations with odd sizes so that the wrap gets hit at
+// every offset. Returns the number of errors.
+template <typename Buf>
+static unsigned check_threads(Buf &seq_ring) {
+	const uint32_t count = 4000000;
+	unsigned errors = 0;
+
+	std::thread producer([&] {
+		uint32_t next = 0;
+		uint32_t block[37];
+		while (next < count) {
+			if (next % 3 == 0) {
+				if (!seq_ring.push(next)) {
+					std::this_thread::yield();
+					continue;
+				}
+				next++;
+				continue;
+			}
+			size_t len = 1 + next % 37;
+			if (len > count - next) {
+				len = count - next;
+			}
+			for (size_t i = 0; i < len; i++) {
+				block[i] = next + i;
+			}
+			size_t pushed = seq_ring.push(block, len);
+			if (pushed == 0) {
+				std::this_thread::yield();
+			}
+			next += pushed;
+		}
+	});
+
+	uint32_t expected = 0;
+	uint32_t block[29];
+	while (expected < count && errors < 10) {
+		size_t len = seq_ring.pop(block, 1 + expected % 29);
+		if (len == 0) {
+			std::this_thread::yield();
+			continue;
+		}
+		for (size_t i = 0; i < len; i++, expected++) {
+			if (block[i] != expected) {
+				fprintf(stderr, "got %u, expected %u\n", block[i], expected);
+				errors++;
+				expected = block[i];
+			}
+		}
+	}
+	producer.join();
+	return errors;
+}
+
+int main(int argc, char **argv) {
+	static Ring<uint32_t, 256> seq_ring;
+	static CbufSeq seq_cbuf;
+
+	if (check_threads(seq_ring) != 0) {
+		return 1;
+	}
+	fprintf(stderr, "Ring passed the producer/consumer thread check\n");
+	if (check_threads(seq_cbuf) != 0) {
+		return 1;
+	}
+	fprintf(stderr, "CBUF passed the producer/consumer thread check\n");
+
+	if (bench_init(argc, argv) != 0) {
+		return 1;
+	}
+	bench_report("ring_cbuf_single", cbuf_single(), 1);
+	bench_report("ring_ring_single", ring_single(), 1);
+	bench_report("ring_cbuf_bulk64", cbuf_bulk(), PACKET);
+	bench_report("ring_ring_bulk64", ring_bulk(), PACKET);
+	return 0;
+}
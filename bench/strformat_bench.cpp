@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host benchmark for StrFormat.h. Before timing anything, it checks that
+// StrFormat produces exactly the same bytes (and return value) as StrPrintf
+// for a wide range of formats and values, and exits with an error if it
+// doesn't. Then both are timed formatting a typical stats line (see bench.h
+// for the output format).
+
+#include <cstdio>
+#include <cstring>
+
+#include "StrFormat.h"
+#include "bench.h"
+
+#define ITERATIONS	1000000
+
+static int errors;
+static int checks;
+
+// Formats the same thing with StrPrintf and StrFormat into buffers of the
+// given size, and compares the results.
+#define CHECK_SIZE(size, fmt, ...) do { \
+	char expected[80]; \
+	char actual[80]; \
+	memset(expected, 'z', sizeof(expected)); \
+	memset(actual, 'z', sizeof(actual)); \
+	int rc1 = StrPrintf(expected, size, fmt, ##__VA_ARGS__); \
+	int rc2 = StrFormat(actual, size, STRFMT(fmt), ##__VA_ARGS__); \
+	checks++; \
+	if (rc1 != rc2 || memcmp(expected, actual, sizeof(expected)) != 0) { \
+		fprintf(stderr, "%s:%d: '%s' StrPrintf gave '%.*s' (%d), StrFormat gave '%.*s' (%d)\n", \
+				__FILE__, __LINE__, fmt, (int)sizeof(expected), expected, rc1, \
+				(int)sizeof(actual), actual, rc2); \
+		errors++; \
+	} \
+} while (0)
+
+#define CHECK(fmt, ...)	CHECK_SIZE(80, fmt, ##__VA_ARGS__)
+
+static void check_values(int i, unsigned u, long l, unsigned long ul) {
+	CHECK("%d", i);
+	CHECK("%5d|%-5d|%05d|%.3d|%08.3d", i, i, i, i, i);
+	CHECK("%u %x %X %o %b", u, u, u, u, u);
+	CHECK("%10u|%-10x|%010X|%.12o", u, u, u, u);
+	CHECK("%ld %lu %lx %lX %lo %lb", l, ul, ul, ul, ul, ul);
+	CHECK("%08lX|%-12ld|%012ld|%.15lu", ul, l, l, ul);
+	CHECK("%*d|%-*u|%.*x", 7, i, 9, u, 6, u);
+	CHECK("%*d", -4, i);
+	CHECK("%.*d", -1, i);
+}
+
+static void check_all(void) {
+	static const int ints[] = { 0, 1, -1, 9, 10, 99, 100, -12345, 65535, INT_MAX, INT_MIN };
+	static const long longs[] = { 0, 7, -7, 1000000, LONG_MAX, LONG_MIN };
+
+	for (int i : ints) {
+		for (long l : longs) {
+			check_values(i, unsigned(i), l, (unsigned long)l);
+		}
+	}
+
+	CHECK("");
+	CHECK("plain text\n");
+	CHECK("100%% sure %");
+	CHECK("%q %l %5");
+	CHECK("%0-5d|%-05d", 42);
+	CHECK("%c%c%c|%3c|%-3c|", 'a', 'b', 'c', 'x', 'y');
+	CHECK("%s|%10s|%-10s|%.3s|%010s", "hello", "hi", "hi", "truncate", "zp");
+	CHECK("%s", "");
+	CHECK("%*s|%-*.*s|", 6, "ab", 6, 2, "abcdef");
+	CHECK("%d %s %c %lu\n", (short)-3, "mixed", 'Q', (unsigned long)123);
+	CHECK("%u", (unsigned char)200);
+	CHECK("%lld|%llu|%-20llx|%025llo|%*lld", -1234567890123ll, 18446744073709551615ull,
+		  0x123456789abcdefull, 0777777777777777ull, 22, 42ll);
+	CHECK("%f %e %.3f %12.4e %-10.2f| %010.3F %E", 0.1, 1e10, 3.14159f, -2.5e-8,
+		  99.995, -1.5, 6.02e23);
+	CHECK("%*.*f|%.*e|%*f", 12, 3, 2.0 / 3, 2, 123456.0, -8, 0.5f);
+	CHECK("%#f %#e|%#.0f|%-#12.0e|%#x", 0.1, 1e10, 2.5f, 3.0, 255);
+	CHECK("%r %R|%-12r|%#r|%012R", 0.1, 1e10, 2.5f, 3.0, -0.5);
+	CHECK("%llc%lls", 'x', "y");
+	CHECK("%d", (signed char)-100);
+
+	// Overflowing the buffer.
+	CHECK_SIZE(1, "abc");
+	CHECK_SIZE(4, "abc");
+	CHECK_SIZE(5, "%d", 12345);
+	CHECK_SIZE(8, "%-10s|", "pad");
+	CHECK_SIZE(10, "x=%08lX y=%d", 0xdeadbeeful, -1);
+}
+
+static volatile char sink;
+
+int main(int argc, char **argv) {
+	char buf[80];
+	size_t bytes = 0;
+
+	check_all();
+	if (errors) {
+		fprintf(stderr, "%d of %d checks failed\n", errors, checks);
+		return 1;
+	}
+	fprintf(stderr, "StrFormat matches StrPrintf for all %d checks\n", checks);
+
+	if (bench_init(argc, argv) != 0) {
+		return 1;
+	}
+	double start = bench_now_sec();
+	for (unsigned i = 0; i < ITERATIONS; i++) {
+		bytes += StrPrintf(buf, sizeof(buf), "port %u tx: %lu bytes %-8s %08lX\n",
+				  i & 1, (unsigned long)i * 64, "usb", (unsigned long)i);
+		sink = buf[0];
+	}
+	bench_report("strformat_strprintf", bench_ns_per_op(start, ITERATIONS),
+				 (double)bytes / ITERATIONS);
+
+	bytes = 0;
+	start = bench_now_sec();
+	for (unsigned i = 0; i < ITERATIONS; i++) {
+		bytes += StrFormat(buf, sizeof(buf), STRFMT("port %u tx: %lu bytes %-8s %08lX\n"),
+				  i & 1, (unsigned long)i * 64, "usb", (unsigned long)i);
+		sink = buf[0];
+	}
+	bench_report("strformat_strformat", bench_ns_per_op(start, ITERATIONS),
+				 (double)bytes / ITERATIONS);
+	return 0;
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host benchmark comparing the per character (StrXPrintfFunc) and chunked
+// (StrXPrintfChunkFunc) StrPrintf sinks. Both sinks push into a CBUF ring
+// buffer the same way that usb.c and uart.c do. Build and run with
+// "make host-bench" (see bench.h for the output format).
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CBUF.h"
+#include "StrPrintf.h"
+#include "bench.h"
+
+#define ITERATIONS	200000
+
+static struct {
+	volatile uint16_t	m_get_idx;
+	volatile uint16_t	m_put_idx;
+	uint8_t				m_entry[1024];
+} ring;
+
+// Keeps the compiler from optimizing the ring buffer away.
+static volatile uint32_t sink_total;
+
+static int char_sink(void *out_param, int ch) {
+	(void)out_param;
+	if (!CBUF_IsFull(ring)) {
+		CBUF_Push(ring, ch);
+	}
+	return 1;
+}
+
+static int chunk_sink(void *out_param, const char *str, int len) {
+	uint8_t *ptr1;
+	uint8_t *ptr2;
+	size_t len1;
+	size_t len2;
+
+	(void)out_param;
+	size_t pushed = CBUF_PushReserve(ring, (size_t)len, ptr1, len1, ptr2, len2);
+	memcpy(ptr1, str, len1);
+	memcpy(ptr2, str + len1, len2);
+	CBUF_PushCommit(ring, pushed);
+	return len;
+}
+
+// Returns the number of bytes drained.
+static size_t drain(void) {
+	size_t len = CBUF_Len(ring);
+	sink_total += len;
+	ring.m_get_idx = ring.m_put_idx;
+	return len;
+}
+
+static int char_printf(const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	int rc = vStrXPrintf(char_sink, NULL, fmt, args);
+	va_end(args);
+	return rc;
+}
+
+static int chunk_printf(const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	int rc = vStrXPrintfChunk(chunk_sink, NULL, fmt, args);
+	va_end(args);
+	return rc;
+}
+
+typedef int (*printf_func_t)(const char *fmt, ...);
+
+// Each case prints one typical log line, the same way with either printf.
+typedef struct {
+	const char	*name;
+	void		(*run)(printf_func_t pf, unsigned i);
+} bench_case_t;
+
+static void run_banner(printf_func_t pf, unsigned i) {
+	(void)i;
+	pf("***** Starting (USB) ...\n");
+}
+
+static void run_stats(printf_func_t pf, unsigned i) {
+	pf("port %u tx: %lu bytes %lu packets\n", i & 1, (unsigned long)i * 64, (unsigned long)i);
+}
+
+static void run_padded(printf_func_t pf, unsigned i) {
+	pf("[%8lu] %-10s %s\n", (unsigned long)i, "usb", "connected");
+}
+
+static void run_hex(printf_func_t pf, unsigned i) {
+	pf("addr 0x%08lx len %5d crc %04x\n", (unsigned long)i * 4, (int)(i & 0x3ff), i & 0xffff);
+}
+
+static const bench_case_t bench_case[] = {
+	{ "banner", run_banner },
+	{ "stats",  run_stats },
+	{ "padded", run_padded },
+	{ "hex",    run_hex },
+};
+
+static void time_case(const char *sink_name, const bench_case_t *bc, printf_func_t pf) {
+	char name[48];
+	size_t bytes = 0;
+	double start = bench_now_sec();
+	for (unsigned i = 0; i < ITERATIONS; i++) {
+		bc->run(pf, i);
+		bytes += drain();
+	}
+	double ns_per_op = bench_ns_per_op(start, ITERATIONS);
+
+	snprintf(name, sizeof(name), "strprintf_%s_%s", sink_name, bc->name);
+	bench_report(name, ns_per_op, (double)bytes / ITERATIONS);
+}
+
+// Both sinks have to produce exactly the same bytes.
+static int check_case(const bench_case_t *bc) {
+	char expected[256];
+	char actual[256];
+	unsigned i = 12345;
+
+	CBUF_Init(ring);
+	bc->run(char_printf, i);
+	size_t n1 = CBUF_Len(ring);
+	memcpy(expected, ring.m_entry, n1);
+
+	CBUF_Init(ring);
+	bc->run(chunk_printf, i);
+	size_t n2 = CBUF_Len(ring);
+	memcpy(actual, ring.m_entry, n2);
+	CBUF_Init(ring);
+
+	if (n1 != n2 || memcmp(expected, actual, n1) != 0) {
+		fprintf(stderr, "%s: chunked output doesn't match per character output\n", bc->name);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	int errors = 0;
+	const size_t num_cases = sizeof(bench_case) / sizeof(bench_case[0]);
+
+	for (size_t i = 0; i < num_cases; i++) {
+		errors += check_case(&bench_case[i]);
+	}
+	if (errors) {
+		return 1;
+	}
+
+	if (bench_init(argc, argv) != 0) {
+		return 1;
+	}
+	for (size_t i = 0; i < num_cases; i++) {
+		time_case("char", &bench_case[i], char_printf);
+		time_case("chunk", &bench_case[i], chunk_printf);
+	}
+	return 0;
+}
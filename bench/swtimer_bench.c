@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host benchmark for the software timer wheel in swtimer.c. Random starts,
+// restarts, cancels and jumps in time (including across the 32-bit wrap)
+// are checked against a simple model, and then starting and cancelling a
+// timer is timed with few and with many timers running, which should take
+// the same time (see bench.h for the output format).
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "swtimer.h"
+#include "bench.h"
+
+#define NUM_TIMERS	256
+#define NUM_STEPS	2000000
+#define ITERATIONS	1000000
+
+// Stand-ins for systick.c
+static uint32_t sim_millis;
+static uint32_t sim_wake_at;
+static int sim_wake_armed;
+
+// The wheel's time: the last millisecond that swtimer_run has processed
+// (or is processing, from a callback). Timers started for that time (or
+// earlier) are due in the next millisecond.
+static uint32_t sim_wheel_time;
+
+uint32_t systick_millis(void) {
+	return sim_millis;
+}
+
+// Like the real one, only the earliest deadline is kept.
+void systick_wake_at(uint32_t millis) {
+	if (!sim_wake_armed || (int32_t)(millis - sim_wake_at) < 0) {
+		sim_wake_at = millis;
+		sim_wake_armed = 1;
+	}
+}
+
+typedef struct {
+	swtimer_t	timer;
+	int			running;
+	uint32_t	due;
+	uint32_t	period;
+} model_t;
+
+static model_t model[NUM_TIMERS];
+static unsigned errors;
+static unsigned long fired;
+
+static uint32_t rand32(void) {
+	return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+static uint32_t random_delay(void) {
+	switch (rand() % 8) {
+		case 0:		return 0;
+		case 1:		return rand32() % 1000000;
+		case 2:		return rand32() % (1u << 30);
+		default:	return rand32() % 100;
+	}
+}
+
+static void start_timer(model_t *m) {
+	uint32_t delay = random_delay();
+	uint32_t period = rand() % 4 ? 0 : 1 + rand32() % 5000;
+	swtimer_start(&m->timer, delay, period);
+	m->running = 1;
+	m->due = sim_millis + delay;
+	m->period = period;
+	if ((int32_t)(m->due - sim_wheel_time) <= 0) {
+		m->due = sim_wheel_time + 1;
+	}
+}
+
+static void cancel_timer(model_t *m) {
+	swtimer_cancel(&m->timer);
+	m->running = 0;
+}
+
+static void expired(swtimer_t *timer, void *arg) {
+	model_t *m = arg;
+
+	if (!m->running || (int32_t)(sim_millis - m->due) < 0
+		|| swtimer_is_running(timer) != (m->period != 0)) {
+		fprintf(stderr, "timer %d fired at %u, due at %u (running %d)\n",
+				(int)(m - model), sim_millis, m->due, m->running);
+		errors++;
+	}
+	fired++;
+	sim_wheel_time = m->due;
+	if (m->period) {
+		m->due += m->period;
+	} else {
+		m->running = 0;
+	}
+
+	// Callbacks are allowed to mess with other timers, and themselves.
+	switch (rand() % 16) {
+		case 0:		start_timer(m); break;
+		case 1:		cancel_timer(m); break;
+		case 2:		start_timer(&model[rand() % NUM_TIMERS]); break;
+		case 3:		cancel_timer(&model[rand() % NUM_TIMERS]); break;
+	}
+}
+
+static void check_model(void) {
+	int armed = 0;
+	uint32_t earliest = 0;
+
+	for (unsigned i = 0; i < NUM_TIMERS; i++) {
+		model_t *m = &model[i];
+		if (m->running != swtimer_is_running(&m->timer)) {
+			fprintf(stderr, "timer %u running %d, expected %d\n",
+					i, swtimer_is_running(&m->timer), m->running);
+			errors++;
+		}
+		if (!m->running) {
+			continue;
+		}
+		if ((int32_t)(sim_millis - m->due) >= 0) {
+			fprintf(stderr, "timer %u due at %u didn't fire by %u\n", i, m->due, sim_millis);
+			errors++;
+		}
+		if (!armed || (int32_t)(m->due - earliest) < 0) {
+			earliest = m->due;
+			armed = 1;
+		}
+	}
+
+	// The wakeup can be earlier than the first timer (when a slot in one of
+	// the upper levels needs to be redistributed) but never later.
+	if (armed && (!sim_wake_armed || (int32_t)(sim_wake_at - earliest) > 0)) {
+		fprintf(stderr, "wakeup at %u for timer due at %u\n", sim_wake_at, earliest);
+		errors++;
+	}
+}
+
+static void check_wheel(void) {
+	swtimer_run();
+	for (unsigned i = 0; i < NUM_TIMERS; i++) {
+		swtimer_init(&model[i].timer, expired, &model[i]);
+	}
+
+	for (unsigned long step = 0; step < NUM_STEPS && errors < 10; step++) {
+		for (int ops = rand() % 3; ops > 0; ops--) {
+			model_t *m = &model[rand() % NUM_TIMERS];
+			if (rand() % 4) {
+				start_timer(m);
+			} else {
+				cancel_timer(m);
+			}
+		}
+
+		switch (rand() % 8) {
+			case 0:
+				// Sleep until the requested wakeup.
+				if (sim_wake_armed) {
+					sim_millis = sim_wake_at;
+				}
+				break;
+			case 1:
+				sim_millis += rand32() % (1u << 24);
+				break;
+			default:
+				sim_millis += rand() % 4;
+				break;
+		}
+		sim_wake_armed = 0;
+		swtimer_run();
+		sim_wheel_time = sim_millis;
+		check_model();
+	}
+}
+
+static void ignore(swtimer_t *timer, void *arg) {
+	(void)timer;
+	(void)arg;
+}
+
+// Times starting and cancelling a timer while num_running other timers
+// (with spread out expiry times) are running.
+static double time_start_cancel(unsigned num_running) {
+	static swtimer_t running[10000];
+	swtimer_t timer;
+
+	for (unsigned i = 0; i < num_running; i++) {
+		swtimer_init(&running[i], ignore, NULL);
+		swtimer_start(&running[i], 1 + rand32() % 10000000, 0);
+	}
+	swtimer_init(&timer, ignore, NULL);
+
+	double start = bench_now_sec();
+	for (unsigned i = 0; i < ITERATIONS; i++) {
+		swtimer_start(&timer, 1 + (i * 2654435761u) % 10000000, 0);
+		swtimer_cancel(&timer);
+	}
+	double ns = bench_ns_per_op(start, ITERATIONS);
+
+	for (unsigned i = 0; i < num_running; i++) {
+		swtimer_cancel(&running[i]);
+	}
+	return ns;
+}
+
+int main(int argc, char **argv) {
+	srand(1);
+	check_wheel();
+	if (errors) {
+		return 1;
+	}
+	fprintf(stderr, "swtimer matches the model for %d steps (%lu callbacks)\n",
+			NUM_STEPS, fired);
+
+	for (unsigned i = 0; i < NUM_TIMERS; i++) {
+		cancel_timer(&model[i]);
+	}
+	if (bench_init(argc, argv) != 0) {
+		return 1;
+	}
+	for (unsigned n = 10; n <= 10000; n *= 10) {
+		char name[48];
+		snprintf(name, sizeof(name), "swtimer_start_cancel_%u", n);
+		bench_report(name, time_start_cancel(n), 0);
+	}
+	return 0;
+}
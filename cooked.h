@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COOKED_H
+#define COOKED_H
+
+#include <stddef.h>
+#include <string.h>
+
+// The "cooked" output translation used by the *_send_strn_cooked and
+// *_printf functions, which turns each \n into \r\n. It's shared by usb.c,
+// uart.c and the host benchmarks.
+
+// Called with each piece of the translated output.
+typedef void (*cooked_write_t)(void *arg, const char *str, size_t len);
+
+// Passes str to write, translating \n into \r\n. The text between newlines
+// is passed in one piece, so that it can go into the output buffer a
+// memcpy at a time.
+static inline void cooked_write(cooked_write_t write, void *arg,
+								const char *str, size_t len) {
+	const char *end = str + len;
+	while (str < end) {
+		const char *nl = memchr(str, '\n', end - str);
+		if (nl == NULL) {
+			write(arg, str, end - str);
+			break;
+		}
+		write(arg, str, nl - str);
+		write(arg, "\r\n", 2);
+		str = nl + 1;
+	}
+}
+
+#endif // COOKED_H
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cycles.h"
+
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/stm32/rcc.h>
+
+static uint32_t cycles_per_micro;
+
+// Top half and last seen value of the 64-bit cycle count.
+static uint32_t cycles_high;
+static uint32_t cycles_last;
+
+void cycles_init(void) {
+	cycles_per_micro = rcc_ahb_frequency / 1000000;
+	dwt_enable_cycle_counter();
+	cycles_last = cycles_now();
+}
+
+uint32_t cycles_to_micros(uint32_t cycles) {
+	return cycles / cycles_per_micro;
+}
+
+uint32_t cycles_to_nanos(uint32_t cycles) {
+	// 1000 * cycles would overflow past 4.29 million cycles (25 ms at
+	// 168 MHz), so use 64 bits.
+	return (uint32_t)((uint64_t)cycles * 1000 / cycles_per_micro);
+}
+
+uint64_t cycles_now64(void) {
+	// This can be called from interrupt context, so the read and carry need
+	// to happen together.
+	uint32_t mask = cm_mask_interrupts(1);
+	uint32_t now = cycles_now();
+	if (now < cycles_last) {
+		cycles_high++;
+	}
+	cycles_last = now;
+	uint64_t cycles = ((uint64_t)cycles_high << 32) | now;
+	cm_mask_interrupts(mask);
+
+	return cycles;
+}
+
+uint32_t micros(void) {
+	return (uint32_t)(cycles_now64() / cycles_per_micro);
+}
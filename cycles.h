@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CYCLES_H
+#define CYCLES_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// High resolution timing using the DWT cycle counter, which counts CPU
+// clocks (so it wraps every 25.5 seconds at 168 MHz). Differences between
+// two cycle counts are correct across a wrap, as long as the interval being
+// measured is shorter than that.
+
+// Set CYCLES_STATS to 0 to compile out CYCLES_TIME_SCOPE.
+#if !defined(CYCLES_STATS)
+#define CYCLES_STATS	1
+#endif
+
+// Enables the cycle counter. Call this after the clocks have been set up.
+void cycles_init(void);
+
+// The DWT cycle count register. This is the same on all ARMv7-M parts, and
+// it's spelled out here (rather than using libopencm3's DWT_CYCCNT) so that
+// usb.h can be used by the host benchmarks. The simulator supplies its own.
+#if !defined(CYCLES_DWT_CYCCNT)
+#define CYCLES_DWT_CYCCNT	(*(volatile uint32_t *)0xe0001004)
+#endif
+
+static inline uint32_t cycles_now(void) {
+	return CYCLES_DWT_CYCCNT;
+}
+
+// Returns the number of cycles since start (a value from cycles_now).
+static inline uint32_t cycles_since(uint32_t start) {
+	return CYCLES_DWT_CYCCNT - start;
+}
+
+uint32_t cycles_to_micros(uint32_t cycles);
+uint32_t cycles_to_nanos(uint32_t cycles);
+
+// Returns a 64-bit version of the cycle counter. Carrying into the top half
+// relies on this being called at least once per wrap of the cycle counter
+// (25.5 s at 168 MHz). systick_idle() calls it on every wakeup, and main
+// runs a periodic software timer (cycles_timer) so that it's called even
+// when the CPU stays asleep.
+uint64_t cycles_now64(void);
+
+// Returns the number of microseconds since cycles_init. This wraps every
+// 71 minutes.
+uint32_t micros(void);
+
+static inline uint32_t micros_since(uint32_t start) {
+	return micros() - start;
+}
+
+// Accumulates the cost of a piece of code. count and total are 0 and min
+// is UINT32_MAX until the first sample is added.
+typedef struct {
+	uint32_t	count;
+	uint32_t	min;
+	uint32_t	max;
+	uint64_t	total;
+} cycle_stats_t;
+
+#define CYCLE_STATS_INIT	{ 0, UINT32_MAX, 0, 0 }
+
+static inline void cycle_stats_add(cycle_stats_t *stats, uint32_t cycles) {
+	stats->count++;
+	stats->total += cycles;
+	if (cycles < stats->min) {
+		stats->min = cycles;
+	}
+	if (cycles > stats->max) {
+		stats->max = cycles;
+	}
+}
+
+static inline uint32_t cycle_stats_avg(const cycle_stats_t *stats) {
+	return stats->count ? (uint32_t)(stats->total / stats->count) : 0;
+}
+
+static inline void cycle_stats_reset(cycle_stats_t *stats) {
+	const cycle_stats_t init = CYCLE_STATS_INIT;
+	*stats = init;
+}
+
+typedef struct {
+	cycle_stats_t	*stats;
+	uint32_t		start;
+} cycles_scope_t;
+
+static inline void cycles_scope_end(cycles_scope_t *scope) {
+	cycle_stats_add(scope->stats, cycles_since(scope->start));
+}
+
+#define CYCLES_CONCAT_(a, b)	a ## b
+#define CYCLES_CONCAT(a, b)		CYCLES_CONCAT_(a, b)
+
+// CYCLES_TIME_SCOPE(stats) adds the number of cycles from this point until
+// the end of the enclosing block (however it's left) to stats, which is a
+// cycle_stats_t. Only one may be used per line.
+#if CYCLES_STATS
+#define CYCLES_TIME_SCOPE(stats) \
+	cycles_scope_t CYCLES_CONCAT(cycles_scope_, __LINE__) \
+		__attribute__((cleanup(cycles_scope_end))) = { &(stats), cycles_now() }
+#else
+#define CYCLES_TIME_SCOPE(stats)	do { } while (0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // CYCLES_H
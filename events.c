@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "events.h"
+
+#include <stddef.h>
+
+#include <libopencm3/cm3/cortex.h>
+
+#include "sections.h"
+#include "systick.h"
+
+static volatile uint32_t event_pending;
+static uint32_t event_handled;		// Events which have handlers
+static event_handler_t event_handler[32];
+
+RAMFUNC void event_post(uint32_t events) {
+	// This compiles to an LDREX/STREX loop, so it's safe against being
+	// interrupted by another poster.
+	__atomic_fetch_or(&event_pending, events, __ATOMIC_RELAXED);
+}
+
+void event_set_handler(unsigned event, event_handler_t handler) {
+	event_handler[event] = handler;
+	if (handler) {
+		event_handled |= EVENT_BIT(event);
+	} else {
+		event_handled &= ~EVENT_BIT(event);
+	}
+}
+
+uint32_t event_wait(uint32_t events) {
+	uint32_t pending;
+
+	while (1) {
+		// Interrupts are masked between checking for events and sleeping,
+		// otherwise an event posted in between wouldn't wake us up until
+		// the next interrupt. WFI still wakes up for a pending interrupt
+		// while they're masked, and the handler runs once they're unmasked.
+		cm_disable_interrupts();
+		pending = event_pending & events;
+		if (!pending) {
+			systick_idle();
+		}
+		cm_enable_interrupts();
+
+		if (pending) {
+			__atomic_fetch_and(&event_pending, ~pending, __ATOMIC_RELAXED);
+			return pending;
+		}
+	}
+}
+
+void event_dispatch(void) {
+	uint32_t pending = event_wait(event_handled);
+
+	while (pending) {
+		unsigned event = __builtin_ctz(pending);
+		pending &= pending - 1;
+		event_handler[event](event);
+	}
+}
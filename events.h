@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Event flags, which let interrupt handlers hand work to the main loop.
+// An ISR posts an event with event_post(), and the main loop, which sleeps
+// in event_dispatch() until something has been posted, runs the handler
+// registered for it. Posting an event which is already pending does nothing
+// more, so handlers should deal with everything that's outstanding (e.g.
+// all of the received data) rather than one item.
+
+// Event numbers (bit numbers in the event mask).
+#define EVENT_TIMER			0	// A systick_wake_at() deadline has arrived
+#define EVENT_USB_RX_0		1	// Data received on USB serial port 0, 1 ...
+
+#define EVENT_USB_RX(port)	(EVENT_USB_RX_0 + (port))
+#define EVENT_BIT(event)	(1u << (event))
+
+typedef void (*event_handler_t)(unsigned event);
+
+// Marks the events in the mask as pending. This may be called from any
+// context.
+void event_post(uint32_t events);
+
+void event_set_handler(unsigned event, event_handler_t handler);
+
+// Sleeps until at least one of the events in the mask is pending, and then
+// clears and returns the pending events from the mask.
+uint32_t event_wait(uint32_t events);
+
+// Waits for any of the events which have handlers, and runs the handlers
+// for those which are pending.
+void event_dispatch(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // EVENTS_H
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+
+#include "log.h"
+
+// A sync byte, plus the format string address and each argument taking up
+// to 5 bytes apiece.
+#define LOG_MAX_RECORD	(1 + 5 * (1 + LOG_MAX_ARGS))
+
+static uint32_t log_dropped;
+
+static uint8_t *log_put_varint(uint8_t *p, uint32_t val) {
+	while (val >= 0x80) {
+		*p++ = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	*p++ = val;
+	return p;
+}
+
+void log_deferred(const char *fmt, unsigned nargs, ...) {
+	uint8_t record[LOG_MAX_RECORD];
+	uint8_t *p = record;
+	va_list args;
+
+	*p++ = LOG_RECORD_SYNC;
+	p = log_put_varint(p, (uint32_t)fmt);
+
+	va_start(args, nargs);
+	while (nargs-- > 0) {
+		p = log_put_varint(p, va_arg(args, uint32_t));
+	}
+	va_end(args);
+
+	// Records are only ever written whole, so that the decoder never sees
+	// part of one.
+	if (!usb_vcp_write_record(LOG_PORT, record, p - record)) {
+		// LOG() may be used from interrupt handlers too.
+		__atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+	}
+}
+
+uint32_t log_get_dropped(void) {
+	return log_dropped;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+#include "usb.h"
+
+// LOG() writes printf style messages to the USB serial port LOG_PORT.
+//
+// With LOG_DEFERRED set to 1 (make DEFERRED_LOG=1) the message isn't
+// formatted on the board. Instead, the format string is placed in the
+// .logstr section (which takes no space in flash) and a binary record
+// containing the address of the format string along with the raw argument
+// words is sent. tools/logdecode.c reads the format strings back out of the
+// ELF file and does the formatting on the host. Ordinary text sent to the
+// port is passed through by the decoder.
+//
+// A record is the LOG_RECORD_SYNC byte followed by the format string
+// address and each of the arguments, all encoded as little endian base 128
+// varints (7 bits per byte, with the top bit set on all but the last byte).
+//
+// Deferred arguments must be 32 bits or smaller, and %s arguments must point
+// at strings in flash (i.e. string literals or const data). So %e, %f and
+// %ll can't be deferred; logdecode reports them as unsupported.
+//
+// LOG() may be called from interrupt handlers as well as the main loop, since
+// the usb_vcp transmit functions may. A deferred record is always written
+// whole, or dropped (and counted by log_get_dropped) if there isn't room.
+// Without LOG_DEFERRED, the message is written a piece at a time as it's
+// formatted, so a message from an interrupt handler may land in between the
+// pieces of one from the main loop.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if !defined(LOG_DEFERRED)
+#define LOG_DEFERRED	0
+#endif
+
+#if !defined(LOG_PORT)
+#define LOG_PORT	(USB_VCP_NUM_PORTS - 1)
+#endif
+
+#define LOG_RECORD_SYNC	0xa5
+#define LOG_MAX_ARGS	8
+
+// Counts the arguments (up to LOG_MAX_ARGS) passed to LOG().
+#define LOG_NARGS(...)	LOG_NARGS_(0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, n, ...)	n
+
+#if LOG_DEFERRED
+#define LOG(fmt, ...) do { \
+	static const char log_fmt_[] __attribute__((section(".logstr"))) = fmt; \
+	log_deferred(log_fmt_, LOG_NARGS(__VA_ARGS__), ##__VA_ARGS__); \
+} while (0)
+#else
+#define LOG(fmt, ...)	usb_vcp_printf(LOG_PORT, fmt, ##__VA_ARGS__)
+#endif
+
+void log_deferred(const char *fmt, unsigned nargs, ...);
+
+// Returns the number of deferred records which were dropped because the
+// USB transmit buffer was full.
+uint32_t log_get_dropped(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // LOG_H
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sections.h"
+
+#include <string.h>
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/scb.h>
+
+// Defined by the board linker scripts.
+extern uint8_t _ramfunc[];				// Start of .ramfunc in SRAM
+extern uint8_t _eramfunc[];				// End of .ramfunc in SRAM
+extern const uint8_t _ramfunc_loadaddr[];	// Start of .ramfunc in flash
+extern const uint32_t _vectors_loadaddr[];	// The vector table in flash
+
+#if RAMFUNC_ENABLE
+
+// The 16 Cortex-M exception vectors followed by the interrupt vectors.
+#define NUM_VECTORS	(16 + NVIC_IRQ_COUNT)
+
+// VTOR needs the table to be aligned to the next power of 2 above its size.
+#if NUM_VECTORS > 128
+#error ram_vectors needs more alignment
+#endif
+
+static uint32_t ram_vectors[NUM_VECTORS] __attribute__((aligned(512)));
+
+#endif
+
+void ramfunc_init(void) {
+#if RAMFUNC_ENABLE
+	memcpy(_ramfunc, _ramfunc_loadaddr, _eramfunc - _ramfunc);
+
+	// Fetching the vector from SRAM (rather than flash) saves a few cycles
+	// of interrupt latency, and again avoids ART misses.
+	memcpy(ram_vectors, _vectors_loadaddr, sizeof(ram_vectors));
+	__asm__ volatile ("dsb" ::: "memory");
+	SCB_VTOR = (uint32_t)ram_vectors;
+	__asm__ volatile ("dsb\n\tisb" ::: "memory");
+#endif
+}
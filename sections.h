@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SECTIONS_H
+#define SECTIONS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Placement of code and data in the STM32F4's memories. The sections used
+// here are defined by the board linker scripts (stm32f4-*.ld).
+
+// CCM_DATA places a variable in the 64K of core coupled memory (CCM) at
+// 0x10000000. Only the CPU can get at CCM, so CPU accesses to it never
+// compete with the DMA and USB traffic on the bus matrix, but it also means
+// that nothing in CCM can be used as a DMA buffer. The section is NOLOAD,
+// so CCM variables start out with garbage in them (rather than being zeroed
+// like .bss) and need to be initialized explicitly. The main stack is at the
+// top of CCM.
+#define CCM_DATA	__attribute__((section(".ccmram")))
+
+// RAMFUNC places a function in the .ramfunc section, which is copied from
+// flash into SRAM by ramfunc_init(). Code in SRAM runs without wait states,
+// so it doesn't suffer the occasional ART accelerator miss that code in
+// flash does, which makes its timing consistent. (CCM is on the data bus
+// only, so code can't run from there.) It's meant for the interrupt hot
+// paths. Calls between SRAM and flash go through veneers added by the
+// linker, and a RAMFUNC function which is inlined runs from wherever its
+// caller is, so its callers usually want to be marked as well.
+//
+// RAMFUNC_ENABLE=0 (make RAMFUNC=0) leaves everything in flash, for
+// comparison.
+#if !defined(RAMFUNC_ENABLE)
+#define RAMFUNC_ENABLE	1
+#endif
+
+#if RAMFUNC_ENABLE
+#define RAMFUNC		__attribute__((section(".ramfunc")))
+#else
+#define RAMFUNC
+#endif
+
+// Copies the .ramfunc section into SRAM, and moves the vector table into
+// SRAM as well. This needs to be called before any RAMFUNC function is, so
+// it's the first thing main does.
+void ramfunc_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SECTIONS_H
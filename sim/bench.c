@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Measures the firmware's echo latency and transmit throughput over the
+// first CDC port, the same way that they'd be measured against a board
+// (i.e. through the tty layer), and then exits. With more than one port,
+// it also checks that when every port transmits at once, each port's data
+// only comes out of that port.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim/sim.h"
+
+#define SIM_BENCH_ECHOES		1000
+#define SIM_BENCH_LINE_LEN		50
+#define SIM_BENCH_TIMEOUT_MS	5000
+
+static int sim_bench_fd;
+
+static uint64_t sim_bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * SIM_NS_PER_SEC + ts.tv_nsec;
+}
+
+static void sim_bench_fail(const char *what)
+{
+	fprintf(stderr, "sim bench: %s\n", what);
+	exit(1);
+}
+
+// Reads whatever is available into buf, waiting up to SIM_BENCH_TIMEOUT_MS
+// for the first byte. Returns the number of bytes read.
+static size_t sim_bench_read(char *buf, size_t len)
+{
+	struct pollfd pfd = { .fd = sim_bench_fd, .events = POLLIN };
+
+	if (poll(&pfd, 1, SIM_BENCH_TIMEOUT_MS) <= 0) {
+		sim_bench_fail("timed out waiting for the firmware");
+	}
+	ssize_t n = read(sim_bench_fd, buf, len);
+	if (n < 0 && errno != EAGAIN) {
+		sim_bench_fail("read failed");
+	}
+	return n < 0 ? 0 : n;
+}
+
+static void sim_bench_write(const char *buf, size_t len)
+{
+	if (write(sim_bench_fd, buf, len) != (ssize_t)len) {
+		sim_bench_fail("write failed");
+	}
+}
+
+// Reads until the output (which is kept, up to size - 1 bytes, in buf) ends
+// with a line starting with prefix. Returns the number of bytes read.
+static size_t sim_bench_read_until(const char *prefix, char *buf, size_t size)
+{
+	size_t total = 0;
+	size_t len = 0;
+	char chunk[4096];
+
+	buf[0] = '\0';
+	while (1) {
+		size_t n = sim_bench_read(chunk, sizeof(chunk));
+		total += n;
+
+		// Only the tail of the output matters.
+		if (n >= size - 1) {
+			memcpy(buf, chunk + n - (size - 1), size - 1);
+			len = size - 1;
+		} else {
+			if (len + n > size - 1) {
+				size_t drop = len + n - (size - 1);
+				memmove(buf, buf + drop, len - drop);
+				len -= drop;
+			}
+			memcpy(buf + len, chunk, n);
+			len += n;
+		}
+		buf[len] = '\0';
+
+		char *line = strstr(buf, prefix);
+		if (line != NULL && strchr(line, '\n') != NULL) {
+			*strchr(line, '\n') = '\0';
+			memmove(buf, line, strlen(line) + 1);
+			return total;
+		}
+	}
+}
+
+// Waits until the firmware has stopped sending its banner.
+static void sim_bench_drain(void)
+{
+	struct pollfd pfd = { .fd = sim_bench_fd, .events = POLLIN };
+	char buf[256];
+
+	while (poll(&pfd, 1, 200) > 0) {
+		if (read(sim_bench_fd, buf, sizeof(buf)) <= 0) {
+			break;
+		}
+	}
+}
+
+// Sends one character at a time and waits for it to be echoed. Every
+// SIM_BENCH_LINE_LEN characters the line is finished, so that the receive
+// buffer doesn't fill up.
+static void sim_bench_latency(void)
+{
+	uint64_t min = UINT64_MAX;
+	uint64_t max = 0;
+	uint64_t total = 0;
+	char buf[256];
+
+	for (unsigned i = 0; i < SIM_BENCH_ECHOES; i++) {
+		char ch = 'a' + i % 26;
+		uint64_t start = sim_bench_now();
+
+		sim_bench_write(&ch, 1);
+		if (sim_bench_read(buf, 1) != 1 || buf[0] != ch) {
+			sim_bench_fail("echo mismatch");
+		}
+		uint64_t elapsed = sim_bench_now() - start;
+
+		total += elapsed;
+		if (elapsed < min) {
+			min = elapsed;
+		}
+		if (elapsed > max) {
+			max = elapsed;
+		}
+		if ((i + 1) % SIM_BENCH_LINE_LEN == 0) {
+			sim_bench_write("\r", 1);
+			sim_bench_read_until("Line: ", buf, sizeof(buf));
+		}
+	}
+	printf("echo latency: min %llu us, avg %llu us, max %llu us (%u chars)\n",
+		   (unsigned long long)(min / 1000),
+		   (unsigned long long)(total / SIM_BENCH_ECHOES / 1000),
+		   (unsigned long long)(max / 1000), SIM_BENCH_ECHOES);
+}
+
+// Runs the firmware's txbench command, and measures the rate at which the
+// data arrives.
+static void sim_bench_throughput(void)
+{
+	char buf[256];
+
+	sim_bench_write("txbench\r", 8);
+	uint64_t start = sim_bench_now();
+	size_t bytes = sim_bench_read_until("txbench: ", buf, sizeof(buf));
+	uint64_t elapsed = sim_bench_now() - start;
+
+	if (elapsed == 0) {
+		elapsed = 1;
+	}
+	printf("%s\n", buf);
+	printf("host: %zu bytes in %llu ms = %llu bytes/sec\n", bytes,
+		   (unsigned long long)(elapsed / SIM_NS_PER_MS),
+		   (unsigned long long)(bytes * SIM_NS_PER_SEC / elapsed));
+}
+
+// What sim_bench_ports has seen on one port.
+typedef struct {
+	int		fd;
+	size_t	own_bytes;		// Bytes of the port's own digit
+	char	rest[256];		// Everything else: the echo and the report
+	size_t	rest_len;
+	bool	done;
+} sim_bench_port_t;
+
+// Runs the firmware's txports command, which streams a different digit out
+// of each port at the same time, and checks that each port only gets its
+// own digit, and all of it.
+static void sim_bench_ports(void)
+{
+	sim_bench_port_t port[USB_VCP_NUM_PORTS];
+	struct pollfd pfd[USB_VCP_NUM_PORTS];
+	unsigned remaining = USB_VCP_NUM_PORTS;
+
+	memset(port, 0, sizeof(port));
+	for (unsigned i = 0; i < USB_VCP_NUM_PORTS; i++) {
+		port[i].fd = i == 0 ? sim_bench_fd
+							: open(sim_usb_port_name(i), O_RDWR | O_NOCTTY | O_NONBLOCK);
+		if (port[i].fd < 0) {
+			sim_bench_fail("can't open the port");
+		}
+		pfd[i].fd = port[i].fd;
+		pfd[i].events = POLLIN;
+	}
+
+	// Opening the other ports connects them, and they may have log output
+	// waiting.
+	for (unsigned i = 1; i < USB_VCP_NUM_PORTS; i++) {
+		char buf[256];
+		while (poll(&pfd[i], 1, 200) > 0 && read(port[i].fd, buf, sizeof(buf)) > 0) {
+			;
+		}
+	}
+
+	sim_bench_write("txports\r", 8);
+	while (remaining > 0) {
+		if (poll(pfd, USB_VCP_NUM_PORTS, SIM_BENCH_TIMEOUT_MS) <= 0) {
+			sim_bench_fail("timed out waiting for txports");
+		}
+		for (unsigned i = 0; i < USB_VCP_NUM_PORTS; i++) {
+			sim_bench_port_t *p = &port[i];
+			char buf[4096];
+
+			if (p->done || !(pfd[i].revents & POLLIN)) {
+				continue;
+			}
+			ssize_t n = read(p->fd, buf, sizeof(buf));
+			for (ssize_t j = 0; j < n; j++) {
+				if (buf[j] == '0' + (char)i && strstr(p->rest, "txports: ") == NULL) {
+					p->own_bytes++;
+				} else if (p->rest_len < sizeof(p->rest) - 1) {
+					p->rest[p->rest_len++] = buf[j];
+				} else {
+					fprintf(stderr, "sim bench: port %u got data from another port\n", i);
+					exit(1);
+				}
+			}
+			p->rest[p->rest_len] = '\0';
+
+			// Apart from the port's own digit, all that can come before the
+			// report is the echo of the command (on port 0) and line ends.
+			char *report = strstr(p->rest, "txports: ");
+			if (report != NULL && strchr(report, '\n') != NULL) {
+				unsigned long sent = strtoul(report + 9, NULL, 10);
+				const char *echo = p->rest;
+				if (i == 0 && strncmp(echo, "txports", 7) == 0) {
+					echo += 7;
+				}
+				if (echo + strspn(echo, "\r\n") != report) {
+					fprintf(stderr, "sim bench: port %u got data from another port\n", i);
+					exit(1);
+				}
+				if (sent == 0 || sent != p->own_bytes) {
+					fprintf(stderr, "sim bench: port %u sent %lu bytes, got %zu\n",
+							i, sent, p->own_bytes);
+					exit(1);
+				}
+				p->done = true;
+				remaining--;
+			}
+		}
+	}
+	for (unsigned i = 1; i < USB_VCP_NUM_PORTS; i++) {
+		close(port[i].fd);
+	}
+	printf("txports: %u ports each got only their own %zu bytes\n",
+		   USB_VCP_NUM_PORTS, port[0].own_bytes);
+}
+
+void *sim_bench(void *arg)
+{
+	(void)arg;
+
+	sim_bench_fd = open(sim_usb_port_name(0), O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (sim_bench_fd < 0) {
+		sim_bench_fail("can't open the port");
+	}
+	sim_bench_drain();
+	sim_bench_latency();
+	sim_bench_throughput();
+	if (USB_VCP_NUM_PORTS > 1) {
+		sim_bench_ports();
+	}
+	fflush(stdout);
+	exit(0);
+}
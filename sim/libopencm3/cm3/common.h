@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Simulator versions of the libopencm3 headers. Only the parts which the
+// firmware uses are here. Peripheral registers which the firmware touches
+// directly are plain memory in the models (see sim/periph.c), and the
+// simulator is linked with -no-pie so that their addresses, like those of
+// the DMA buffers, fit in the 32 bits which libopencm3 uses for them.
+
+#ifndef SIM_LIBOPENCM3_CM3_COMMON_H
+#define SIM_LIBOPENCM3_CM3_COMMON_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MMIO32(addr)	(*(volatile uint32_t *)(uintptr_t)(addr))
+
+// The address of a simulated register block, as a libopencm3 peripheral
+// base address.
+#define SIM_PERIPH(regs)	((uint32_t)(uintptr_t)(regs))
+
+#endif // SIM_LIBOPENCM3_CM3_COMMON_H
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIM_LIBOPENCM3_CM3_NVIC_H
+#define SIM_LIBOPENCM3_CM3_NVIC_H
+
+#include <libopencm3/cm3/common.h>
+
+#define NVIC_DMA1_STREAM5_IRQ	16
+#define NVIC_DMA1_STREAM6_IRQ	17
+#define NVIC_TIM2_IRQ			28
+#define NVIC_USART2_IRQ			38
+#define NVIC_OTG_FS_IRQ			67
+
+#define NVIC_IRQ_COUNT			91
+
+void nvic_enable_irq(uint8_t irqn);
+void nvic_disable_irq(uint8_t irqn);
+uint8_t nvic_get_pending_irq(uint8_t irqn);
+void nvic_set_pending_irq(uint8_t irqn);
+void nvic_clear_pending_irq(uint8_t irqn);
+void nvic_set_priority(uint8_t irqn, uint8_t priority);
+
+// The handlers which the simulated peripherals can call. Those which the
+// firmware doesn't define do nothing.
+void sys_tick_handler(void);
+void dma1_stream5_isr(void);
+void dma1_stream6_isr(void);
+void tim2_isr(void);
+void usart2_isr(void);
+void otg_fs_isr(void);
+
+#endif // SIM_LIBOPENCM3_CM3_NVIC_H
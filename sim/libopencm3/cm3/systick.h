@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIM_LIBOPENCM3_CM3_SYSTICK_H
+#define SIM_LIBOPENCM3_CM3_SYSTICK_H
+
+#include <libopencm3/cm3/common.h>
+
+#define STK_CSR_CLKSOURCE_AHB_DIV8	0
+#define STK_CSR_CLKSOURCE_AHB		1
+
+void systick_set_reload(uint32_t value);
+void systick_set_clocksource(uint8_t clocksource);
+void systick_counter_enable(void);
+void systick_counter_disable(void);
+void systick_interrupt_enable(void);
+void systick_interrupt_disable(void);
+
+#endif // SIM_LIBOPENCM3_CM3_SYSTICK_H
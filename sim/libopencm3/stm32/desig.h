@@ -0,0 +1,27 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIM_LIBOPENCM3_STM32_DESIG_H
+#define SIM_LIBOPENCM3_STM32_DESIG_H
+
+#include <libopencm3/cm3/common.h>
+
+// The 96-bit unique device ID.
+extern const uint8_t sim_desig_unique_id[12];
+#define DESIG_UNIQUE_ID_BASE	((uintptr_t)sim_desig_unique_id)
+
+#endif // SIM_LIBOPENCM3_STM32_DESIG_H
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIM_LIBOPENCM3_STM32_GPIO_H
+#define SIM_LIBOPENCM3_STM32_GPIO_H
+
+#include <libopencm3/cm3/common.h>
+
+// The ports are only used as handles, so they keep their real addresses.
+#define GPIOA	0x40020000u
+#define GPIOB	0x40020400u
+#define GPIOC	0x40020800u
+#define GPIOD	0x40020c00u
+#define GPIOE	0x40021000u
+
+#define GPIO0	(1 << 0)
+#define GPIO1	(1 << 1)
+#define GPIO2	(1 << 2)
+#define GPIO3	(1 << 3)
+#define GPIO4	(1 << 4)
+#define GPIO5	(1 << 5)
+#define GPIO6	(1 << 6)
+#define GPIO7	(1 << 7)
+#define GPIO8	(1 << 8)
+#define GPIO9	(1 << 9)
+#define GPIO10	(1 << 10)
+#define GPIO11	(1 << 11)
+#define GPIO12	(1 << 12)
+#define GPIO13	(1 << 13)
+#define GPIO14	(1 << 14)
+#define GPIO15	(1 << 15)
+
+#define GPIO_MODE_INPUT		0x0
+#define GPIO_MODE_OUTPUT	0x1
+#define GPIO_MODE_AF		0x2
+#define GPIO_MODE_ANALOG	0x3
+
+#define GPIO_PUPD_NONE		0x0
+#define GPIO_PUPD_PULLUP	0x1
+#define GPIO_PUPD_PULLDOWN	0x2
+
+#define GPIO_AF7	0x7
+#define GPIO_AF10	0xa
+
+void gpio_mode_setup(uint32_t gpioport, uint8_t mode, uint8_t pull_up_down, uint16_t gpios);
+void gpio_set_af(uint32_t gpioport, uint8_t alt_func_num, uint16_t gpios);
+void gpio_set(uint32_t gpioport, uint16_t gpios);
+void gpio_clear(uint32_t gpioport, uint16_t gpios);
+void gpio_toggle(uint32_t gpioport, uint16_t gpios);
+uint16_t gpio_get(uint32_t gpioport, uint16_t gpios);
+
+#endif // SIM_LIBOPENCM3_STM32_GPIO_H
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIM_LIBOPENCM3_STM32_RCC_H
+#define SIM_LIBOPENCM3_STM32_RCC_H
+
+#include <libopencm3/cm3/common.h>
+
+// The GPIO clocks are consecutive, like the bits in RCC_AHB1ENR.
+enum rcc_periph_clken {
+	RCC_GPIOA, RCC_GPIOB, RCC_GPIOC, RCC_GPIOD, RCC_GPIOE,
+	RCC_GPIOF, RCC_GPIOG, RCC_GPIOH, RCC_GPIOI,
+	RCC_DMA1, RCC_DMA2, RCC_OTGFS, RCC_TIM2, RCC_USART2,
+};
+
+enum rcc_periph_rst {
+	RST_TIM2,
+};
+
+enum rcc_clock_3v3 {
+	RCC_CLOCK_3V3_168MHZ,
+	RCC_CLOCK_3V3_END
+};
+
+struct rcc_clock_scale {
+	uint32_t ahb_frequency;
+	uint32_t apb1_frequency;
+	uint32_t apb2_frequency;
+};
+
+extern const struct rcc_clock_scale rcc_hse_8mhz_3v3[RCC_CLOCK_3V3_END];
+extern const struct rcc_clock_scale rcc_hse_25mhz_3v3[RCC_CLOCK_3V3_END];
+
+extern uint32_t rcc_ahb_frequency;
+extern uint32_t rcc_apb1_frequency;
+extern uint32_t rcc_apb2_frequency;
+
+void rcc_clock_setup_hse_3v3(const struct rcc_clock_scale *clock);
+void rcc_periph_clock_enable(enum rcc_periph_clken clken);
+void rcc_periph_reset_pulse(enum rcc_periph_rst rst);
+
+#endif // SIM_LIBOPENCM3_STM32_RCC_H
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIM_LIBOPENCM3_STM32_TIMER_H
+#define SIM_LIBOPENCM3_STM32_TIMER_H
+
+#include <libopencm3/cm3/common.h>
+
+// Only TIM2 (a 32-bit timer) is simulated.
+#define TIM2	0x40000000u
+
+#define TIM_CR1_CKD_CK_INT	(0 << 8)
+#define TIM_CR1_CMS_EDGE	(0 << 5)
+#define TIM_CR1_DIR_UP		(0 << 4)
+
+#define TIM_DIER_UIE	(1 << 0)
+#define TIM_DIER_CC1IE	(1 << 1)
+
+#define TIM_SR_UIF		(1 << 0)
+#define TIM_SR_CC1IF	(1 << 1)
+
+#define TIM_EGR_UG		(1 << 0)
+#define TIM_EGR_CC1G	(1 << 1)
+
+enum tim_oc_id {
+	TIM_OC1 = 0,
+};
+
+void timer_set_mode(uint32_t timer_peripheral, uint32_t clock_div, uint32_t alignment, uint32_t direction);
+void timer_set_prescaler(uint32_t timer_peripheral, uint32_t value);
+void timer_set_period(uint32_t timer_peripheral, uint32_t period);
+void timer_disable_preload(uint32_t timer_peripheral);
+void timer_continuous_mode(uint32_t timer_peripheral);
+void timer_enable_counter(uint32_t timer_peripheral);
+uint32_t timer_get_counter(uint32_t timer_peripheral);
+void timer_set_oc_value(uint32_t timer_peripheral, enum tim_oc_id oc_id, uint32_t value);
+void timer_enable_irq(uint32_t timer_peripheral, uint32_t irq);
+void timer_disable_irq(uint32_t timer_peripheral, uint32_t irq);
+bool timer_get_flag(uint32_t timer_peripheral, uint32_t flag);
+void timer_clear_flag(uint32_t timer_peripheral, uint32_t flag);
+void timer_generate_event(uint32_t timer_peripheral, uint32_t event);
+
+#endif // SIM_LIBOPENCM3_STM32_TIMER_H
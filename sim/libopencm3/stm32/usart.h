@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIM_LIBOPENCM3_STM32_USART_H
+#define SIM_LIBOPENCM3_STM32_USART_H
+
+#include <libopencm3/cm3/common.h>
+
+// The register block. Reading SR and then DR doesn't clear any flags.
+extern uint32_t sim_usart2[7];
+#define USART2	SIM_PERIPH(sim_usart2)
+
+#define USART_SR(usart_base)	MMIO32((usart_base) + 0x00)
+#define USART_DR(usart_base)	MMIO32((usart_base) + 0x04)
+#define USART_BRR(usart_base)	MMIO32((usart_base) + 0x08)
+#define USART_CR1(usart_base)	MMIO32((usart_base) + 0x0c)
+#define USART_CR2(usart_base)	MMIO32((usart_base) + 0x10)
+#define USART_CR3(usart_base)	MMIO32((usart_base) + 0x14)
+
+#define USART2_SR	USART_SR(USART2)
+#define USART2_DR	USART_DR(USART2)
+
+#define USART_SR_PE		(1 << 0)
+#define USART_SR_FE		(1 << 1)
+#define USART_SR_NE		(1 << 2)
+#define USART_SR_ORE	(1 << 3)
+#define USART_SR_IDLE	(1 << 4)
+#define USART_SR_RXNE	(1 << 5)
+#define USART_SR_TC		(1 << 6)
+#define USART_SR_TXE	(1 << 7)
+
+#define USART_CR1_RE		(1 << 2)
+#define USART_CR1_TE		(1 << 3)
+#define USART_CR1_IDLEIE	(1 << 4)
+#define USART_CR1_PEIE		(1 << 8)
+#define USART_CR1_PS		(1 << 9)
+#define USART_CR1_PCE		(1 << 10)
+#define USART_CR1_M			(1 << 12)
+#define USART_CR1_UE		(1 << 13)
+
+#define USART_CR2_STOPBITS_MASK	(3 << 12)
+
+#define USART_CR3_EIE		(1 << 0)
+#define USART_CR3_DMAR		(1 << 6)
+#define USART_CR3_DMAT		(1 << 7)
+#define USART_CR3_RTSE		(1 << 8)
+#define USART_CR3_CTSE		(1 << 9)
+
+#define USART_STOPBITS_1	(0x00 << 12)
+#define USART_STOPBITS_0_5	(0x01 << 12)
+#define USART_STOPBITS_2	(0x02 << 12)
+#define USART_STOPBITS_1_5	(0x03 << 12)
+
+#define USART_MODE_RX		USART_CR1_RE
+#define USART_MODE_TX		USART_CR1_TE
+#define USART_MODE_TX_RX	(USART_CR1_RE | USART_CR1_TE)
+#define USART_MODE_MASK		(USART_CR1_RE | USART_CR1_TE)
+
+#define USART_PARITY_NONE	0x00
+#define USART_PARITY_EVEN	USART_CR1_PCE
+#define USART_PARITY_ODD	(USART_CR1_PS | USART_CR1_PCE)
+#define USART_PARITY_MASK	(USART_CR1_PS | USART_CR1_PCE)
+
+#define USART_FLOWCONTROL_NONE		0x00
+#define USART_FLOWCONTROL_MASK		(USART_CR3_RTSE | USART_CR3_CTSE)
+
+void usart_set_baudrate(uint32_t usart, uint32_t baud);
+void usart_set_databits(uint32_t usart, uint32_t bits);
+void usart_set_stopbits(uint32_t usart, uint32_t stopbits);
+void usart_set_parity(uint32_t usart, uint32_t parity);
+void usart_set_mode(uint32_t usart, uint32_t mode);
+void usart_set_flow_control(uint32_t usart, uint32_t flowcontrol);
+void usart_enable(uint32_t usart);
+void usart_disable(uint32_t usart);
+void usart_enable_rx_dma(uint32_t usart);
+void usart_disable_rx_dma(uint32_t usart);
+void usart_enable_tx_dma(uint32_t usart);
+void usart_disable_tx_dma(uint32_t usart);
+
+#endif // SIM_LIBOPENCM3_STM32_USART_H
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIM_LIBOPENCM3_USB_USBD_H
+#define SIM_LIBOPENCM3_USB_USBD_H
+
+#include <libopencm3/usb/usbstd.h>
+
+// The device side of the simulated USB bus (see sim/usbd.c). The calls
+// behave like libopencm3's, but there's only one driver, and the host at
+// the other end is simulated too.
+
+enum usbd_request_return_codes {
+	USBD_REQ_NOTSUPP		= 0,
+	USBD_REQ_HANDLED		= 1,
+	USBD_REQ_NEXT_CALLBACK	= 2,
+};
+
+typedef struct _usbd_driver usbd_driver;
+typedef struct _usbd_device usbd_device;
+
+extern const usbd_driver otgfs_usb_driver;
+
+typedef void (*usbd_control_complete_callback)(usbd_device *usbd_dev,
+		struct usb_setup_data *req);
+
+typedef int (*usbd_control_callback)(usbd_device *usbd_dev,
+		struct usb_setup_data *req, uint8_t **buf, uint16_t *len,
+		usbd_control_complete_callback *complete);
+
+typedef void (*usbd_set_config_callback)(usbd_device *usbd_dev,
+		uint16_t wValue);
+
+typedef void (*usbd_endpoint_callback)(usbd_device *usbd_dev, uint8_t ep);
+
+usbd_device *usbd_init(const usbd_driver *driver,
+		const struct usb_device_descriptor *dev,
+		const struct usb_config_descriptor *conf,
+		const char * const *strings, int num_strings,
+		uint8_t *control_buffer, uint16_t control_buffer_size);
+
+int usbd_register_control_callback(usbd_device *usbd_dev, uint8_t type,
+		uint8_t type_mask, usbd_control_callback callback);
+int usbd_register_set_config_callback(usbd_device *usbd_dev,
+		usbd_set_config_callback callback);
+void usbd_register_sof_callback(usbd_device *usbd_dev, void (*callback)(void));
+
+void usbd_poll(usbd_device *usbd_dev);
+
+void usbd_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type,
+		uint16_t max_size, usbd_endpoint_callback callback);
+uint16_t usbd_ep_write_packet(usbd_device *usbd_dev, uint8_t addr,
+		const void *buf, uint16_t len);
+uint16_t usbd_ep_read_packet(usbd_device *usbd_dev, uint8_t addr,
+		void *buf, uint16_t len);
+void usbd_ep_nak_set(usbd_device *usbd_dev, uint8_t addr, uint8_t nak);
+
+#endif // SIM_LIBOPENCM3_USB_USBD_H
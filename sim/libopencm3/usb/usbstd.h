@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIM_LIBOPENCM3_USB_USBSTD_H
+#define SIM_LIBOPENCM3_USB_USBSTD_H
+
+#include <libopencm3/cm3/common.h>
+
+// The standard USB requests and descriptors, laid out as in libopencm3.
+
+struct usb_setup_data {
+	uint8_t bmRequestType;
+	uint8_t bRequest;
+	uint16_t wValue;
+	uint16_t wIndex;
+	uint16_t wLength;
+} __attribute__((packed));
+
+#define USB_REQ_GET_STATUS			0
+#define USB_REQ_CLEAR_FEATURE		1
+#define USB_REQ_SET_FEATURE			3
+#define USB_REQ_SET_ADDRESS			5
+#define USB_REQ_GET_DESCRIPTOR		6
+#define USB_REQ_SET_DESCRIPTOR		7
+#define USB_REQ_GET_CONFIGURATION	8
+#define USB_REQ_SET_CONFIGURATION	9
+#define USB_REQ_GET_INTERFACE		10
+#define USB_REQ_SET_INTERFACE		11
+
+#define USB_REQ_TYPE_IN				0x80
+#define USB_REQ_TYPE_STANDARD		0x00
+#define USB_REQ_TYPE_CLASS			0x20
+#define USB_REQ_TYPE_VENDOR			0x40
+#define USB_REQ_TYPE_DEVICE			0x00
+#define USB_REQ_TYPE_INTERFACE		0x01
+#define USB_REQ_TYPE_ENDPOINT		0x02
+
+#define USB_REQ_TYPE_DIRECTION		0x80
+#define USB_REQ_TYPE_TYPE			0x60
+#define USB_REQ_TYPE_RECIPIENT		0x1f
+
+#define USB_DT_DEVICE					1
+#define USB_DT_CONFIGURATION			2
+#define USB_DT_STRING					3
+#define USB_DT_INTERFACE				4
+#define USB_DT_ENDPOINT					5
+#define USB_DT_INTERFACE_ASSOCIATION	11
+
+#define USB_CLASS_CDC			0x02
+#define USB_CLASS_DATA			0x0a
+#define USB_CLASS_MISCELLANEOUS	0xef
+
+struct usb_device_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint16_t bcdUSB;
+	uint8_t bDeviceClass;
+	uint8_t bDeviceSubClass;
+	uint8_t bDeviceProtocol;
+	uint8_t bMaxPacketSize0;
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t bcdDevice;
+	uint8_t iManufacturer;
+	uint8_t iProduct;
+	uint8_t iSerialNumber;
+	uint8_t bNumConfigurations;
+} __attribute__((packed));
+
+#define USB_DT_DEVICE_SIZE	sizeof(struct usb_device_descriptor)
+
+struct usb_config_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint16_t wTotalLength;
+	uint8_t bNumInterfaces;
+	uint8_t bConfigurationValue;
+	uint8_t iConfiguration;
+	uint8_t bmAttributes;
+	uint8_t bMaxPower;
+
+	// Descriptor ends here. The following are used internally:
+	const struct usb_interface {
+		uint8_t *cur_altsetting;
+		uint8_t num_altsetting;
+		const struct usb_iface_assoc_descriptor *iface_assoc;
+		const struct usb_interface_descriptor *altsetting;
+	} *interface;
+} __attribute__((packed));
+
+#define USB_DT_CONFIGURATION_SIZE	9
+
+struct usb_interface_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bInterfaceNumber;
+	uint8_t bAlternateSetting;
+	uint8_t bNumEndpoints;
+	uint8_t bInterfaceClass;
+	uint8_t bInterfaceSubClass;
+	uint8_t bInterfaceProtocol;
+	uint8_t iInterface;
+
+	// Descriptor ends here. The following are used internally:
+	const struct usb_endpoint_descriptor *endpoint;
+	const void *extra;
+	int extralen;
+} __attribute__((packed));
+
+#define USB_DT_INTERFACE_SIZE	9
+
+struct usb_endpoint_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bEndpointAddress;
+	uint8_t bmAttributes;
+	uint16_t wMaxPacketSize;
+	uint8_t bInterval;
+
+	// Descriptor ends here. The following are used internally:
+	const void *extra;
+	int extralen;
+} __attribute__((packed));
+
+#define USB_DT_ENDPOINT_SIZE	7
+
+#define USB_ENDPOINT_ADDR_IN(x)		(0x80 | (x))
+#define USB_ENDPOINT_ADDR_OUT(x)	(x)
+
+#define USB_ENDPOINT_ATTR_CONTROL		0x00
+#define USB_ENDPOINT_ATTR_ISOCHRONOUS	0x01
+#define USB_ENDPOINT_ATTR_BULK			0x02
+#define USB_ENDPOINT_ATTR_INTERRUPT		0x03
+#define USB_ENDPOINT_ATTR_TYPE			0x03
+
+struct usb_iface_assoc_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bFirstInterface;
+	uint8_t bInterfaceCount;
+	uint8_t bFunctionClass;
+	uint8_t bFunctionSubClass;
+	uint8_t bFunctionProtocol;
+	uint8_t iFunction;
+} __attribute__((packed));
+
+#define USB_DT_INTERFACE_ASSOCIATION_SIZE	sizeof(struct usb_iface_assoc_descriptor)
+
+#endif // SIM_LIBOPENCM3_USB_USBSTD_H
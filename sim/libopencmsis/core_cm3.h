@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIM_LIBOPENCMSIS_CORE_CM3_H
+#define SIM_LIBOPENCMSIS_CORE_CM3_H
+
+// Sleeps until an enabled interrupt is pending (see sim/nvic.c).
+void sim_wfi(void);
+
+static inline void __WFI(void)
+{
+	sim_wfi();
+}
+
+#endif // SIM_LIBOPENCMSIS_CORE_CM3_H
@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The simulated NVIC. Interrupts are delivered to the firmware thread
+// (the simulated CPU) as SIGUSR1, and the signal handler calls the handler
+// for each interrupt which is both pending and enabled. Blocking the
+// signal is the equivalent of setting PRIMASK. Every interrupt has the same
+// priority, so handlers never preempt each other, and when several are
+// pending the one with the lowest exception number runs first.
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/nvic.h>
+
+#include "sim/sim.h"
+
+#define SIM_IRQ_SIGNAL	SIGUSR1
+
+// The handlers which the firmware doesn't define do nothing (libopencm3
+// does the same thing using weak aliases in its vector table).
+#pragma weak sys_tick_handler = sim_null_handler
+#pragma weak dma1_stream5_isr = sim_null_handler
+#pragma weak dma1_stream6_isr = sim_null_handler
+#pragma weak tim2_isr = sim_null_handler
+#pragma weak usart2_isr = sim_null_handler
+#pragma weak otg_fs_isr = sim_null_handler
+
+// In priority order.
+static const struct {
+	unsigned	irqn;
+	void		(*handler)(void);
+} sim_irq[] = {
+	{ SIM_SYSTICK_IRQ,			sys_tick_handler },
+	{ NVIC_DMA1_STREAM5_IRQ,	dma1_stream5_isr },
+	{ NVIC_DMA1_STREAM6_IRQ,	dma1_stream6_isr },
+	{ NVIC_TIM2_IRQ,			tim2_isr },
+	{ NVIC_USART2_IRQ,			usart2_isr },
+	{ NVIC_OTG_FS_IRQ,			otg_fs_isr },
+};
+#define NUM_SIM_IRQS	(sizeof(sim_irq) / sizeof(sim_irq[0]))
+
+// One bit per entry in sim_irq.
+static volatile uint32_t sim_irq_pending;
+static volatile uint32_t sim_irq_enabled;
+
+static pthread_t sim_cpu_thread;
+static sigset_t sim_irq_sigset;
+
+void sim_null_handler(void)
+{
+}
+
+static uint32_t sim_irq_bit(unsigned irqn)
+{
+	for (unsigned i = 0; i < NUM_SIM_IRQS; i++) {
+		if (sim_irq[i].irqn == irqn) {
+			return 1u << i;
+		}
+	}
+	return 0;
+}
+
+static void sim_irq_handler(int sig)
+{
+	int saved_errno = errno;
+	uint32_t active;
+
+	(void)sig;
+
+	// The signal is blocked while we're in here, so anything raised in the
+	// meantime is picked up by the loop rather than by nesting.
+	while ((active = sim_irq_pending & sim_irq_enabled) != 0) {
+		unsigned i = __builtin_ctz(active);
+		__atomic_fetch_and(&sim_irq_pending, ~(1u << i), __ATOMIC_SEQ_CST);
+		sim_irq[i].handler();
+	}
+	errno = saved_errno;
+}
+
+// Signals the CPU if an enabled interrupt is pending. Signals don't queue,
+// so an extra one is harmless and the handler catches everything.
+static void sim_irq_kick(void)
+{
+	if (sim_irq_pending & sim_irq_enabled) {
+		pthread_kill(sim_cpu_thread, SIM_IRQ_SIGNAL);
+	}
+}
+
+void sim_irq_init(void)
+{
+	struct sigaction sa = {
+		.sa_handler = sim_irq_handler,
+		.sa_flags = SA_RESTART,
+	};
+
+	sim_cpu_thread = pthread_self();
+	sigemptyset(&sim_irq_sigset);
+	sigaddset(&sim_irq_sigset, SIM_IRQ_SIGNAL);
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIM_IRQ_SIGNAL, &sa, NULL);
+}
+
+void sim_irq_raise(unsigned irqn)
+{
+	__atomic_fetch_or(&sim_irq_pending, sim_irq_bit(irqn), __ATOMIC_SEQ_CST);
+	sim_irq_kick();
+}
+
+void sim_irq_set_enabled(unsigned irqn, bool enabled)
+{
+	if (enabled) {
+		__atomic_fetch_or(&sim_irq_enabled, sim_irq_bit(irqn), __ATOMIC_SEQ_CST);
+		sim_irq_kick();
+	} else {
+		__atomic_fetch_and(&sim_irq_enabled, ~sim_irq_bit(irqn), __ATOMIC_SEQ_CST);
+	}
+}
+
+void sim_wfi(void)
+{
+	sigset_t mask;
+
+	pthread_sigmask(SIG_BLOCK, NULL, &mask);
+	if (!sigismember(&mask, SIM_IRQ_SIGNAL)) {
+		// Interrupts are enabled, so sleep until one has been handled.
+		sigsuspend(&mask);
+		return;
+	}
+
+	// Interrupts are masked. Like WFI, wake up when one is pending, but
+	// leave it pending (by raising the signal again) so that the handler
+	// runs once they're unmasked.
+	if (sim_irq_pending & sim_irq_enabled) {
+		return;
+	}
+	int sig;
+	sigwait(&sim_irq_sigset, &sig);
+	pthread_kill(sim_cpu_thread, SIM_IRQ_SIGNAL);
+}
+
+void nvic_enable_irq(uint8_t irqn)
+{
+	sim_irq_set_enabled(irqn, true);
+}
+
+void nvic_disable_irq(uint8_t irqn)
+{
+	sim_irq_set_enabled(irqn, false);
+}
+
+uint8_t nvic_get_pending_irq(uint8_t irqn)
+{
+	return (sim_irq_pending & sim_irq_bit(irqn)) != 0;
+}
+
+void nvic_set_pending_irq(uint8_t irqn)
+{
+	sim_irq_raise(irqn);
+}
+
+void nvic_clear_pending_irq(uint8_t irqn)
+{
+	__atomic_fetch_and(&sim_irq_pending, ~sim_irq_bit(irqn), __ATOMIC_SEQ_CST);
+}
+
+void nvic_set_priority(uint8_t irqn, uint8_t priority)
+{
+	// Everything runs at the same priority.
+	(void)irqn;
+	(void)priority;
+}
+
+void cm_enable_interrupts(void)
+{
+	pthread_sigmask(SIG_UNBLOCK, &sim_irq_sigset, NULL);
+}
+
+void cm_disable_interrupts(void)
+{
+	pthread_sigmask(SIG_BLOCK, &sim_irq_sigset, NULL);
+}
+
+bool cm_is_masked_interrupts(void)
+{
+	sigset_t mask;
+
+	pthread_sigmask(SIG_BLOCK, NULL, &mask);
+	return sigismember(&mask, SIM_IRQ_SIGNAL);
+}
+
+uint32_t cm_mask_interrupts(uint32_t mask)
+{
+	sigset_t old;
+
+	pthread_sigmask(mask ? SIG_BLOCK : SIG_UNBLOCK, &sim_irq_sigset, &old);
+	return sigismember(&old, SIM_IRQ_SIGNAL);
+}
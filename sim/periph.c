@@ -0,0 +1,746 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Models of the STM32F4 peripherals used by the firmware, other than USB:
+// the clocks, GPIO, the SysTick and TIM2 timebases, the DMA streams and
+// USART2. USART2 is connected to the console: what the firmware sends is
+// written to stdout, and what's typed on stdin is received.
+//
+// The firmware's side of each model is a set of libopencm3 calls. The
+// simulator's side is sim_periph_run, which is called from the peripheral
+// thread to make things happen at the right time.
+
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/scb.h>
+#include <libopencm3/cm3/systick.h>
+#include <libopencm3/stm32/desig.h>
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
+#include <libopencm3/stm32/usart.h>
+
+#include "sim/sim.h"
+
+#define SIM_NEVER	UINT64_MAX
+
+/* ---- RCC ---------------------------------------------------------------- */
+
+const struct rcc_clock_scale rcc_hse_8mhz_3v3[RCC_CLOCK_3V3_END] = {
+	[RCC_CLOCK_3V3_168MHZ] = {
+		.ahb_frequency = 168000000,
+		.apb1_frequency = 42000000,
+		.apb2_frequency = 84000000,
+	},
+};
+
+const struct rcc_clock_scale rcc_hse_25mhz_3v3[RCC_CLOCK_3V3_END] = {
+	[RCC_CLOCK_3V3_168MHZ] = {
+		.ahb_frequency = 168000000,
+		.apb1_frequency = 42000000,
+		.apb2_frequency = 84000000,
+	},
+};
+
+// Everything runs from the 16 MHz HSI out of reset.
+uint32_t rcc_ahb_frequency = 16000000;
+uint32_t rcc_apb1_frequency = 16000000;
+uint32_t rcc_apb2_frequency = 16000000;
+
+void rcc_clock_setup_hse_3v3(const struct rcc_clock_scale *clock)
+{
+	rcc_ahb_frequency = clock->ahb_frequency;
+	rcc_apb1_frequency = clock->apb1_frequency;
+	rcc_apb2_frequency = clock->apb2_frequency;
+}
+
+void rcc_periph_clock_enable(enum rcc_periph_clken clken)
+{
+	(void)clken;
+}
+
+static void sim_tim2_reset(void);
+
+void rcc_periph_reset_pulse(enum rcc_periph_rst rst)
+{
+	if (rst == RST_TIM2) {
+		sim_tim2_reset();
+	}
+}
+
+/* ---- Cortex-M ----------------------------------------------------------- */
+
+uint32_t sim_scb_vtor;
+
+uint32_t sim_cycle_count(void)
+{
+	return (uint32_t)(sim_now() * (rcc_ahb_frequency / 1000000) / 1000);
+}
+
+bool dwt_enable_cycle_counter(void)
+{
+	return true;
+}
+
+uint32_t dwt_read_cycle_counter(void)
+{
+	return sim_cycle_count();
+}
+
+// SysTick only needs to produce interrupts at the right rate.
+static struct {
+	uint32_t			reload;
+	uint64_t			period;		// ns
+	volatile uint64_t	next;		// ns, or SIM_NEVER when stopped
+} sim_systick = {
+	.next = SIM_NEVER,
+};
+
+void systick_set_reload(uint32_t value)
+{
+	sim_systick.reload = value;
+}
+
+void systick_set_clocksource(uint8_t clocksource)
+{
+	(void)clocksource;
+}
+
+void systick_counter_enable(void)
+{
+	sim_systick.period = (sim_systick.reload + 1) * SIM_NS_PER_SEC / rcc_ahb_frequency;
+	sim_systick.next = sim_now() + sim_systick.period;
+	sim_wake();
+}
+
+void systick_counter_disable(void)
+{
+	sim_systick.next = SIM_NEVER;
+}
+
+void systick_interrupt_enable(void)
+{
+	sim_irq_set_enabled(SIM_SYSTICK_IRQ, true);
+}
+
+void systick_interrupt_disable(void)
+{
+	sim_irq_set_enabled(SIM_SYSTICK_IRQ, false);
+}
+
+static uint64_t sim_systick_run(uint64_t now)
+{
+	if (sim_systick.next == SIM_NEVER) {
+		return SIM_NEVER;
+	}
+	if (now >= sim_systick.next) {
+		sim_systick.next += sim_systick.period;
+		if (sim_systick.next <= now) {
+			// We've fallen behind. Ticks which a busy CPU would have
+			// missed are lost here too.
+			sim_systick.next = now + sim_systick.period;
+		}
+		sim_irq_raise(SIM_SYSTICK_IRQ);
+	}
+	return sim_systick.next;
+}
+
+/* ---- GPIO --------------------------------------------------------------- */
+
+#define SIM_GPIO_PORTS	9
+#define SIM_GPIO_INDEX(gpioport)	(((gpioport) - GPIOA) / (GPIOB - GPIOA))
+
+static volatile uint16_t sim_gpio_odr[SIM_GPIO_PORTS];
+
+void gpio_mode_setup(uint32_t gpioport, uint8_t mode, uint8_t pull_up_down, uint16_t gpios)
+{
+	(void)gpioport;
+	(void)mode;
+	(void)pull_up_down;
+	(void)gpios;
+}
+
+void gpio_set_af(uint32_t gpioport, uint8_t alt_func_num, uint16_t gpios)
+{
+	(void)gpioport;
+	(void)alt_func_num;
+	(void)gpios;
+}
+
+void gpio_set(uint32_t gpioport, uint16_t gpios)
+{
+	sim_gpio_odr[SIM_GPIO_INDEX(gpioport)] |= gpios;
+}
+
+void gpio_clear(uint32_t gpioport, uint16_t gpios)
+{
+	sim_gpio_odr[SIM_GPIO_INDEX(gpioport)] &= ~gpios;
+}
+
+void gpio_toggle(uint32_t gpioport, uint16_t gpios)
+{
+	sim_gpio_odr[SIM_GPIO_INDEX(gpioport)] ^= gpios;
+}
+
+uint16_t gpio_get(uint32_t gpioport, uint16_t gpios)
+{
+	// Nothing drives the inputs, so the pins read back what's output.
+	return sim_gpio_odr[SIM_GPIO_INDEX(gpioport)] & gpios;
+}
+
+/* ---- TIM2 --------------------------------------------------------------- */
+
+// The counter is worked out from the time, so only the compare and the
+// wrap need to be watched for.
+static struct {
+	uint32_t			psc;
+	volatile bool		enabled;
+	volatile uint64_t	start;		// ns, when the counter was 0
+	volatile uint64_t	tick;		// ns per count
+	volatile uint32_t	dier;
+	volatile uint32_t	sr;
+	volatile uint32_t	ccr1;
+	uint64_t			checked;	// Counts up to the last sim_tim2_run
+} sim_tim2;
+
+static void sim_tim2_reset(void)
+{
+	memset((void *)&sim_tim2, 0, sizeof(sim_tim2));
+	sim_tim2.tick = 1;
+}
+
+// Returns the number of counts since the counter was started (which is
+// 64 bits, so it doesn't wrap).
+static uint64_t sim_tim2_counts(uint64_t now)
+{
+	if (!sim_tim2.enabled || now < sim_tim2.start) {
+		return 0;
+	}
+	return (now - sim_tim2.start) / sim_tim2.tick;
+}
+
+static void sim_tim2_set_flag(uint32_t flag)
+{
+	__atomic_fetch_or(&sim_tim2.sr, flag, __ATOMIC_SEQ_CST);
+	if (sim_tim2.dier & flag) {
+		// The DIER interrupt enables line up with the SR flags.
+		sim_irq_raise(NVIC_TIM2_IRQ);
+	}
+}
+
+void timer_set_mode(uint32_t timer_peripheral, uint32_t clock_div, uint32_t alignment, uint32_t direction)
+{
+	(void)timer_peripheral;
+	(void)clock_div;
+	(void)alignment;
+	(void)direction;
+}
+
+void timer_set_prescaler(uint32_t timer_peripheral, uint32_t value)
+{
+	(void)timer_peripheral;
+	sim_tim2.psc = value;
+}
+
+void timer_set_period(uint32_t timer_peripheral, uint32_t period)
+{
+	// Only the full 32-bit period is simulated.
+	(void)timer_peripheral;
+	(void)period;
+}
+
+void timer_disable_preload(uint32_t timer_peripheral)
+{
+	(void)timer_peripheral;
+}
+
+void timer_continuous_mode(uint32_t timer_peripheral)
+{
+	(void)timer_peripheral;
+}
+
+void timer_enable_counter(uint32_t timer_peripheral)
+{
+	(void)timer_peripheral;
+	if (!sim_tim2.enabled) {
+		sim_tim2.start = sim_now();
+		sim_tim2.checked = 0;
+		sim_tim2.enabled = true;
+		sim_wake();
+	}
+}
+
+uint32_t timer_get_counter(uint32_t timer_peripheral)
+{
+	(void)timer_peripheral;
+	return (uint32_t)sim_tim2_counts(sim_now());
+}
+
+void timer_set_oc_value(uint32_t timer_peripheral, enum tim_oc_id oc_id, uint32_t value)
+{
+	(void)timer_peripheral;
+	(void)oc_id;
+	sim_tim2.ccr1 = value;
+	sim_wake();
+}
+
+void timer_enable_irq(uint32_t timer_peripheral, uint32_t irq)
+{
+	(void)timer_peripheral;
+	__atomic_fetch_or(&sim_tim2.dier, irq, __ATOMIC_SEQ_CST);
+	if (sim_tim2.sr & irq) {
+		sim_irq_raise(NVIC_TIM2_IRQ);
+	}
+	sim_wake();
+}
+
+void timer_disable_irq(uint32_t timer_peripheral, uint32_t irq)
+{
+	(void)timer_peripheral;
+	__atomic_fetch_and(&sim_tim2.dier, ~irq, __ATOMIC_SEQ_CST);
+}
+
+bool timer_get_flag(uint32_t timer_peripheral, uint32_t flag)
+{
+	(void)timer_peripheral;
+	return (sim_tim2.sr & flag) != 0;
+}
+
+void timer_clear_flag(uint32_t timer_peripheral, uint32_t flag)
+{
+	(void)timer_peripheral;
+	__atomic_fetch_and(&sim_tim2.sr, ~flag, __ATOMIC_SEQ_CST);
+}
+
+void timer_generate_event(uint32_t timer_peripheral, uint32_t event)
+{
+	(void)timer_peripheral;
+	if (event & TIM_EGR_UG) {
+		// Restarts the counter, and loads the prescaler. The counter is
+		// clocked at twice the APB1 clock when APB1 is divided down.
+		uint32_t timer_clock = rcc_apb1_frequency;
+		if (rcc_apb1_frequency != rcc_ahb_frequency) {
+			timer_clock *= 2;
+		}
+		sim_tim2.tick = (uint64_t)(sim_tim2.psc + 1) * SIM_NS_PER_SEC / timer_clock;
+		sim_tim2.start = sim_now();
+		sim_tim2.checked = 0;
+		sim_tim2_set_flag(TIM_SR_UIF);
+	}
+	if (event & TIM_EGR_CC1G) {
+		sim_tim2_set_flag(TIM_SR_CC1IF);
+	}
+}
+
+static uint64_t sim_tim2_run(uint64_t now)
+{
+	if (!sim_tim2.enabled) {
+		return SIM_NEVER;
+	}
+	uint64_t counts = sim_tim2_counts(now);
+	uint64_t checked = sim_tim2.checked;
+	uint32_t ccr1 = sim_tim2.ccr1;
+
+	if (counts > checked) {
+		// Did the counter pass CCR1 (or wrap) since we last looked?
+		if ((uint32_t)(ccr1 - (uint32_t)checked - 1) < counts - checked) {
+			sim_tim2_set_flag(TIM_SR_CC1IF);
+		}
+		if ((counts >> 32) != (checked >> 32)) {
+			sim_tim2_set_flag(TIM_SR_UIF);
+		}
+		sim_tim2.checked = counts;
+	}
+
+	// The next compare match. The wrap is 24 days away, so we just wait
+	// for it to happen in between.
+	if (!(sim_tim2.dier & TIM_DIER_CC1IE)) {
+		return SIM_NEVER;
+	}
+	uint64_t until = (uint32_t)(ccr1 - (uint32_t)counts);
+	if (until == 0) {
+		// It matched at counts, so the next match is a whole wrap away.
+		until = 1ull << 32;
+	}
+	return sim_tim2.start + (counts + until) * sim_tim2.tick;
+}
+
+/* ---- DMA ---------------------------------------------------------------- */
+
+typedef struct {
+	volatile uint32_t	cr;
+	volatile uint32_t	ndtr;
+	uint32_t			size;		// ndtr when the stream was enabled
+	volatile uint32_t	par;
+	volatile uint32_t	m0ar;
+	volatile uint32_t	flags;		// DMA_xxIF
+	volatile uint64_t	done;		// ns, when a peripheral transfer finishes
+} sim_dma_stream_t;
+
+// Only DMA1 is used.
+static sim_dma_stream_t sim_dma1[8];
+
+static const uint8_t sim_dma1_irq[8] = {
+	[DMA_STREAM5] = NVIC_DMA1_STREAM5_IRQ,
+	[DMA_STREAM6] = NVIC_DMA1_STREAM6_IRQ,
+};
+
+static uint64_t sim_usart_char_time(void);
+
+static void sim_dma_set_flags(uint8_t stream, uint32_t flags)
+{
+	sim_dma_stream_t *s = &sim_dma1[stream];
+
+	__atomic_fetch_or(&s->flags, flags, __ATOMIC_SEQ_CST);
+	if (((flags & DMA_TCIF) && (s->cr & DMA_SxCR_TCIE))
+	||	((flags & DMA_HTIF) && (s->cr & DMA_SxCR_HTIE))) {
+		sim_irq_raise(sim_dma1_irq[stream]);
+	}
+}
+
+void dma_stream_reset(uint32_t dma, uint8_t stream)
+{
+	(void)dma;
+	memset((void *)&sim_dma1[stream], 0, sizeof(sim_dma1[stream]));
+}
+
+void dma_channel_select(uint32_t dma, uint8_t stream, uint32_t channel)
+{
+	(void)dma;
+	sim_dma1[stream].cr = (sim_dma1[stream].cr & ~DMA_SxCR_CHSEL_MASK) | channel;
+}
+
+void dma_set_priority(uint32_t dma, uint8_t stream, uint32_t prio)
+{
+	(void)dma;
+	sim_dma1[stream].cr = (sim_dma1[stream].cr & ~DMA_SxCR_PL_MASK) | prio;
+}
+
+void dma_set_memory_size(uint32_t dma, uint8_t stream, uint32_t mem_size)
+{
+	// Only byte transfers are simulated.
+	(void)dma;
+	(void)stream;
+	(void)mem_size;
+}
+
+void dma_set_peripheral_size(uint32_t dma, uint8_t stream, uint32_t peripheral_size)
+{
+	(void)dma;
+	(void)stream;
+	(void)peripheral_size;
+}
+
+void dma_enable_memory_increment_mode(uint32_t dma, uint8_t stream)
+{
+	(void)dma;
+	sim_dma1[stream].cr |= DMA_SxCR_MINC;
+}
+
+void dma_enable_circular_mode(uint32_t dma, uint8_t stream)
+{
+	(void)dma;
+	sim_dma1[stream].cr |= DMA_SxCR_CIRC;
+}
+
+void dma_set_transfer_mode(uint32_t dma, uint8_t stream, uint32_t direction)
+{
+	(void)dma;
+	sim_dma1[stream].cr = (sim_dma1[stream].cr & ~DMA_SxCR_DIR_MASK) | direction;
+}
+
+void dma_set_peripheral_address(uint32_t dma, uint8_t stream, uint32_t address)
+{
+	(void)dma;
+	sim_dma1[stream].par = address;
+}
+
+void dma_set_memory_address(uint32_t dma, uint8_t stream, uint32_t address)
+{
+	(void)dma;
+	sim_dma1[stream].m0ar = address;
+}
+
+void dma_set_number_of_data(uint32_t dma, uint8_t stream, uint16_t number)
+{
+	(void)dma;
+	sim_dma1[stream].ndtr = number;
+}
+
+uint16_t dma_get_number_of_data(uint32_t dma, uint8_t stream)
+{
+	(void)dma;
+	return sim_dma1[stream].ndtr;
+}
+
+void dma_enable_transfer_complete_interrupt(uint32_t dma, uint8_t stream)
+{
+	(void)dma;
+	sim_dma1[stream].cr |= DMA_SxCR_TCIE;
+}
+
+void dma_enable_half_transfer_interrupt(uint32_t dma, uint8_t stream)
+{
+	(void)dma;
+	sim_dma1[stream].cr |= DMA_SxCR_HTIE;
+}
+
+void dma_enable_stream(uint32_t dma, uint8_t stream)
+{
+	sim_dma_stream_t *s = &sim_dma1[stream];
+
+	(void)dma;
+	s->size = s->ndtr;
+	if ((s->cr & DMA_SxCR_DIR_MASK) == DMA_SxCR_DIR_MEM_TO_PERIPHERAL) {
+		// The USART takes one character time per byte.
+		s->done = sim_now() + s->ndtr * sim_usart_char_time();
+	}
+	__atomic_fetch_or(&s->cr, DMA_SxCR_EN, __ATOMIC_SEQ_CST);
+	sim_wake();
+}
+
+void dma_disable_stream(uint32_t dma, uint8_t stream)
+{
+	(void)dma;
+	__atomic_fetch_and(&sim_dma1[stream].cr, ~DMA_SxCR_EN, __ATOMIC_SEQ_CST);
+}
+
+bool dma_get_interrupt_flag(uint32_t dma, uint8_t stream, uint32_t interrupts)
+{
+	(void)dma;
+	return (sim_dma1[stream].flags & interrupts) != 0;
+}
+
+void dma_clear_interrupt_flags(uint32_t dma, uint8_t stream, uint32_t interrupts)
+{
+	(void)dma;
+	__atomic_fetch_and(&sim_dma1[stream].flags, ~interrupts, __ATOMIC_SEQ_CST);
+}
+
+/* ---- USART2 ------------------------------------------------------------- */
+
+uint32_t sim_usart2[7];
+
+static bool sim_console;		// Connect USART2 to stdin and stdout.
+static bool sim_console_eof;
+
+void usart_set_baudrate(uint32_t usart, uint32_t baud)
+{
+	USART_BRR(usart) = (rcc_apb1_frequency + baud / 2) / baud;
+}
+
+void usart_set_databits(uint32_t usart, uint32_t bits)
+{
+	if (bits == 8) {
+		USART_CR1(usart) &= ~USART_CR1_M;
+	} else {
+		USART_CR1(usart) |= USART_CR1_M;
+	}
+}
+
+void usart_set_stopbits(uint32_t usart, uint32_t stopbits)
+{
+	USART_CR2(usart) = (USART_CR2(usart) & ~USART_CR2_STOPBITS_MASK) | stopbits;
+}
+
+void usart_set_parity(uint32_t usart, uint32_t parity)
+{
+	USART_CR1(usart) = (USART_CR1(usart) & ~USART_PARITY_MASK) | parity;
+}
+
+void usart_set_mode(uint32_t usart, uint32_t mode)
+{
+	USART_CR1(usart) = (USART_CR1(usart) & ~USART_MODE_MASK) | mode;
+}
+
+void usart_set_flow_control(uint32_t usart, uint32_t flowcontrol)
+{
+	USART_CR3(usart) = (USART_CR3(usart) & ~USART_FLOWCONTROL_MASK) | flowcontrol;
+}
+
+void usart_enable(uint32_t usart)
+{
+	USART_CR1(usart) |= USART_CR1_UE;
+}
+
+void usart_disable(uint32_t usart)
+{
+	USART_CR1(usart) &= ~USART_CR1_UE;
+}
+
+void usart_enable_rx_dma(uint32_t usart)
+{
+	USART_CR3(usart) |= USART_CR3_DMAR;
+}
+
+void usart_disable_rx_dma(uint32_t usart)
+{
+	USART_CR3(usart) &= ~USART_CR3_DMAR;
+}
+
+void usart_enable_tx_dma(uint32_t usart)
+{
+	USART_CR3(usart) |= USART_CR3_DMAT;
+}
+
+void usart_disable_tx_dma(uint32_t usart)
+{
+	USART_CR3(usart) &= ~USART_CR3_DMAT;
+}
+
+// Returns the time taken to send one character (start bit, data bits,
+// parity and stop bits) at the current baud rate.
+static uint64_t sim_usart_char_time(void)
+{
+	uint32_t brr = USART_BRR(USART2);
+	uint32_t bits = (USART_CR1(USART2) & USART_CR1_M) ? 11 : 10;
+
+	if (brr == 0) {
+		return 0;
+	}
+	return (uint64_t)bits * brr * SIM_NS_PER_SEC / rcc_apb1_frequency;
+}
+
+// Finds the DMA stream (if any) which the USART is using in the given
+// direction.
+static sim_dma_stream_t *sim_usart_dma(uint32_t direction)
+{
+	for (unsigned i = 0; i < 8; i++) {
+		sim_dma_stream_t *s = &sim_dma1[i];
+		if ((s->cr & DMA_SxCR_EN) && s->par == (uint32_t)(uintptr_t)&USART_DR(USART2)
+		&&	(s->cr & DMA_SxCR_DIR_MASK) == direction) {
+			return s;
+		}
+	}
+	return NULL;
+}
+
+// Finishes transmit DMA transfers, whose data goes to stdout.
+static uint64_t sim_usart_tx_run(uint64_t now)
+{
+	sim_dma_stream_t *s = sim_usart_dma(DMA_SxCR_DIR_MEM_TO_PERIPHERAL);
+
+	if (s == NULL) {
+		return SIM_NEVER;
+	}
+	if (now < s->done) {
+		return s->done;
+	}
+	if (sim_console) {
+		const uint8_t *data = (const uint8_t *)(uintptr_t)s->m0ar;
+		size_t len = s->ndtr;
+		while (len > 0) {
+			ssize_t n = write(STDOUT_FILENO, data, len);
+			if (n <= 0) {
+				break;
+			}
+			data += n;
+			len -= n;
+		}
+	}
+	s->ndtr = 0;
+	__atomic_fetch_and(&s->cr, ~DMA_SxCR_EN, __ATOMIC_SEQ_CST);
+	sim_dma_set_flags(s - sim_dma1, DMA_TCIF);
+	return SIM_NEVER;
+}
+
+// Returns the receive DMA stream if the USART is ready to receive.
+static sim_dma_stream_t *sim_usart_rx_dma(void)
+{
+	if (!sim_console || sim_console_eof || !(USART_CR1(USART2) & USART_CR1_UE)) {
+		return NULL;
+	}
+	return sim_usart_dma(DMA_SxCR_DIR_PERIPHERAL_TO_MEM);
+}
+
+// Receives whatever is waiting on stdin, using the receive DMA stream (in
+// circular mode), and then reports an idle line. The data arrives all at
+// once rather than at the baud rate.
+static void sim_usart_rx_run(sim_dma_stream_t *s)
+{
+	uint8_t buf[256];
+
+	ssize_t len = read(STDIN_FILENO, buf, sizeof(buf));
+	if (len == 0) {
+		sim_console_eof = true;
+	}
+	if (len <= 0) {
+		return;
+	}
+
+	uint8_t *mem = (uint8_t *)(uintptr_t)s->m0ar;
+	for (ssize_t i = 0; i < len; i++) {
+		mem[s->size - s->ndtr] = buf[i];
+		s->ndtr--;
+		if (s->ndtr == s->size / 2) {
+			sim_dma_set_flags(s - sim_dma1, DMA_HTIF);
+		}
+		if (s->ndtr == 0) {
+			s->ndtr = s->size;
+			sim_dma_set_flags(s - sim_dma1, DMA_TCIF);
+		}
+	}
+	USART_SR(USART2) |= USART_SR_IDLE;
+	if (USART_CR1(USART2) & USART_CR1_IDLEIE) {
+		sim_irq_raise(NVIC_USART2_IRQ);
+	}
+}
+
+/* ---- Device ID ---------------------------------------------------------- */
+
+const uint8_t sim_desig_unique_id[12] = {
+	0x53, 0x49, 0x4d, 0x00, 0x32, 0x00, 0x30, 0x01, 0x12, 0x34, 0x56, 0x78,
+};
+
+/* ---- Simulator side ----------------------------------------------------- */
+
+void sim_periph_init(bool console)
+{
+	sim_console = console;
+	sim_tim2_reset();
+}
+
+uint64_t sim_periph_run(uint64_t now, int *fd)
+{
+	uint64_t next = sim_systick_run(now);
+	uint64_t t;
+
+	t = sim_tim2_run(now);
+	if (t < next) {
+		next = t;
+	}
+	t = sim_usart_tx_run(now);
+	if (t < next) {
+		next = t;
+	}
+
+	*fd = -1;
+	sim_dma_stream_t *rx = sim_usart_rx_dma();
+	if (rx != NULL) {
+		struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+		if (poll(&pfd, 1, 0) > 0) {
+			sim_usart_rx_run(rx);
+		}
+		*fd = STDIN_FILENO;
+	}
+	return next;
+}
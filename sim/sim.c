@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The simulator's main program. It starts the peripheral thread, and then
+// runs the firmware's main on the main thread.
+
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim/sim.h"
+#include "usb.h"
+
+int firmware_main(void);
+
+static struct timespec sim_start;
+static int sim_wake_fd = -1;
+
+uint64_t sim_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)(ts.tv_sec - sim_start.tv_sec) * SIM_NS_PER_SEC
+		 + ts.tv_nsec - sim_start.tv_nsec;
+}
+
+void sim_wake(void)
+{
+	uint64_t one = 1;
+
+	// This only fails if the counter is about to overflow, in which case
+	// the peripheral thread has plenty of wakeups to see already.
+	ssize_t n = write(sim_wake_fd, &one, sizeof(one));
+	(void)n;
+}
+
+// The peripheral thread. It runs the peripheral models and the USB host
+// whenever something is due, and otherwise sleeps until the next deadline,
+// until there's input, or until the firmware calls sim_wake.
+static void *sim_run(void *arg)
+{
+	struct pollfd fds[2 + SIM_USB_MAX_PORTS];
+
+	(void)arg;
+
+	// The deadlines are often only tens of microseconds away, so don't let
+	// the kernel add its usual 50 us of slack to them.
+	prctl(PR_SET_TIMERSLACK, 1);
+
+	while (1) {
+		uint64_t now = sim_now();
+		int fd;
+		uint64_t next = sim_periph_run(now, &fd);
+		uint64_t t = sim_usb_run(now);
+		if (t < next) {
+			next = t;
+		}
+
+		nfds_t nfds = 0;
+		fds[nfds].fd = sim_wake_fd;
+		fds[nfds].events = POLLIN;
+		nfds++;
+		if (fd >= 0) {
+			fds[nfds].fd = fd;
+			fds[nfds].events = POLLIN;
+			nfds++;
+		}
+		nfds += sim_usb_pollfds(&fds[nfds]);
+
+		struct timespec timeout = { 0, 0 };
+		now = sim_now();
+		if (next == UINT64_MAX) {
+			timeout.tv_sec = 1;
+		} else if (next > now) {
+			timeout.tv_sec = (next - now) / SIM_NS_PER_SEC;
+			timeout.tv_nsec = (next - now) % SIM_NS_PER_SEC;
+		}
+		if (ppoll(fds, nfds, &timeout, NULL) > 0 && (fds[0].revents & POLLIN)) {
+			uint64_t count;
+			ssize_t n = read(sim_wake_fd, &count, sizeof(count));
+			(void)n;
+		}
+	}
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-b] [-q]\n", prog);
+	fprintf(stderr, "  -b  Run the echo latency and throughput benchmarks, and exit\n");
+	fprintf(stderr, "  -q  Don't connect the UART to stdin and stdout\n");
+}
+
+int main(int argc, char **argv)
+{
+	bool bench = false;
+	bool quiet = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "bqh")) != -1) {
+		switch (opt) {
+			case 'b':
+				bench = true;
+				break;
+			case 'q':
+				quiet = true;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &sim_start);
+	sim_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (sim_wake_fd < 0) {
+		perror("eventfd");
+		return 1;
+	}
+
+	sim_irq_init();
+	sim_periph_init(!quiet && !bench);
+	if (!sim_usb_init(USB_VCP_NUM_PORTS)) {
+		return 1;
+	}
+	for (unsigned i = 0; i < USB_VCP_NUM_PORTS; i++) {
+		fprintf(stderr, "USB port %u is %s\n", i, sim_usb_port_name(i));
+	}
+
+	// The interrupt signal is only ever delivered to the firmware's thread,
+	// so the other threads start out with it blocked.
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, sim_run, NULL) != 0
+	||	(bench && pthread_create(&thread, NULL, sim_bench, NULL) != 0)) {
+		perror("pthread_create");
+		return 1;
+	}
+	pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+
+	return firmware_main();
+}
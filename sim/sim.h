@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The simulator runs the firmware as a Linux program, with libopencm3
+// replaced by models of the peripherals it uses. The firmware runs on the
+// main thread, and its interrupt handlers run on the same thread from a
+// signal handler, so they preempt it just like they would on the board.
+// The peripherals are advanced by a second thread (see sim_run in sim.c),
+// which also plays the part of the USB host.
+//
+// This header is included ahead of every firmware source file when the
+// simulator is built.
+
+// The DWT cycle counter, which counts at rcc_ahb_frequency in host time.
+uint32_t sim_cycle_count(void);
+#define CYCLES_DWT_CYCCNT	sim_cycle_count()
+
+#define SIM_NS_PER_SEC	1000000000ull
+#define SIM_NS_PER_MS	1000000ull
+
+// Returns the number of nanoseconds since the simulator started.
+uint64_t sim_now(void);
+
+// Wakes up the peripheral thread so that it notices a change made by the
+// firmware. This is safe to call from interrupt handlers.
+void sim_wake(void);
+
+// Interrupts (sim/nvic.c). SysTick is treated as one more interrupt.
+#define SIM_SYSTICK_IRQ	0xff
+
+void sim_irq_init(void);
+void sim_irq_raise(unsigned irqn);
+void sim_irq_set_enabled(unsigned irqn, bool enabled);
+void sim_null_handler(void);
+
+// The peripheral models (sim/periph.c). sim_periph_run does whatever is
+// due at time now, and returns the time at which it next needs to run.
+// fd is set to a file descriptor to wait for input on, or -1.
+void sim_periph_init(bool console);
+uint64_t sim_periph_run(uint64_t now, int *fd);
+
+// The USB device and host (sim/usbd.c). Each CDC ACM port appears as a
+// pseudo-terminal.
+#define SIM_USB_MAX_PORTS	4
+
+struct pollfd;
+
+bool sim_usb_init(unsigned num_ports);
+const char *sim_usb_port_name(unsigned port);
+uint64_t sim_usb_run(uint64_t now);
+unsigned sim_usb_pollfds(struct pollfd *fds);
+
+// Runs the latency and throughput benchmarks against a CDC port, and then
+// exits (sim/bench.c).
+void *sim_bench(void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SIM_H
@@ -0,0 +1,760 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The simulated USB bus. The device side is libopencm3's usbd API, which
+// usb.c is written against. The host side is run by the peripheral thread
+// (see sim_usb_run), and behaves roughly like the Linux cdc_acm driver:
+// the device is configured as soon as it's initialized, and each CDC ACM
+// port is connected to a pseudo-terminal. Opening the pseudo-terminal
+// raises DTR (after setting the line coding from its termios), and closing
+// it drops DTR.
+//
+// The bus runs at full speed timing. There's an SOF every 1 ms frame, and
+// the rest of the frame is filled with bulk transactions, taken round robin
+// from the ports which have something to do, which take as long as their
+// packets would at 12 Mbit/s (about 19 64-byte packets per frame).
+// Transactions which would be NAKed don't take any time. Interrupt IN
+// endpoints are polled once every bInterval frames.
+//
+// The device and the host hand each endpoint's buffer back and forth using
+// its full flag, the way that the OTG_FS core's FIFOs are shared between
+// the CPU and the USB, so no locks are needed.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/usb/cdc.h>
+#include <libopencm3/usb/usbd.h>
+
+#include "sim/sim.h"
+
+#define SIM_USB_FRAME_NS	SIM_NS_PER_MS
+
+// Full speed signalling. Each transaction carries a token packet, a data
+// packet and a handshake packet, with their sync fields, CRCs, EOPs and
+// inter-packet gaps adding up to about 13 bytes on top of the data.
+#define SIM_USB_BIT_RATE	12000000
+#define SIM_USB_OVERHEAD	13
+#define SIM_USB_SOF_BYTES	6
+
+#define SIM_USB_NUM_EPS				8
+#define SIM_USB_MAX_PACKET			64
+#define SIM_USB_MAX_CONTROL_CBS		4
+#define SIM_USB_SETUP_QUEUE			16
+
+// Bits in _usbd_device.events, which tell usbd_poll what's happened.
+#define SIM_USB_EVENT_SOF			(1u << 0)
+#define SIM_USB_EVENT_SETUP			(1u << 1)
+#define SIM_USB_EVENT_OUT(ep)		(1u << (8 + (ep)))
+#define SIM_USB_EVENT_IN(ep)		(1u << (16 + (ep)))
+
+typedef struct {
+	usbd_endpoint_callback	callback;
+	uint8_t				type;
+	uint16_t			max_size;	// 0 if the endpoint isn't set up
+
+	// An OUT endpoint's buffer is full from when the host sends a packet
+	// until usbd_poll has called the callback. An IN endpoint's buffer is
+	// full from usbd_ep_write_packet until the host collects it.
+	volatile bool		full;
+	volatile bool		nak;		// OUT only
+	uint16_t			len;
+	uint8_t				buf[SIM_USB_MAX_PACKET];
+} sim_usb_ep_t;
+
+// A control transfer from the host, along with its data stage.
+typedef struct {
+	struct usb_setup_data	req;
+	uint8_t					data[8];
+} sim_usb_setup_t;
+
+struct _usbd_driver {
+	const char	*name;
+};
+
+const usbd_driver otgfs_usb_driver = {
+	.name = "sim",
+};
+
+struct _usbd_device {
+	const struct usb_device_descriptor	*desc;
+	const struct usb_config_descriptor	*config;
+	uint8_t		*ctrl_buf;
+	uint16_t	ctrl_buf_size;
+
+	usbd_set_config_callback	set_config;
+	void		(*sof)(void);
+	struct {
+		uint8_t					type;
+		uint8_t					type_mask;
+		usbd_control_callback	callback;
+	} control[SIM_USB_MAX_CONTROL_CBS];
+
+	sim_usb_ep_t	ep_out[SIM_USB_NUM_EPS];
+	sim_usb_ep_t	ep_in[SIM_USB_NUM_EPS];
+
+	volatile uint32_t	events;		// SIM_USB_EVENT_xxx
+
+	// The control transfer being handed to usbd_poll.
+	volatile bool		setup_full;
+	sim_usb_setup_t		setup;
+};
+
+static usbd_device sim_usbd_dev;
+static usbd_device *volatile sim_usbd_ready;	// Set by usbd_init
+
+/* ---- Device side -------------------------------------------------------- */
+
+usbd_device *usbd_init(const usbd_driver *driver,
+		const struct usb_device_descriptor *dev,
+		const struct usb_config_descriptor *conf,
+		const char * const *strings, int num_strings,
+		uint8_t *control_buffer, uint16_t control_buffer_size)
+{
+	usbd_device *usbd_dev = &sim_usbd_dev;
+
+	(void)driver;
+	(void)strings;
+	(void)num_strings;
+
+	memset(usbd_dev, 0, sizeof(*usbd_dev));
+	usbd_dev->desc = dev;
+	usbd_dev->config = conf;
+	usbd_dev->ctrl_buf = control_buffer;
+	usbd_dev->ctrl_buf_size = control_buffer_size;
+
+	// Plug in the cable.
+	__atomic_store_n(&sim_usbd_ready, usbd_dev, __ATOMIC_RELEASE);
+	sim_wake();
+	return usbd_dev;
+}
+
+int usbd_register_control_callback(usbd_device *usbd_dev, uint8_t type,
+		uint8_t type_mask, usbd_control_callback callback)
+{
+	for (unsigned i = 0; i < SIM_USB_MAX_CONTROL_CBS; i++) {
+		if (usbd_dev->control[i].callback == NULL) {
+			usbd_dev->control[i].type = type;
+			usbd_dev->control[i].type_mask = type_mask;
+			usbd_dev->control[i].callback = callback;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int usbd_register_set_config_callback(usbd_device *usbd_dev,
+		usbd_set_config_callback callback)
+{
+	usbd_dev->set_config = callback;
+	return 0;
+}
+
+void usbd_register_sof_callback(usbd_device *usbd_dev, void (*callback)(void))
+{
+	usbd_dev->sof = callback;
+}
+
+void usbd_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type,
+		uint16_t max_size, usbd_endpoint_callback callback)
+{
+	sim_usb_ep_t *ep = (addr & 0x80) ? &usbd_dev->ep_in[addr & 0x7f]
+									 : &usbd_dev->ep_out[addr];
+
+	ep->callback = callback;
+	ep->type = type;
+	ep->nak = false;
+	ep->len = 0;
+	__atomic_store_n(&ep->full, false, __ATOMIC_RELEASE);
+	__atomic_store_n(&ep->max_size, max_size, __ATOMIC_RELEASE);
+	sim_wake();
+}
+
+uint16_t usbd_ep_write_packet(usbd_device *usbd_dev, uint8_t addr,
+		const void *buf, uint16_t len)
+{
+	sim_usb_ep_t *ep = &usbd_dev->ep_in[addr & 0x7f];
+
+	if (__atomic_load_n(&ep->full, __ATOMIC_ACQUIRE)) {
+		// The host hasn't collected the last one yet.
+		return 0;
+	}
+	if (len > ep->max_size) {
+		len = ep->max_size;
+	}
+	memcpy(ep->buf, buf, len);
+	ep->len = len;
+	__atomic_store_n(&ep->full, true, __ATOMIC_RELEASE);
+	sim_wake();
+	return len;
+}
+
+uint16_t usbd_ep_read_packet(usbd_device *usbd_dev, uint8_t addr,
+		void *buf, uint16_t len)
+{
+	sim_usb_ep_t *ep = &usbd_dev->ep_out[addr & 0x7f];
+
+	if (!__atomic_load_n(&ep->full, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	if (len > ep->len) {
+		len = ep->len;
+	}
+	memcpy(buf, ep->buf, len);
+
+	// The rest of the packet (if any) is thrown away, as with libopencm3.
+	ep->len = 0;
+	return len;
+}
+
+void usbd_ep_nak_set(usbd_device *usbd_dev, uint8_t addr, uint8_t nak)
+{
+	usbd_dev->ep_out[addr & 0x7f].nak = nak;
+	if (!nak) {
+		sim_wake();
+	}
+}
+
+// Handles a control transfer from the host.
+static void sim_usbd_control(usbd_device *usbd_dev)
+{
+	struct usb_setup_data req = usbd_dev->setup.req;
+	uint8_t *buf = usbd_dev->ctrl_buf;
+	uint16_t len = req.wLength;
+	usbd_control_complete_callback complete = NULL;
+
+	if (len > usbd_dev->ctrl_buf_size) {
+		len = usbd_dev->ctrl_buf_size;
+	}
+	if (len > sizeof(usbd_dev->setup.data)) {
+		len = sizeof(usbd_dev->setup.data);
+	}
+	memcpy(buf, usbd_dev->setup.data, len);
+
+	if ((req.bmRequestType & USB_REQ_TYPE_TYPE) == USB_REQ_TYPE_STANDARD) {
+		// The host only ever sends SET_CONFIGURATION, and the descriptors
+		// are taken from the config passed to usbd_init.
+		if (req.bRequest == USB_REQ_SET_CONFIGURATION) {
+			// As in libopencm3, the endpoints and the control callbacks
+			// are reset before the set config callback sets them up.
+			for (unsigned i = 1; i < SIM_USB_NUM_EPS; i++) {
+				__atomic_store_n(&usbd_dev->ep_out[i].max_size, 0, __ATOMIC_RELEASE);
+				__atomic_store_n(&usbd_dev->ep_in[i].max_size, 0, __ATOMIC_RELEASE);
+			}
+			memset(usbd_dev->control, 0, sizeof(usbd_dev->control));
+			if (usbd_dev->set_config) {
+				usbd_dev->set_config(usbd_dev, req.wValue);
+			}
+		}
+		return;
+	}
+
+	for (unsigned i = 0; i < SIM_USB_MAX_CONTROL_CBS; i++) {
+		if (usbd_dev->control[i].callback == NULL
+		||	(req.bmRequestType & usbd_dev->control[i].type_mask)
+				!= usbd_dev->control[i].type) {
+			continue;
+		}
+		int result = usbd_dev->control[i].callback(usbd_dev, &req, &buf, &len, &complete);
+		if (result == USBD_REQ_HANDLED) {
+			if (complete) {
+				complete(usbd_dev, &req);
+			}
+			return;
+		}
+		if (result == USBD_REQ_NOTSUPP) {
+			// The host would see a STALL.
+			return;
+		}
+	}
+}
+
+void usbd_poll(usbd_device *usbd_dev)
+{
+	uint32_t events = __atomic_exchange_n(&usbd_dev->events, 0, __ATOMIC_ACQ_REL);
+
+	if (events & SIM_USB_EVENT_SETUP) {
+		sim_usbd_control(usbd_dev);
+		__atomic_store_n(&usbd_dev->setup_full, false, __ATOMIC_RELEASE);
+		sim_wake();
+	}
+	for (unsigned i = 0; i < SIM_USB_NUM_EPS; i++) {
+		sim_usb_ep_t *ep = &usbd_dev->ep_out[i];
+
+		if (events & SIM_USB_EVENT_OUT(i)) {
+			if (ep->callback) {
+				ep->callback(usbd_dev, i);
+			}
+			// The endpoint is ready for the next packet (unless the
+			// callback NAKed it).
+			__atomic_store_n(&ep->full, false, __ATOMIC_RELEASE);
+			sim_wake();
+		}
+	}
+	for (unsigned i = 0; i < SIM_USB_NUM_EPS; i++) {
+		sim_usb_ep_t *ep = &usbd_dev->ep_in[i];
+
+		// Like libopencm3's drivers, IN callbacks get the bare endpoint
+		// number, without the direction bit.
+		if ((events & SIM_USB_EVENT_IN(i)) && ep->callback) {
+			ep->callback(usbd_dev, i);
+		}
+	}
+	if ((events & SIM_USB_EVENT_SOF) && usbd_dev->sof) {
+		usbd_dev->sof();
+	}
+}
+
+/* ---- Host side ---------------------------------------------------------- */
+
+// What the host knows about each CDC ACM port.
+typedef struct {
+	int			master;			// The pseudo-terminal's master side
+	char		name[64];		// The pseudo-terminal (i.e. the slave side)
+	bool		connected;		// The slave is open, so DTR is raised
+
+	// The port's interfaces and endpoints, from the config descriptor.
+	bool		present;
+	uint8_t		comm_iface;
+	uint8_t		notify_ep;
+	uint8_t		notify_interval;
+	uint8_t		out_ep;
+	uint8_t		in_ep;
+
+	// Data read from the pseudo-terminal which hasn't been sent yet, and
+	// data received which the pseudo-terminal hasn't taken yet.
+	uint8_t		out_buf[SIM_USB_MAX_PACKET];
+	uint16_t	out_len;
+	uint8_t		in_buf[SIM_USB_MAX_PACKET];
+	uint16_t	in_len;
+	uint16_t	in_off;
+} sim_usb_port_t;
+
+static struct {
+	usbd_device		*dev;			// NULL until attached
+	unsigned		num_ports;
+	sim_usb_port_t	port[SIM_USB_MAX_PORTS];
+
+	uint32_t		frame;
+	uint64_t		next_frame;		// ns
+	uint64_t		bus_free;		// ns, when the next transaction can start
+	bool			bus_idle;
+	unsigned		next_xfer;		// For the round robin
+
+	sim_usb_setup_t	setup_queue[SIM_USB_SETUP_QUEUE];
+	unsigned		setup_head;
+	unsigned		setup_tail;
+} sim_usb;
+
+bool sim_usb_init(unsigned num_ports)
+{
+	if (num_ports > SIM_USB_MAX_PORTS) {
+		num_ports = SIM_USB_MAX_PORTS;
+	}
+	sim_usb.num_ports = num_ports;
+
+	for (unsigned i = 0; i < num_ports; i++) {
+		sim_usb_port_t *port = &sim_usb.port[i];
+		struct termios tio;
+
+		port->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+		if (port->master < 0
+		||	grantpt(port->master) < 0
+		||	unlockpt(port->master) < 0
+		||	ptsname_r(port->master, port->name, sizeof(port->name)) != 0) {
+			perror("pseudo-terminal");
+			return false;
+		}
+
+		// Termios calls on the master apply to the slave, and the setting
+		// sticks when the slave is opened.
+		tcgetattr(port->master, &tio);
+		cfmakeraw(&tio);
+		cfsetspeed(&tio, B115200);
+		tcsetattr(port->master, TCSANOW, &tio);
+
+		// The master reports POLLHUP once the slave has been opened and
+		// closed again, and stops when it's reopened, which is how we tell
+		// when somebody has the port open.
+		close(open(port->name, O_RDWR | O_NOCTTY));
+	}
+	return true;
+}
+
+const char *sim_usb_port_name(unsigned port)
+{
+	return sim_usb.port[port].name;
+}
+
+// Finds the CDC ACM ports in the configuration. A port is a communications
+// interface (with its notification endpoint, if it has one) followed by a
+// data interface.
+static void sim_usb_find_ports(const struct usb_config_descriptor *config)
+{
+	unsigned num_ports = 0;
+	sim_usb_port_t *port = NULL;
+
+	for (unsigned i = 0; i < config->bNumInterfaces; i++) {
+		const struct usb_interface_descriptor *iface = &config->interface[i].altsetting[0];
+
+		if (iface->bInterfaceClass == USB_CLASS_CDC) {
+			port = num_ports < sim_usb.num_ports ? &sim_usb.port[num_ports] : NULL;
+			if (port != NULL) {
+				port->comm_iface = iface->bInterfaceNumber;
+			}
+			// Port 1 has no notification endpoint.
+			if (port != NULL && iface->bNumEndpoints > 0) {
+				port->notify_ep = iface->endpoint[0].bEndpointAddress;
+				port->notify_interval = iface->endpoint[0].bInterval;
+			}
+		} else if (iface->bInterfaceClass == USB_CLASS_DATA && port != NULL) {
+			for (unsigned e = 0; e < iface->bNumEndpoints; e++) {
+				uint8_t addr = iface->endpoint[e].bEndpointAddress;
+				if (addr & 0x80) {
+					port->in_ep = addr & 0x7f;
+				} else {
+					port->out_ep = addr;
+				}
+			}
+			port->present = true;
+			num_ports++;
+			port = NULL;
+		}
+	}
+	for (unsigned i = num_ports; i < sim_usb.num_ports; i++) {
+		fprintf(stderr, "%s isn't connected to a CDC ACM port\n", sim_usb.port[i].name);
+	}
+}
+
+static void sim_usb_queue_setup(uint8_t type, uint8_t request, uint16_t value,
+		uint16_t index, const void *data, uint16_t len)
+{
+	unsigned next = (sim_usb.setup_tail + 1) % SIM_USB_SETUP_QUEUE;
+	if (next == sim_usb.setup_head) {
+		return;
+	}
+	sim_usb_setup_t *setup = &sim_usb.setup_queue[sim_usb.setup_tail];
+	setup->req.bmRequestType = type;
+	setup->req.bRequest = request;
+	setup->req.wValue = value;
+	setup->req.wIndex = index;
+	setup->req.wLength = len;
+	memcpy(setup->data, data, len);
+	sim_usb.setup_tail = next;
+}
+
+// Hands the next control transfer to the device. They're slow (there are
+// at least two stages, which the host spreads over more than one frame) so
+// only one is started per frame.
+static void sim_usb_start_setup(usbd_device *dev)
+{
+	if (sim_usb.setup_head == sim_usb.setup_tail
+	||	__atomic_load_n(&dev->setup_full, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	dev->setup = sim_usb.setup_queue[sim_usb.setup_head];
+	sim_usb.setup_head = (sim_usb.setup_head + 1) % SIM_USB_SETUP_QUEUE;
+	__atomic_store_n(&dev->setup_full, true, __ATOMIC_RELEASE);
+	__atomic_fetch_or(&dev->events, SIM_USB_EVENT_SETUP, __ATOMIC_SEQ_CST);
+}
+
+// Converts a termios speed into bits per second.
+static uint32_t sim_usb_baud(speed_t speed)
+{
+	static const struct {
+		speed_t		speed;
+		uint32_t	baud;
+	} bauds[] = {
+		{ B1200, 1200 }, { B2400, 2400 }, { B4800, 4800 },
+		{ B9600, 9600 }, { B19200, 19200 }, { B38400, 38400 },
+		{ B57600, 57600 }, { B115200, 115200 }, { B230400, 230400 },
+		{ B460800, 460800 }, { B921600, 921600 }, { B1000000, 1000000 },
+		{ B1500000, 1500000 }, { B2000000, 2000000 }, { B2500000, 2500000 },
+	};
+
+	for (unsigned i = 0; i < sizeof(bauds) / sizeof(bauds[0]); i++) {
+		if (bauds[i].speed == speed) {
+			return bauds[i].baud;
+		}
+	}
+	return 115200;
+}
+
+// Raises or drops DTR to match whether the pseudo-terminal is open. When it's
+// opened, the line coding is sent first, like cdc_acm does.
+static void sim_usb_check_lines(void)
+{
+	for (unsigned i = 0; i < sim_usb.num_ports; i++) {
+		sim_usb_port_t *port = &sim_usb.port[i];
+		struct pollfd pfd = { .fd = port->master };
+
+		if (!port->present) {
+			continue;
+		}
+		poll(&pfd, 1, 0);
+		bool connected = !(pfd.revents & POLLHUP);
+		if (connected == port->connected) {
+			continue;
+		}
+		port->connected = connected;
+		if (connected) {
+			struct termios tio;
+			struct usb_cdc_line_coding lc = {
+				.dwDTERate = 115200,
+				.bCharFormat = USB_CDC_1_STOP_BITS,
+				.bParityType = USB_CDC_NO_PARITY,
+				.bDataBits = 8,
+			};
+			if (tcgetattr(port->master, &tio) == 0) {
+				lc.dwDTERate = sim_usb_baud(cfgetospeed(&tio));
+				lc.bCharFormat = (tio.c_cflag & CSTOPB) ? USB_CDC_2_STOP_BITS : USB_CDC_1_STOP_BITS;
+				lc.bParityType = !(tio.c_cflag & PARENB) ? USB_CDC_NO_PARITY
+							   : (tio.c_cflag & PARODD) ? USB_CDC_ODD_PARITY
+							   : USB_CDC_EVEN_PARITY;
+				switch (tio.c_cflag & CSIZE) {
+					case CS5:	lc.bDataBits = 5;	break;
+					case CS6:	lc.bDataBits = 6;	break;
+					case CS7:	lc.bDataBits = 7;	break;
+					default:	lc.bDataBits = 8;	break;
+				}
+			}
+			sim_usb_queue_setup(USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+					USB_CDC_REQ_SET_LINE_CODING, 0, port->comm_iface, &lc, sizeof(lc));
+		} else {
+			// Whatever was on its way to or from the port is thrown away.
+			port->out_len = 0;
+			port->in_len = 0;
+		}
+		// DTR is bit 0 and RTS is bit 1.
+		sim_usb_queue_setup(USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+				USB_CDC_REQ_SET_CONTROL_LINE_STATE, connected ? 3 : 0,
+				port->comm_iface, NULL, 0);
+	}
+}
+
+// Moves data between the pseudo-terminals and the host's buffers.
+static void sim_usb_service_ptys(void)
+{
+	for (unsigned i = 0; i < sim_usb.num_ports; i++) {
+		sim_usb_port_t *port = &sim_usb.port[i];
+
+		if (!port->connected) {
+			continue;
+		}
+		while (port->in_len > 0) {
+			ssize_t n = write(port->master, port->in_buf + port->in_off, port->in_len);
+			if (n < 0 && errno == EAGAIN) {
+				// The pseudo-terminal is full, so the host stops collecting
+				// packets from the IN endpoint until it has room.
+				break;
+			}
+			if (n <= 0) {
+				port->in_len = 0;
+				break;
+			}
+			port->in_off += n;
+			port->in_len -= n;
+		}
+		if (port->out_len == 0) {
+			ssize_t n = read(port->master, port->out_buf, sizeof(port->out_buf));
+			if (n > 0) {
+				port->out_len = n;
+			}
+		}
+	}
+}
+
+// Polls the interrupt IN (notification) endpoints which are due this frame.
+// The SERIAL_STATE notifications are thrown away.
+static void sim_usb_poll_interrupt(usbd_device *dev)
+{
+	for (unsigned i = 0; i < sim_usb.num_ports; i++) {
+		sim_usb_port_t *port = &sim_usb.port[i];
+		uint8_t interval = port->notify_interval ? port->notify_interval : 1;
+		sim_usb_ep_t *ep = &dev->ep_in[port->notify_ep & 0x7f];
+
+		if (!port->connected || port->notify_ep == 0 || sim_usb.frame % interval != 0
+		||	!__atomic_load_n(&ep->full, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+		__atomic_store_n(&ep->full, false, __ATOMIC_RELEASE);
+		__atomic_fetch_or(&dev->events, SIM_USB_EVENT_IN(port->notify_ep & 0x7f), __ATOMIC_SEQ_CST);
+	}
+}
+
+// Returns the length of the packet which transfer xfer (OUT and then IN for
+// each port) would move, or -1 if it would be NAKed.
+static int sim_usb_xfer_len(usbd_device *dev, unsigned xfer)
+{
+	sim_usb_port_t *port = &sim_usb.port[xfer / 2];
+
+	if (!port->present || !port->connected) {
+		return -1;
+	}
+	if (xfer % 2 == 0) {
+		sim_usb_ep_t *ep = &dev->ep_out[port->out_ep];
+		if (port->out_len == 0 || __atomic_load_n(&ep->max_size, __ATOMIC_ACQUIRE) == 0
+		||	ep->nak || __atomic_load_n(&ep->full, __ATOMIC_ACQUIRE)) {
+			return -1;
+		}
+		return port->out_len;
+	}
+	sim_usb_ep_t *ep = &dev->ep_in[port->in_ep];
+	if (port->in_len > 0 || !__atomic_load_n(&ep->full, __ATOMIC_ACQUIRE)) {
+		return -1;
+	}
+	return ep->len;
+}
+
+static void sim_usb_xfer(usbd_device *dev, unsigned xfer)
+{
+	sim_usb_port_t *port = &sim_usb.port[xfer / 2];
+
+	if (xfer % 2 == 0) {
+		sim_usb_ep_t *ep = &dev->ep_out[port->out_ep];
+		memcpy(ep->buf, port->out_buf, port->out_len);
+		ep->len = port->out_len;
+		port->out_len = 0;
+		__atomic_store_n(&ep->full, true, __ATOMIC_RELEASE);
+		__atomic_fetch_or(&dev->events, SIM_USB_EVENT_OUT(port->out_ep), __ATOMIC_SEQ_CST);
+	} else {
+		sim_usb_ep_t *ep = &dev->ep_in[port->in_ep];
+		memcpy(port->in_buf, ep->buf, ep->len);
+		port->in_len = ep->len;
+		port->in_off = 0;
+		__atomic_store_n(&ep->full, false, __ATOMIC_RELEASE);
+		__atomic_fetch_or(&dev->events, SIM_USB_EVENT_IN(port->in_ep), __ATOMIC_SEQ_CST);
+	}
+	sim_irq_raise(NVIC_OTG_FS_IRQ);
+}
+
+static uint64_t sim_usb_xfer_time(int len)
+{
+	return (uint64_t)(len + SIM_USB_OVERHEAD) * 8 * SIM_NS_PER_SEC / SIM_USB_BIT_RATE;
+}
+
+uint64_t sim_usb_run(uint64_t now)
+{
+	usbd_device *dev = sim_usb.dev;
+
+	if (dev == NULL) {
+		dev = __atomic_load_n(&sim_usbd_ready, __ATOMIC_ACQUIRE);
+		if (dev == NULL) {
+			return UINT64_MAX;
+		}
+		// Enumerate.
+		sim_usb.dev = dev;
+		sim_usb_find_ports(dev->config);
+		sim_usb_queue_setup(USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_DEVICE,
+				USB_REQ_SET_CONFIGURATION, dev->config->bConfigurationValue,
+				0, NULL, 0);
+		sim_usb.next_frame = now;
+		sim_usb.bus_idle = true;
+	}
+
+	if (now >= sim_usb.next_frame) {
+		if (now - sim_usb.next_frame > 10 * SIM_USB_FRAME_NS) {
+			// We were held up (by a debugger, say), so skip ahead.
+			sim_usb.next_frame = now;
+		}
+		uint64_t frame_start = sim_usb.next_frame;
+		sim_usb.next_frame += SIM_USB_FRAME_NS;
+		sim_usb.frame++;
+		sim_usb.bus_free = frame_start + sim_usb_xfer_time(SIM_USB_SOF_BYTES - SIM_USB_OVERHEAD);
+		sim_usb.bus_idle = false;
+
+		sim_usb_check_lines();
+		sim_usb_start_setup(dev);
+		sim_usb_poll_interrupt(dev);
+		__atomic_fetch_or(&dev->events, SIM_USB_EVENT_SOF, __ATOMIC_SEQ_CST);
+		sim_irq_raise(NVIC_OTG_FS_IRQ);
+	}
+
+	// Run the bulk transactions which have finished by now. Each one is
+	// only done (i.e. the device sees it) once its time on the bus is up.
+	uint64_t next = sim_usb.next_frame;
+	unsigned num_xfers = 2 * sim_usb.num_ports;
+	while (1) {
+		sim_usb_service_ptys();
+
+		unsigned xfer = 0;
+		int len = -1;
+		for (unsigned i = 0; i < num_xfers && len < 0; i++) {
+			xfer = (sim_usb.next_xfer + i) % num_xfers;
+			len = sim_usb_xfer_len(dev, xfer);
+		}
+		if (len < 0) {
+			// Nothing to do, so the next transaction can start as soon as
+			// there's something.
+			sim_usb.bus_idle = true;
+			break;
+		}
+		if (sim_usb.bus_idle) {
+			sim_usb.bus_free = now;
+			sim_usb.bus_idle = false;
+		}
+		uint64_t end = sim_usb.bus_free + sim_usb_xfer_time(len);
+		if (end > sim_usb.next_frame) {
+			// It doesn't fit in this frame.
+			break;
+		}
+		if (end > now) {
+			next = end;
+			break;
+		}
+		sim_usb_xfer(dev, xfer);
+		sim_usb.bus_free = end;
+		sim_usb.next_xfer = xfer + 1;
+	}
+	return next;
+}
+
+// Adds the pseudo-terminals which the host is waiting on to fds.
+unsigned sim_usb_pollfds(struct pollfd *fds)
+{
+	unsigned nfds = 0;
+
+	for (unsigned i = 0; i < sim_usb.num_ports; i++) {
+		sim_usb_port_t *port = &sim_usb.port[i];
+		short events = 0;
+
+		if (!port->connected) {
+			// A hangup is reported until the port is opened, so this one
+			// is checked every frame instead.
+			continue;
+		}
+		if (port->out_len == 0) {
+			events |= POLLIN;
+		}
+		if (port->in_len > 0) {
+			events |= POLLOUT;
+		}
+		if (events) {
+			fds[nfds].fd = port->master;
+			fds[nfds].events = events;
+			nfds++;
+		}
+	}
+	return nfds;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stats.h"
+#include "log.h"
+#include "sections.h"
+#include "StrFormat.h"
+#include "uart.h"
+#include "usb.h"
+
+static void print_cycle_stats(unsigned out_port, const char *name,
+							  const cycle_stats_t *stats)
+{
+	if (stats->count == 0) {
+		usb_vcp_format(out_port, STRFMT("%s: no calls\n"), name);
+		return;
+	}
+	usb_vcp_format(out_port, STRFMT("%s: %lu calls, %lu min %lu avg %lu max cycles (max %lu us)\n"),
+				   name, stats->count, stats->min, cycle_stats_avg(stats),
+				   stats->max, cycles_to_micros(stats->max));
+}
+
+void print_stats(unsigned out_port)
+{
+	usb_vcp_stats_t	stats;
+	uart_stats_t	uart_stats;
+	usb_cycle_stats_t	cycle_stats;
+
+	for (unsigned port = 0; port < USB_VCP_NUM_PORTS; port++) {
+		usb_vcp_get_stats(port, &stats);
+		usb_vcp_format(out_port, STRFMT("port %u tx: %lu bytes %lu packets\n"),
+					   port, stats.tx_bytes, stats.tx_packets);
+		usb_vcp_format(out_port, STRFMT("port %u rx: %lu bytes %lu naks %lu dropped\n"),
+					   port, stats.rx_bytes, stats.rx_naks, stats.rx_dropped);
+		usb_vcp_format(out_port, STRFMT("port %u notifications: %lu\n"),
+					   port, stats.notifications);
+	}
+
+	// So that RAMFUNC=0 and RAMFUNC=1 figures can't be mixed up.
+	usb_vcp_format(out_port, STRFMT("usb interrupt path runs from %s\n"),
+				   RAMFUNC_ENABLE ? "SRAM" : "flash");
+	usb_get_cycle_stats(&cycle_stats, true);
+	print_cycle_stats(out_port, "otg_fs_isr", &cycle_stats.isr);
+	print_cycle_stats(out_port, "rx_cb", &cycle_stats.rx_cb);
+
+	usb_vcp_format(out_port, STRFMT("log: %lu records dropped\n"), log_get_dropped());
+
+	uart_get_stats(&uart_stats);
+	usb_vcp_format(out_port, STRFMT("uart tx: %lu bytes %lu dropped\n"),
+				   uart_stats.tx_bytes, uart_stats.tx_dropped);
+	usb_vcp_format(out_port, STRFMT("uart rx: %lu bytes %lu overrun %lu framing %lu parity\n"),
+				   uart_stats.rx_bytes, uart_stats.rx_overrun,
+				   uart_stats.rx_framing, uart_stats.rx_parity);
+	usb_vcp_format(out_port, STRFMT("uart unsupported line codings: %lu\n"),
+				   uart_stats.line_coding_unsupported);
+}
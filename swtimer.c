@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "swtimer.h"
+
+#include "systick.h"
+
+// The wheel has SWTIMER_LEVELS levels of SWTIMER_SLOTS slots, so that it
+// covers all 32 bits of the time. A timer goes into the level containing
+// the most significant bit in which its expiry time differs from the
+// wheel's time, and into the slot which that level's digit of its expiry
+// time selects. When the wheel's time reaches the start of a slot in one
+// of the upper levels, the timers in that slot are redistributed into the
+// lower levels (they'll all land at least one level lower), and the timers
+// in a level 0 slot are due when the wheel's time reaches it.
+//
+// A bitmap of the non-empty slots is kept for each level, which allows
+// finding the next time that anything needs to be done without looking at
+// each slot, so no matter how long we slept, catching up only looks at the
+// times when something actually happens.
+
+#define SWTIMER_SLOT_BITS	4
+#define SWTIMER_SLOTS		(1 << SWTIMER_SLOT_BITS)
+#define SWTIMER_LEVELS		(32 / SWTIMER_SLOT_BITS)
+
+static swtimer_t *swtimer_wheel[SWTIMER_LEVELS][SWTIMER_SLOTS];
+static uint16_t swtimer_bitmap[SWTIMER_LEVELS];
+
+// Every tick before this has been processed.
+static uint32_t swtimer_time;
+
+static void swtimer_link(swtimer_t *timer) {
+	uint32_t diff = timer->expires ^ swtimer_time;
+	unsigned level = diff ? (31 - __builtin_clz(diff)) / SWTIMER_SLOT_BITS : 0;
+	unsigned slot = (timer->expires >> (level * SWTIMER_SLOT_BITS)) & (SWTIMER_SLOTS - 1);
+	swtimer_t **head = &swtimer_wheel[level][slot];
+
+	timer->next = *head;
+	if (timer->next) {
+		timer->next->pprev = &timer->next;
+	}
+	timer->pprev = head;
+	*head = timer;
+	swtimer_bitmap[level] |= 1 << slot;
+}
+
+// Removes timer from whatever list it's on, clearing the slot's bitmap bit
+// if that leaves the slot empty.
+static void swtimer_unlink(swtimer_t *timer) {
+	swtimer_t **slots = &swtimer_wheel[0][0];
+
+	*timer->pprev = timer->next;
+	if (timer->next) {
+		timer->next->pprev = timer->pprev;
+	} else if (*timer->pprev == NULL && timer->pprev >= slots
+			   && timer->pprev < slots + SWTIMER_LEVELS * SWTIMER_SLOTS) {
+		unsigned index = timer->pprev - slots;
+		swtimer_bitmap[index / SWTIMER_SLOTS] &= ~(1 << (index % SWTIMER_SLOTS));
+	}
+	timer->pprev = NULL;
+}
+
+// Detaches the list of timers in a slot, and points the first one back at
+// list (so that the timers can still be cancelled while they're on it).
+static void swtimer_take_slot(unsigned level, unsigned slot, swtimer_t **list) {
+	*list = swtimer_wheel[level][slot];
+	swtimer_wheel[level][slot] = NULL;
+	swtimer_bitmap[level] &= ~(1 << slot);
+	if (*list) {
+		(*list)->pprev = list;
+	}
+}
+
+void swtimer_init(swtimer_t *timer, swtimer_func_t func, void *arg) {
+	timer->next = NULL;
+	timer->pprev = NULL;
+	timer->period = 0;
+	timer->func = func;
+	timer->arg = arg;
+}
+
+void swtimer_start(swtimer_t *timer, uint32_t delay_ms, uint32_t period_ms) {
+	if (swtimer_is_running(timer)) {
+		swtimer_unlink(timer);
+	}
+	timer->expires = system_millis + delay_ms;
+	timer->period = period_ms;
+
+	// The wheel only moves forwards.
+	if ((int32_t)(timer->expires - swtimer_time) < 0) {
+		timer->expires = swtimer_time;
+	}
+	swtimer_link(timer);
+
+	// Make sure that swtimer_run gets called in time for it.
+	systick_wake_at(timer->expires);
+}
+
+void swtimer_cancel(swtimer_t *timer) {
+	if (swtimer_is_running(timer)) {
+		swtimer_unlink(timer);
+	}
+}
+
+// Returns true, and sets *next to the next time at or after swtimer_time
+// when a slot needs to be processed, if there are any timers.
+static bool swtimer_next_event(uint32_t *next) {
+	bool found = false;
+	uint32_t best = 0;
+
+	for (unsigned level = 0; level < SWTIMER_LEVELS; level++) {
+		unsigned shift = level * SWTIMER_SLOT_BITS;
+		unsigned cur = (swtimer_time >> shift) & (SWTIMER_SLOTS - 1);
+		uint32_t bits = swtimer_bitmap[level];
+
+		// The current slot is due now if the time is at its start (which
+		// is always the case for level 0), otherwise it's already been
+		// redistributed. Anything in an earlier slot belongs to the next
+		// time around the level (which only happens in the top level, when
+		// the time wraps).
+		if (swtimer_time & ((1u << shift) - 1)) {
+			cur++;
+		}
+		bits &= ~((1u << cur) - 1);
+		if (bits == 0) {
+			if (level != SWTIMER_LEVELS - 1 || swtimer_bitmap[level] == 0) {
+				continue;
+			}
+			bits = swtimer_bitmap[level];
+		}
+		unsigned slot = __builtin_ctz(bits);
+		uint32_t when = (uint32_t)slot << shift;
+		if (level != SWTIMER_LEVELS - 1) {
+			when |= swtimer_time & ~((1u << (shift + SWTIMER_SLOT_BITS)) - 1);
+		}
+		if (!found || when - swtimer_time < best - swtimer_time) {
+			best = when;
+			found = true;
+		}
+	}
+	*next = best;
+	return found;
+}
+
+void swtimer_run(void) {
+	uint32_t now = system_millis;
+	uint32_t next;
+	swtimer_t *list;
+
+	while (swtimer_next_event(&next) && (int32_t)(now - next) >= 0) {
+		swtimer_time = next;
+
+		// Redistribute the upper level slots which start at this time,
+		// highest first since their timers may land in a lower one.
+		for (unsigned level = SWTIMER_LEVELS - 1; level > 0; level--) {
+			unsigned shift = level * SWTIMER_SLOT_BITS;
+			if (swtimer_time & ((1u << shift) - 1)) {
+				continue;
+			}
+			swtimer_take_slot(level, (swtimer_time >> shift) & (SWTIMER_SLOTS - 1), &list);
+			while (list) {
+				swtimer_t *timer = list;
+				swtimer_unlink(timer);
+				swtimer_link(timer);
+			}
+		}
+
+		// Anything in the current level 0 slot is due. Advancing the time
+		// first means that anything restarted by a callback goes into a
+		// later slot.
+		swtimer_take_slot(0, swtimer_time & (SWTIMER_SLOTS - 1), &list);
+		swtimer_time++;
+		while (list) {
+			swtimer_t *timer = list;
+			swtimer_unlink(timer);
+			if (timer->period) {
+				timer->expires += timer->period;
+				if ((int32_t)(timer->expires - swtimer_time) < 0) {
+					timer->expires = swtimer_time;
+				}
+				swtimer_link(timer);
+			}
+			timer->func(timer, timer->arg);
+		}
+	}
+	// Nothing else is due until next, so skip ahead. This keeps the
+	// wheel's time close to system_millis, which swtimer_start relies on.
+	if ((int32_t)(now + 1 - swtimer_time) > 0) {
+		swtimer_time = now + 1;
+	}
+	if (swtimer_next_event(&next)) {
+		systick_wake_at(next);
+	}
+}
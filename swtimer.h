@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SWTIMER_H
+#define SWTIMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Software timers, with millisecond resolution, kept in a hierarchical
+// timer wheel. Starting and cancelling a timer takes constant time, and
+// the callbacks are run from swtimer_run() (i.e. from the main loop) rather
+// than from an interrupt, so the timer interrupt itself does the same
+// small amount of work no matter how many timers there are.
+
+typedef struct swtimer swtimer_t;
+
+typedef void (*swtimer_func_t)(swtimer_t *timer, void *arg);
+
+struct swtimer {
+	swtimer_t		*next;
+	swtimer_t		**pprev;	// NULL when the timer isn't running
+	uint32_t		expires;
+	uint32_t		period;		// 0 for a one-shot timer
+	swtimer_func_t	func;
+	void			*arg;
+};
+
+void swtimer_init(swtimer_t *timer, swtimer_func_t func, void *arg);
+
+// Runs timer's callback delay_ms from now, and then every period_ms after
+// that (unless period_ms is 0). Restarting a running timer reschedules it.
+// Delays need to be less than 2^31 ms.
+void swtimer_start(swtimer_t *timer, uint32_t delay_ms, uint32_t period_ms);
+
+void swtimer_cancel(swtimer_t *timer);
+
+static inline bool swtimer_is_running(const swtimer_t *timer) {
+	return timer->pprev != NULL;
+}
+
+// Runs the callbacks for any timers which have expired, and then asks
+// systick to wake us up when the next one is due. This is the EVENT_TIMER
+// handler. Callbacks may start or cancel
+// any timer, including their own.
+void swtimer_run(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // SWTIMER_H
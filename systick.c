@@ -19,10 +19,135 @@
 
 #include "systick.h"
 
+#include "cycles.h"
+#include "events.h"
+
 #include <libopencmsis/core_cm3.h>
+#include <libopencm3/cm3/cortex.h>
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/cm3/systick.h>
 #include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
+
+// Number of times the CPU has come out of systick_idle().
+static volatile uint32_t systick_wakeups;
+
+// Number of timebase (TIM2 or SysTick) interrupts.
+static volatile uint32_t systick_timebase_irqs;
+
+#if SYSTICK_TICKLESS
+
+// TIM2 is a 32-bit timer, which is used as a free running clock. The timer
+// runs at 2 kHz (84 MHz / 65536 is the slowest that the 16-bit prescaler
+// allows, so 1 kHz isn't possible), so the counter wraps after 2^31 ms. The
+// update interrupt, which fires when it wraps (every 24.8 days), supplies
+// the top bit so that system_millis still wraps every 49 days.
+//
+// Channel 1's compare interrupt is only enabled when somebody has asked to
+// be woken up at a particular time (see systick_wake_at) so when there's
+// nothing to do the CPU stays asleep until there's some real work.
+
+#define TIMEBASE_HZ		2000
+#define TIMEBASE_SHIFT	1		// log2(TIMEBASE_HZ / 1000)
+
+static volatile uint32_t timebase_epoch;	// Number of times TIM2 has wrapped.
+static volatile bool deadline_armed;
+static volatile uint32_t deadline_ticks;
+
+void tim2_isr(void)
+{
+	systick_timebase_irqs++;
+	if (timer_get_flag(TIM2, TIM_SR_UIF)) {
+		timer_clear_flag(TIM2, TIM_SR_UIF);
+		timebase_epoch++;
+	}
+	if (timer_get_flag(TIM2, TIM_SR_CC1IF)) {
+		// The deadline is one-shot. Whoever asked for it will ask again
+		// when it needs to be woken up the next time.
+		timer_clear_flag(TIM2, TIM_SR_CC1IF);
+		timer_disable_irq(TIM2, TIM_DIER_CC1IE);
+		deadline_armed = false;
+		event_post(EVENT_BIT(EVENT_TIMER));
+	}
+}
+
+uint32_t systick_millis(void)
+{
+	uint32_t epoch;
+	uint32_t ticks;
+	bool wrapped;
+
+	// If interrupts are masked (or we're in a higher priority interrupt)
+	// the counter may have wrapped without tim2_isr having run yet, which
+	// UIF tells us. It's sampled before the epoch is checked again, so if
+	// tim2_isr runs (and clears it) in between, we go around again rather
+	// than pairing the old epoch with the new ticks.
+	do {
+		epoch = timebase_epoch;
+		ticks = timer_get_counter(TIM2);
+		wrapped = timer_get_flag(TIM2, TIM_SR_UIF);
+	} while (epoch != timebase_epoch);
+
+	if (wrapped && ticks < 0x80000000u) {
+		epoch++;
+	}
+	return (epoch << (32 - TIMEBASE_SHIFT)) | (ticks >> TIMEBASE_SHIFT);
+}
+
+void systick_wake_at(uint32_t millis)
+{
+	uint32_t ticks = millis << TIMEBASE_SHIFT;
+
+	nvic_disable_irq(NVIC_TIM2_IRQ);
+
+	// Only the earliest deadline needs to be armed. Anybody with a later
+	// deadline will re-arm theirs after the earlier one wakes us up.
+	if (!deadline_armed || (int32_t)(ticks - deadline_ticks) < 0) {
+		deadline_ticks = ticks;
+		deadline_armed = true;
+		timer_set_oc_value(TIM2, TIM_OC1, ticks);
+		timer_clear_flag(TIM2, TIM_SR_CC1IF);
+		timer_enable_irq(TIM2, TIM_DIER_CC1IE);
+
+		// If the deadline has already passed (or passed while we were
+		// setting up the compare) then the compare won't match until the
+		// counter wraps, so force it.
+		if ((int32_t)(timer_get_counter(TIM2) - ticks) >= 0) {
+			timer_generate_event(TIM2, TIM_EGR_CC1G);
+		}
+	}
+
+	nvic_enable_irq(NVIC_TIM2_IRQ);
+}
+
+/* Set up TIM2 as the timebase */
+void systick_init(void) {
+	// The timers on APB1 run at twice the APB1 clock when APB1 is divided
+	// down from the AHB clock.
+	uint32_t timer_clock = rcc_apb1_frequency;
+	if (rcc_apb1_frequency != rcc_ahb_frequency) {
+		timer_clock *= 2;
+	}
+
+	rcc_periph_clock_enable(RCC_TIM2);
+	rcc_periph_reset_pulse(RST_TIM2);
+	timer_set_mode(TIM2, TIM_CR1_CKD_CK_INT, TIM_CR1_CMS_EDGE, TIM_CR1_DIR_UP);
+	timer_set_prescaler(TIM2, timer_clock / TIMEBASE_HZ - 1);
+	timer_set_period(TIM2, 0xffffffff);
+	timer_disable_preload(TIM2);
+	timer_continuous_mode(TIM2);
+
+	// The prescaler is only loaded on an update event, so generate one, and
+	// throw away the update flag that it sets.
+	timer_generate_event(TIM2, TIM_EGR_UG);
+	timer_clear_flag(TIM2, TIM_SR_UIF);
+
+	timer_enable_irq(TIM2, TIM_DIER_UIE);
+	nvic_enable_irq(NVIC_TIM2_IRQ);
+	timer_enable_counter(TIM2);
+}
+
+#else
 
 /* monotonically increasing number of milliseconds from reset
  * overflows every 49 days if you're wondering
@@ -32,18 +157,15 @@ volatile uint32_t system_millis;
 /* Called when systick fires */
 void sys_tick_handler(void)
 {
+	systick_timebase_irqs++;
 	system_millis++;
+	event_post(EVENT_BIT(EVENT_TIMER));
 }
 
-/* sleep for delay milliseconds */
-void msleep(uint32_t delay) {
-
-    uint32_t start = system_millis;
-
-    // Wraparound of tick is taken care of by 2's complement arithmetic.
-    while (system_millis - start < delay) {
-        __WFI();
-    }
+void systick_wake_at(uint32_t millis)
+{
+	// We wake up every millisecond anyways.
+	(void)millis;
 }
 
 /* Set up a timer to create 1mS ticks. */
@@ -56,4 +178,45 @@ void systick_init(void) {
 	systick_interrupt_enable();
 }
 
+#endif  // SYSTICK_TICKLESS
+
+void systick_idle(void)
+{
+	__WFI();
+	systick_wakeups++;
+
+	// Keep the carry into the top half of the 64-bit cycle count going.
+	cycles_now64();
+}
+
+uint32_t systick_get_wakeups(void)
+{
+	return systick_wakeups;
+}
 
+uint32_t systick_get_timebase_irqs(void)
+{
+	return systick_timebase_irqs;
+}
+
+/* sleep for delay milliseconds */
+void msleep(uint32_t delay) {
+
+    uint32_t start = system_millis;
+    bool done;
+
+    do {
+        systick_wake_at(start + delay);
+
+        // As in event_wait, interrupts are masked between the check and
+        // the WFI, so that a deadline which arrives in between still
+        // wakes us up. Wraparound of tick is taken care of by 2's
+        // complement arithmetic.
+        cm_disable_interrupts();
+        done = (system_millis - start >= delay);
+        if (!done) {
+            systick_idle();
+        }
+        cm_enable_interrupts();
+    } while (!done);
+}
@@ -22,10 +22,48 @@
 
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Set SYSTICK_TICKLESS to 0 to use the original free running 1 ms SysTick
+// interrupt rather than the TIM2 based timebase (which only interrupts for
+// deadlines passed to systick_wake_at).
+#if !defined(SYSTICK_TICKLESS)
+#define SYSTICK_TICKLESS	1
+#endif
+
+#if SYSTICK_TICKLESS
+// Returns the number of milliseconds since reset. This wraps every 49 days.
+uint32_t systick_millis(void);
+
+#define system_millis	systick_millis()
+#else
 extern volatile uint32_t system_millis;
+#endif
 
 void systick_init(void);
 
+// Arranges for the CPU to be woken up (from systick_idle), and EVENT_TIMER
+// to be posted, once system_millis reaches millis. Only the earliest
+// outstanding deadline is kept, so callers should call this again after
+// each EVENT_TIMER. (With TICKLESS=0, EVENT_TIMER is posted every ms.)
+void systick_wake_at(uint32_t millis);
+
+// Waits for an interrupt.
+void systick_idle(void);
+
+// Returns the number of times that systick_idle has returned.
+uint32_t systick_get_wakeups(void);
+
+// Returns the number of timebase interrupts (TIM2, or SysTick with
+// TICKLESS=0), which is how many of the wakeups the timebase caused.
+uint32_t systick_get_timebase_irqs(void);
+
 void msleep(uint32_t msecs);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif  // SYSTICK_H
@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2016 Dave Hylands <dhylands@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Decodes the deferred log records described in log.h.
+//
+// Usage: logdecode firmware.elf [/dev/ttyACM0]
+//
+// The format strings are read from the .logstr section of the ELF file, and
+// each conversion is formatted by StrPrintf (the same code which runs on the
+// board), so the output matches what LOG() would produce with LOG_DEFERRED
+// set to 0. Bytes which aren't part of a record are copied straight through.
+// Data is read from stdin if no device is given.
+
+#include <elf.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "StrPrintf.h"
+
+static uint8_t *elf_data;
+static size_t elf_size;
+
+static const Elf32_Shdr *logstr_shdr;
+
+static const Elf32_Shdr *elf_section(unsigned idx) {
+	const Elf32_Ehdr *ehdr = (const Elf32_Ehdr *)elf_data;
+	return (const Elf32_Shdr *)(elf_data + ehdr->e_shoff + idx * ehdr->e_shentsize);
+}
+
+static int elf_load(const char *filename) {
+	FILE *fs = fopen(filename, "rb");
+	if (fs == NULL) {
+		perror(filename);
+		return -1;
+	}
+	fseek(fs, 0, SEEK_END);
+	elf_size = ftell(fs);
+	fseek(fs, 0, SEEK_SET);
+	elf_data = malloc(elf_size);
+	if (elf_data == NULL || fread(elf_data, 1, elf_size, fs) != elf_size) {
+		fprintf(stderr, "%s: unable to read file\n", filename);
+		fclose(fs);
+		return -1;
+	}
+	fclose(fs);
+
+	// The board is little endian, and so is every host we care about, so
+	// the headers are used as is.
+	const Elf32_Ehdr *ehdr = (const Elf32_Ehdr *)elf_data;
+	if (elf_size < sizeof(*ehdr)
+	||  memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0
+	||  ehdr->e_ident[EI_CLASS] != ELFCLASS32
+	||  ehdr->e_ident[EI_DATA] != ELFDATA2LSB
+	||  ehdr->e_shoff + (size_t)ehdr->e_shnum * ehdr->e_shentsize > elf_size
+	||  ehdr->e_shstrndx >= ehdr->e_shnum) {
+		fprintf(stderr, "%s: not a 32 bit little endian ELF file\n", filename);
+		return -1;
+	}
+
+	const Elf32_Shdr *strtab = elf_section(ehdr->e_shstrndx);
+	for (unsigned i = 0; i < ehdr->e_shnum; i++) {
+		const Elf32_Shdr *shdr = elf_section(i);
+		if (strcmp((const char *)elf_data + strtab->sh_offset + shdr->sh_name, ".logstr") == 0) {
+			logstr_shdr = shdr;
+		}
+	}
+	if (logstr_shdr == NULL) {
+		fprintf(stderr, "%s: no .logstr section (was it built with DEFERRED_LOG=1?)\n", filename);
+		return -1;
+	}
+	return 0;
+}
+
+// Returns the string at addr within the given section, or NULL if addr
+// isn't in the section or the string isn't null terminated.
+static const char *section_str(const Elf32_Shdr *shdr, uint32_t addr) {
+	if (shdr->sh_type != SHT_PROGBITS || addr < shdr->sh_addr
+	||  addr - shdr->sh_addr >= shdr->sh_size) {
+		return NULL;
+	}
+	const char *str = (const char *)elf_data + shdr->sh_offset + (addr - shdr->sh_addr);
+	if (memchr(str, '\0', shdr->sh_size - (addr - shdr->sh_addr)) == NULL) {
+		return NULL;
+	}
+	return str;
+}
+
+// Looks up a %s argument, which should point at a string in flash.
+static const char *flash_str(uint32_t addr) {
+	const Elf32_Ehdr *ehdr = (const Elf32_Ehdr *)elf_data;
+	for (unsigned i = 0; i < ehdr->e_shnum; i++) {
+		const Elf32_Shdr *shdr = elf_section(i);
+		if (shdr->sh_flags & SHF_ALLOC) {
+			const char *str = section_str(shdr, addr);
+			if (str != NULL) {
+				return str;
+			}
+		}
+	}
+	return "(?)";
+}
+
+static int read_varint(FILE *fs, uint32_t *val) {
+	*val = 0;
+	for (unsigned shift = 0; shift < 35; shift += 7) {
+		int ch = getc(fs);
+		if (ch == EOF) {
+			return -1;
+		}
+		*val |= (uint32_t)(ch & 0x7f) << shift;
+		if ((ch & 0x80) == 0) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// Formats a single record, reading the arguments from fs as each
+// conversion needs them. The format is parsed using the same grammar as
+// vStrXPrintf: %[-][#][0][width|*][.precision|*][l|ll]type
+static int decode_record(FILE *fs, const char *fmt) {
+	char out[512];
+
+	while (*fmt != '\0') {
+		if (*fmt != '%') {
+			size_t len = strcspn(fmt, "%");
+			fwrite(fmt, 1, len, stdout);
+			fmt += len;
+			continue;
+		}
+
+		// Copy the conversion spec, replacing any * with the value of the
+		// corresponding argument.
+		char spec[64];
+		size_t n = 0;
+		uint32_t arg;
+		int long_arg = 0;
+		int long_long_arg = 0;
+
+		spec[n++] = *fmt++;
+		if (*fmt == '-') {
+			spec[n++] = *fmt++;
+		}
+		if (*fmt == '#') {
+			spec[n++] = *fmt++;
+		}
+		if (*fmt == '0') {
+			spec[n++] = *fmt++;
+		}
+		if (*fmt == '*') {
+			fmt++;
+			if (read_varint(fs, &arg) < 0) {
+				return -1;
+			}
+			// A negative width is the same as no width.
+			if ((int32_t)arg > 0) {
+				n += sprintf(&spec[n], "%d", (int)(int16_t)arg);
+			}
+		} else {
+			while (*fmt >= '0' && *fmt <= '9' && n < sizeof(spec) - 16) {
+				spec[n++] = *fmt++;
+			}
+		}
+		if (*fmt == '.') {
+			fmt++;
+			if (*fmt == '*') {
+				fmt++;
+				if (read_varint(fs, &arg) < 0) {
+					return -1;
+				}
+				// A negative precision is the same as no precision.
+				if ((int32_t)arg >= 0) {
+					n += sprintf(&spec[n], ".%d", (int)(int16_t)arg);
+				}
+			} else {
+				spec[n++] = '.';
+				while (*fmt >= '0' && *fmt <= '9' && n < sizeof(spec) - 16) {
+					spec[n++] = *fmt++;
+				}
+			}
+		}
+		if (*fmt == 'l') {
+			long_arg = 1;
+			spec[n++] = *fmt++;
+			if (*fmt == 'l') {
+				long_long_arg = 1;
+				spec[n++] = *fmt++;
+			}
+		}
+		char type = *fmt;
+		if (type == '\0') {
+			break;
+		}
+		spec[n++] = *fmt++;
+		spec[n] = '\0';
+
+		if (long_long_arg || strchr("eEfFrR", type) != NULL) {
+			// log_deferred only sends 32 bit arguments, so 64 bit integers
+			// and doubles can't be decoded. LOG_NARGS still counted the
+			// argument, so skip its (meaningless) word to stay in sync.
+			if (read_varint(fs, &arg) < 0) {
+				return -1;
+			}
+			fprintf(stderr, "logdecode: %s can't be used with a deferred LOG()\n", spec);
+			StrPrintf(out, sizeof(out), "<%s unsupported>", spec);
+		} else if (strchr("duxXobcs", type) == NULL) {
+			// Not a conversion which takes an argument (i.e. %%).
+			StrPrintf(out, sizeof(out), spec);
+		} else {
+			if (read_varint(fs, &arg) < 0) {
+				return -1;
+			}
+			if (type == 's') {
+				StrPrintf(out, sizeof(out), spec, flash_str(arg));
+			} else if (type == 'd') {
+				if (long_arg) {
+					StrPrintf(out, sizeof(out), spec, (long)(int32_t)arg);
+				} else {
+					StrPrintf(out, sizeof(out), spec, (int)(int32_t)arg);
+				}
+			} else if (long_arg) {
+				StrPrintf(out, sizeof(out), spec, (unsigned long)arg);
+			} else {
+				StrPrintf(out, sizeof(out), spec, (unsigned)arg);
+			}
+		}
+		fputs(out, stdout);
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	FILE *fs = stdin;
+	int ch;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s firmware.elf [device]\n", argv[0]);
+		return 1;
+	}
+	if (elf_load(argv[1]) < 0) {
+		return 1;
+	}
+	if (argc == 3) {
+		fs = fopen(argv[2], "rb");
+		if (fs == NULL) {
+			perror(argv[2]);
+			return 1;
+		}
+	}
+
+	while ((ch = getc(fs)) != EOF) {
+		if (ch != LOG_RECORD_SYNC) {
+			putchar(ch);
+			fflush(stdout);
+			continue;
+		}
+		uint32_t addr;
+		if (read_varint(fs, &addr) < 0) {
+			break;
+		}
+		const char *fmt = section_str(logstr_shdr, addr);
+		if (fmt == NULL) {
+			// Most likely the ELF file doesn't match the firmware.
+			printf("<unknown log record 0x%08x>\n", addr);
+			continue;
+		}
+		if (decode_record(fs, fmt) < 0) {
+			break;
+		}
+		fflush(stdout);
+	}
+	return 0;
+}
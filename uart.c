@@ -19,65 +19,380 @@
 
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
+#include <libopencm3/cm3/nvic.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/usart.h>
+#include <libopencm3/stm32/dma.h>
 
+#include "CBUF.h"
+#include "cooked.h"
 #include "StrPrintf.h"
 
+// USART2 Tx is serviced by DMA1 Stream 6, Channel 4.
+#define UART_TX_DMA			DMA1
+#define UART_TX_DMA_STREAM	DMA_STREAM6
+#define UART_TX_DMA_CHANNEL	DMA_SxCR_CHSEL_4
+#define UART_TX_DMA_IRQ		NVIC_DMA1_STREAM6_IRQ
+
+// USART2 Rx is serviced by DMA1 Stream 5, Channel 4.
+#define UART_RX_DMA			DMA1
+#define UART_RX_DMA_STREAM	DMA_STREAM5
+#define UART_RX_DMA_CHANNEL	DMA_SxCR_CHSEL_4
+#define UART_RX_DMA_IRQ		NVIC_DMA1_STREAM5_IRQ
+
+typedef struct {
+	volatile	uint16_t	m_get_idx;
+	volatile	uint16_t	m_put_idx;
+				uint8_t		m_entry[1024];	// Size must be a power of 2
+} buf_t;
+
+static buf_t	uart_rx_buf;
+static buf_t	uart_tx_buf;
+
+// Number of bytes the DMA is currently sending from uart_tx_buf (0 when idle).
+static volatile uint16_t uart_tx_dma_len;
+
+static uart_stats_t uart_stats;
+
+// UART_ERROR_xxx bits accumulated since the last call to uart_get_errors().
+static volatile uint8_t uart_errors;
+
 void uart_init(void)
 {
     rcc_periph_clock_enable(RCC_GPIOA);
     rcc_periph_clock_enable(RCC_USART2);
+    rcc_periph_clock_enable(RCC_DMA1);
 
 	/* Setup USART2 parameters. */
 	usart_set_baudrate(USART2, 115200);
 	usart_set_databits(USART2, 8);
 	usart_set_stopbits(USART2, USART_STOPBITS_1);
-	usart_set_mode(USART2, USART_MODE_TX);
+	usart_set_mode(USART2, USART_MODE_TX_RX);
 	usart_set_parity(USART2, USART_PARITY_NONE);
 	usart_set_flow_control(USART2, USART_FLOWCONTROL_NONE);
 
+	/* Setup the DMA stream used to transmit. */
+	dma_stream_reset(UART_TX_DMA, UART_TX_DMA_STREAM);
+	dma_channel_select(UART_TX_DMA, UART_TX_DMA_STREAM, UART_TX_DMA_CHANNEL);
+	dma_set_priority(UART_TX_DMA, UART_TX_DMA_STREAM, DMA_SxCR_PL_MEDIUM);
+	dma_set_transfer_mode(UART_TX_DMA, UART_TX_DMA_STREAM,
+						  DMA_SxCR_DIR_MEM_TO_PERIPHERAL);
+	dma_set_memory_size(UART_TX_DMA, UART_TX_DMA_STREAM, DMA_SxCR_MSIZE_8BIT);
+	dma_set_peripheral_size(UART_TX_DMA, UART_TX_DMA_STREAM,
+							DMA_SxCR_PSIZE_8BIT);
+	dma_enable_memory_increment_mode(UART_TX_DMA, UART_TX_DMA_STREAM);
+	dma_set_peripheral_address(UART_TX_DMA, UART_TX_DMA_STREAM,
+							   (uint32_t)&USART2_DR);
+	dma_enable_transfer_complete_interrupt(UART_TX_DMA, UART_TX_DMA_STREAM);
+	nvic_enable_irq(UART_TX_DMA_IRQ);
+	usart_enable_tx_dma(USART2);
+
+	/*
+	 * Setup the DMA stream used to receive. It runs continuously in
+	 * circular mode over the whole of uart_rx_buf.m_entry. The put index
+	 * is updated from the half/full transfer interrupts and when the line
+	 * goes idle, so partial frames are seen promptly without needing an
+	 * interrupt per character.
+	 */
+	dma_stream_reset(UART_RX_DMA, UART_RX_DMA_STREAM);
+	dma_channel_select(UART_RX_DMA, UART_RX_DMA_STREAM, UART_RX_DMA_CHANNEL);
+	dma_set_priority(UART_RX_DMA, UART_RX_DMA_STREAM, DMA_SxCR_PL_HIGH);
+	dma_set_transfer_mode(UART_RX_DMA, UART_RX_DMA_STREAM,
+						  DMA_SxCR_DIR_PERIPHERAL_TO_MEM);
+	dma_set_memory_size(UART_RX_DMA, UART_RX_DMA_STREAM, DMA_SxCR_MSIZE_8BIT);
+	dma_set_peripheral_size(UART_RX_DMA, UART_RX_DMA_STREAM,
+							DMA_SxCR_PSIZE_8BIT);
+	dma_enable_memory_increment_mode(UART_RX_DMA, UART_RX_DMA_STREAM);
+	dma_enable_circular_mode(UART_RX_DMA, UART_RX_DMA_STREAM);
+	dma_set_peripheral_address(UART_RX_DMA, UART_RX_DMA_STREAM,
+							   (uint32_t)&USART2_DR);
+	dma_set_memory_address(UART_RX_DMA, UART_RX_DMA_STREAM,
+						   (uint32_t)uart_rx_buf.m_entry);
+	dma_set_number_of_data(UART_RX_DMA, UART_RX_DMA_STREAM,
+						   CBUF_Size(uart_rx_buf));
+	dma_enable_half_transfer_interrupt(UART_RX_DMA, UART_RX_DMA_STREAM);
+	dma_enable_transfer_complete_interrupt(UART_RX_DMA, UART_RX_DMA_STREAM);
+	nvic_enable_irq(UART_RX_DMA_IRQ);
+	dma_enable_stream(UART_RX_DMA, UART_RX_DMA_STREAM);
+	usart_enable_rx_dma(USART2);
+
+	// Parity, framing, noise and overrun errors are reported through the
+	// USART interrupt along with idle line detection.
+	USART_CR1(USART2) |= USART_CR1_IDLEIE | USART_CR1_PEIE;
+	USART_CR3(USART2) |= USART_CR3_EIE;
+	nvic_enable_irq(NVIC_USART2_IRQ);
+
 	/* Finally enable the USART. */
 	usart_enable(USART2);
 
-    // Setup USART2 Tx on A2
-    gpio_mode_setup(GPIOA, GPIO_MODE_AF, GPIO_PUPD_NONE, GPIO2);
-    gpio_set_af(GPIOA, GPIO_AF7, GPIO2);
+    // Setup USART2 Tx on A2 and Rx on A3
+    gpio_mode_setup(GPIOA, GPIO_MODE_AF, GPIO_PUPD_NONE, GPIO2 | GPIO3);
+    gpio_set_af(GPIOA, GPIO_AF7, GPIO2 | GPIO3);
 }
 
-static int uart_putc(void *out_param, int ch) {
-	(void)out_param;
-	if (ch == '\n') {
-		usart_send_blocking(USART2, '\r');
+void uart_set_line_coding(uint32_t baud, uint8_t databits,
+						  uart_parity_t parity, uart_stopbits_t stopbits)
+{
+	static const uint32_t usart_parity[] = {
+		[UART_PARITY_NONE]	= USART_PARITY_NONE,
+		[UART_PARITY_ODD]	= USART_PARITY_ODD,
+		[UART_PARITY_EVEN]	= USART_PARITY_EVEN,
+	};
+	static const uint32_t usart_stopbits[] = {
+		[UART_STOPBITS_1]	= USART_STOPBITS_1,
+		[UART_STOPBITS_1_5]	= USART_STOPBITS_1_5,
+		[UART_STOPBITS_2]	= USART_STOPBITS_2,
+	};
+
+	// The USART's word length includes the parity bit, and it only
+	// supports 8 or 9 bit words. Anything else (7N1, say) falls back to
+	// 8N1, which is counted so that it shows up in the stats.
+	uint8_t wordlen = databits + (parity != UART_PARITY_NONE);
+	if (wordlen != 8 && wordlen != 9) {
+		wordlen = 8;
+		parity = UART_PARITY_NONE;
+		uart_stats.line_coding_unsupported++;
+	}
+
+	usart_disable(USART2);
+	usart_set_baudrate(USART2, baud);
+	usart_set_databits(USART2, wordlen);
+	usart_set_stopbits(USART2, usart_stopbits[stopbits]);
+	usart_set_parity(USART2, usart_parity[parity]);
+	usart_enable(USART2);
+}
+
+// Publishes the data which the Rx DMA has written since the last call.
+// Only called from the USART2 and Rx DMA interrupts, which run at the same
+// priority, so they can't preempt each other.
+static void uart_rx_update(void) {
+	uint16_t dma_idx = CBUF_Size(uart_rx_buf)
+					 - dma_get_number_of_data(UART_RX_DMA, UART_RX_DMA_STREAM);
+	uint16_t len = (dma_idx - uart_rx_buf.m_put_idx) & CBUF_Mask(uart_rx_buf);
+
+	uart_stats.rx_bytes += len;
+	CBUF_AdvancePushIdxBy(uart_rx_buf, len);
+}
+
+void dma1_stream5_isr(void) {
+	// Only the half and full transfer interrupts are enabled.
+	dma_clear_interrupt_flags(UART_RX_DMA, UART_RX_DMA_STREAM,
+							  DMA_HTIF | DMA_TCIF);
+	uart_rx_update();
+}
+
+void usart2_isr(void) {
+	uint32_t sr = USART_SR(USART2);
+
+	if ((sr & (USART_SR_IDLE | USART_SR_PE | USART_SR_FE | USART_SR_NE | USART_SR_ORE))
+	&&	!(sr & USART_SR_RXNE)) {
+		// These flags are all cleared by reading SR followed by DR. If the
+		// DMA hasn't taken the byte which has the error yet, reading DR here
+		// would take it instead, and it would never reach uart_rx_buf. The
+		// DMA's own read of DR finishes the sequence in that case, so DR is
+		// only read once it's empty. A byte which finishes arriving in
+		// between the two reads is still lost, but that window is a few
+		// cycles long, compared with a character time of at least 3.8 us.
+		(void)USART_DR(USART2);
+	}
+	if (sr & USART_SR_PE) {
+		uart_errors |= UART_ERROR_PARITY;
+		uart_stats.rx_parity++;
+	}
+	if (sr & (USART_SR_FE | USART_SR_NE)) {
+		uart_errors |= UART_ERROR_FRAMING;
+		uart_stats.rx_framing++;
+	}
+	if (sr & USART_SR_ORE) {
+		uart_errors |= UART_ERROR_OVERRUN;
+		uart_stats.rx_overrun++;
+	}
+	if (sr & USART_SR_IDLE) {
+		uart_rx_update();
+	}
+}
+
+uint8_t uart_get_errors(void) {
+	uint8_t errors = uart_errors;
+	uart_errors = 0;
+	return errors;
+}
+
+// The DMA keeps writing regardless of whether there's space, so if the
+// reader falls more than a buffer behind, the oldest data has been
+// overwritten. Skip over it so that the reader gets the newest data.
+static void uart_rx_check_overrun(void) {
+	uint16_t len = CBUF_Len(uart_rx_buf);
+	if (len > CBUF_Size(uart_rx_buf)) {
+		uint16_t lost = len - CBUF_Size(uart_rx_buf);
+		uart_stats.rx_overrun += lost;
+		uart_errors |= UART_ERROR_OVERRUN;
+		CBUF_AdvancePopIdxBy(uart_rx_buf, lost);
+	}
+}
+
+uint16_t uart_avail(void) {
+	uart_rx_check_overrun();
+	return CBUF_Len(uart_rx_buf);
+}
+
+size_t uart_rx_peek(const uint8_t **data) {
+	uint8_t *ptr1;
+	uint8_t *ptr2;
+	size_t len1;
+	size_t len2;
+
+	uart_rx_update();
+	uart_rx_check_overrun();
+	CBUF_PopPeek(uart_rx_buf, CBUF_Size(uart_rx_buf), ptr1, len1, ptr2, len2);
+	(void)ptr2;
+	(void)len2;
+	*data = ptr1;
+	return len1;
+}
+
+void uart_rx_consume(size_t len) {
+	CBUF_PopConsume(uart_rx_buf, len);
+}
+
+int uart_recv_byte(void) {
+	uint8_t ch;
+	if (uart_read(&ch, 1) == 0) {
+		return -1;
+	}
+	return ch;
+}
+
+size_t uart_read(void *data, size_t len) {
+	uint8_t *dst = data;
+	uint8_t *ptr1;
+	uint8_t *ptr2;
+	size_t len1;
+	size_t len2;
+
+	uart_rx_check_overrun();
+	len = CBUF_PopPeek(uart_rx_buf, len, ptr1, len1, ptr2, len2);
+	memcpy(dst, ptr1, len1);
+	memcpy(dst + len1, ptr2, len2);
+	CBUF_PopConsume(uart_rx_buf, len);
+	return len;
+}
+
+// Points the DMA at the next contiguous segment of uart_tx_buf. Must only
+// be called when the DMA is idle, with the DMA interrupt masked (or from
+// the DMA interrupt itself).
+static void uart_tx_dma_start(void) {
+	uint8_t *ptr1;
+	uint8_t *ptr2;
+	size_t len1;
+	size_t len2;
+
+	CBUF_PopPeek(uart_tx_buf, CBUF_Size(uart_tx_buf), ptr1, len1, ptr2, len2);
+	(void)ptr2;
+	(void)len2;
+	if (len1 == 0) {
+		return;
+	}
+	uart_tx_dma_len = len1;
+	dma_clear_interrupt_flags(UART_TX_DMA, UART_TX_DMA_STREAM,
+		DMA_TCIF | DMA_HTIF | DMA_TEIF | DMA_DMEIF | DMA_FEIF);
+	dma_set_memory_address(UART_TX_DMA, UART_TX_DMA_STREAM, (uint32_t)ptr1);
+	dma_set_number_of_data(UART_TX_DMA, UART_TX_DMA_STREAM, len1);
+	dma_enable_stream(UART_TX_DMA, UART_TX_DMA_STREAM);
+}
+
+// Called after data has been added to uart_tx_buf.
+static void uart_tx_kick(void) {
+	if (uart_tx_dma_len != 0) {
+		// The transfer complete interrupt will pick up the new data.
+		return;
+	}
+	nvic_disable_irq(UART_TX_DMA_IRQ);
+	if (uart_tx_dma_len == 0) {
+		uart_tx_dma_start();
 	}
-	usart_send_blocking(USART2, ch);
-	return 1;
+	nvic_enable_irq(UART_TX_DMA_IRQ);
+}
+
+void dma1_stream6_isr(void) {
+	if (dma_get_interrupt_flag(UART_TX_DMA, UART_TX_DMA_STREAM, DMA_TCIF)) {
+		dma_clear_interrupt_flags(UART_TX_DMA, UART_TX_DMA_STREAM, DMA_TCIF);
+		uart_stats.tx_bytes += uart_tx_dma_len;
+		CBUF_PopConsume(uart_tx_buf, uart_tx_dma_len);
+		uart_tx_dma_len = 0;
+
+		// Keep going with the next segment (i.e. after a wrap).
+		uart_tx_dma_start();
+	}
+}
+
+static size_t uart_tx_push(const void *data, size_t len) {
+	const uint8_t *src = data;
+	uint8_t *ptr1;
+	uint8_t *ptr2;
+	size_t len1;
+	size_t len2;
+
+	size_t pushed = CBUF_PushReserve(uart_tx_buf, len, ptr1, len1, ptr2, len2);
+	memcpy(ptr1, src, len1);
+	memcpy(ptr2, src + len1, len2);
+	CBUF_PushCommit(uart_tx_buf, pushed);
+
+	// When the buffer is full we drop the data rather than waiting.
+	uart_stats.tx_dropped += len - pushed;
+	return pushed;
+}
+
+size_t uart_write(const void *data, size_t len) {
+	len = uart_tx_push(data, len);
+	uart_tx_kick();
+	return len;
+}
+
+uint16_t uart_tx_space(void) {
+	return CBUF_Space(uart_tx_buf);
+}
+
+void uart_get_stats(uart_stats_t *stats) {
+	*stats = uart_stats;
+}
+
+static void uart_tx_push_run(void *arg, const char *str, size_t len) {
+	(void)arg;
+	uart_tx_push(str, len);
+}
+
+// Pushes str into the TX ring, translating \n into \r\n. The caller is
+// responsible for kicking the transmitter.
+static void uart_tx_push_cooked(const char *str, size_t len) {
+	cooked_write(uart_tx_push_run, NULL, str, len);
+}
+
+static int uart_put_chunk(void *out_param, const char *str, int len) {
+	(void)out_param;
+	uart_tx_push_cooked(str, len);
+	return len;
 }
 
 void uart_printf(const char *fmt, ...) {
 	va_list args;
 	va_start(args, fmt);
-	vStrXPrintf(uart_putc, NULL, fmt, args);
+	vStrXPrintfChunk(uart_put_chunk, NULL, fmt, args);
 	va_end(args);
+	uart_tx_kick();
 }
 
 void uart_send_byte(uint8_t ch) {
-    usart_send_blocking(USART2, ch);
+	uart_write(&ch, 1);
 }
 
 void uart_send_strn(const char *str, size_t len) {
-	for (const char *end = str + len; str < end; str++) {
-		uart_send_byte(*str);
-	}
+	uart_write(str, len);
 }
 
 void uart_send_strn_cooked(const char *str, size_t len) {
-	for (const char *end = str + len; str < end; str++) {
-		if (*str == '\n') {
-			uart_send_byte('\r');
-		}
-		uart_send_byte(*str);
-	}
+	uart_tx_push_cooked(str, len);
+	uart_tx_kick();
 }
-
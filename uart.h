@@ -21,12 +21,68 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	UART_PARITY_NONE,
+	UART_PARITY_ODD,
+	UART_PARITY_EVEN,
+} uart_parity_t;
+
+typedef enum {
+	UART_STOPBITS_1,
+	UART_STOPBITS_1_5,
+	UART_STOPBITS_2,
+} uart_stopbits_t;
+
+#define UART_ERROR_OVERRUN	0x01
+#define UART_ERROR_FRAMING	0x02
+#define UART_ERROR_PARITY	0x04
+
+typedef struct {
+	uint32_t	tx_bytes;		// Bytes sent by the Tx DMA
+	uint32_t	tx_dropped;		// Bytes dropped because the Tx buffer was full
+	uint32_t	rx_bytes;		// Bytes received by the Rx DMA
+	uint32_t	rx_overrun;		// Bytes overwritten before they were read, plus
+								// USART overrun errors
+	uint32_t	rx_framing;		// Framing (and noise) errors
+	uint32_t	rx_parity;		// Parity errors
+	uint32_t	line_coding_unsupported;	// Line codings replaced by 8N1
+} uart_stats_t;
+
 void uart_init(void);
+void uart_get_stats(uart_stats_t *stats);
+
+// Returns the UART_ERROR_xxx bits seen since the previous call. Like
+// uart_rx_peek(), this must be called from an interrupt handler running at
+// the same priority as the UART interrupts.
+uint8_t uart_get_errors(void);
+void uart_set_line_coding(uint32_t baud, uint8_t databits,
+						  uart_parity_t parity, uart_stopbits_t stopbits);
 void uart_printf(const char *fmt, ...);
 
+uint16_t uart_avail(void);
+int uart_recv_byte(void);
+size_t uart_read(void *data, size_t len);
+size_t uart_write(const void *data, size_t len);
+uint16_t uart_tx_space(void);
+
+// Zero-copy access to the Rx buffer. uart_rx_peek() returns the number of
+// contiguous bytes available at *data, which are then released using
+// uart_rx_consume(). These must only be called from an interrupt handler
+// running at the same priority as the UART interrupts (i.e. the default).
+size_t uart_rx_peek(const uint8_t **data);
+void uart_rx_consume(size_t len);
+
 void uart_send_byte(uint8_t ch);
 void uart_send_strn(const char *str, size_t len);
 void uart_send_strn_cooked(const char *str, size_t len);
 
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif  // UART_H
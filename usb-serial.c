@@ -15,17 +15,306 @@
  * along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <libopencmsis/core_cm3.h>
+#include <string.h>
+
 #include <libopencm3/stm32/rcc.h>
 
 #include "button_boot.h"
+#include "cycles.h"
+#include "events.h"
 #include "led.h"
+#include "log.h"
+#include "sections.h"
+#include "stats.h"
+#include "StrPrintf.h"
+#include "swtimer.h"
 #include "systick.h"
 #include "uart.h"
 #include "usb.h"
 
+// The port used for the echo demo (and the bridge).
+#define VCP_PORT	0
+
+#define TX_BENCH_BYTES	(256 * 1024)
+#define TX_BENCH_REPORT_SPACE	128
+
+// Streams TX_BENCH_BYTES of printable data to the host as fast as the USB
+// transmitter will take it, and then reports the achieved throughput. On
+// the host, run something like "cat /dev/ttyACM0 > /dev/null" and then type
+// "txbench" into another terminal (or echo it into the port).
+static void tx_bench(void)
+{
+	usb_vcp_stats_t	start_stats;
+	usb_vcp_stats_t	end_stats;
+	uint32_t		remaining = TX_BENCH_BYTES;
+	char			pattern[95];
+
+	for (unsigned i = 0; i < sizeof(pattern); i++) {
+		pattern[i] = ' ' + i;
+	}
+
+	usb_vcp_get_stats(VCP_PORT, &start_stats);
+	uint32_t start_millis = system_millis;
+
+	while (remaining > 0 && usb_vcp_is_connected(VCP_PORT)) {
+		size_t len = sizeof(pattern);
+		if (len > remaining) {
+			len = remaining;
+		}
+		remaining -= usb_vcp_write(VCP_PORT, pattern, len);
+	}
+	uint32_t elapsed = system_millis - start_millis;
+	usb_vcp_get_stats(VCP_PORT, &end_stats);
+
+	if (elapsed == 0) {
+		elapsed = 1;
+	}
+
+	// The transmit buffer is still full, and anything which doesn't fit is
+	// dropped, so wait for there to be room for the report.
+	while (usb_vcp_tx_space(VCP_PORT) < TX_BENCH_REPORT_SPACE
+		&& usb_vcp_is_connected(VCP_PORT)) {
+		;
+	}
+	usb_vcp_printf(VCP_PORT, "\ntxbench: %lu bytes in %lu ms = %lu bytes/sec (%lu packets)\n",
+				   TX_BENCH_BYTES - remaining, elapsed,
+				   (TX_BENCH_BYTES - remaining) / elapsed * 1000,
+				   end_stats.tx_packets - start_stats.tx_packets);
+}
+
+#define TX_PORTS_BYTES	(64 * 1024)
+
+// Streams TX_PORTS_BYTES to every port at the same time, with each port
+// sending nothing but its own digit ('0' for port 0 and so on), and then
+// reports how much each port sent. The simulator's benchmark uses this to
+// check that each port's data only comes out of that port.
+static void tx_ports(void)
+{
+	uint32_t	remaining[USB_VCP_NUM_PORTS];
+	char		pattern[USB_VCP_NUM_PORTS][64];
+	bool		busy = true;
+
+	for (unsigned port = 0; port < USB_VCP_NUM_PORTS; port++) {
+		remaining[port] = TX_PORTS_BYTES;
+		memset(pattern[port], '0' + port, sizeof(pattern[port]));
+	}
+	while (busy) {
+		busy = false;
+		for (unsigned port = 0; port < USB_VCP_NUM_PORTS; port++) {
+			if (remaining[port] > 0 && usb_vcp_is_connected(port)) {
+				size_t len = sizeof(pattern[port]);
+				if (len > remaining[port]) {
+					len = remaining[port];
+				}
+				remaining[port] -= usb_vcp_write(port, pattern[port], len);
+				busy = true;
+			}
+		}
+	}
+	for (unsigned port = 0; port < USB_VCP_NUM_PORTS; port++) {
+		while (usb_vcp_tx_space(port) < TX_BENCH_REPORT_SPACE
+			&& usb_vcp_is_connected(port)) {
+			;
+		}
+		usb_vcp_printf(port, "\ntxports: %lu bytes\n",
+					   (unsigned long)(TX_PORTS_BYTES - remaining[port]));
+	}
+}
+
+#define FMT_BENCH_CALLS	1000
+
+// Times some StrPrintf conversions using the cycle counter and reports
+// the average number of cycles per StrPrintf call. The same formats are
+// timed on the host by bench/intfmt_bench.c and bench/float_bench.c.
+static void fmt_bench(void)
+{
+	static const char *const fmt[] = {
+		"%d", "%u", "%x", "%08lX", "%lld", "%.3f", "%e",
+	};
+	char buf[32];
+
+	for (unsigned i = 0; i < sizeof(fmt) / sizeof(fmt[0]); i++) {
+		uint32_t start = cycles_now();
+		for (uint32_t n = 0; n < FMT_BENCH_CALLS; n++) {
+			// Vary the value so that both short and long numbers show up.
+			uint32_t val = n * 2654435761u >> (n & 31);
+			switch (i) {
+				case 3:
+					StrPrintf(buf, sizeof(buf), fmt[i], (unsigned long)val);
+					break;
+				case 4:
+					StrPrintf(buf, sizeof(buf), fmt[i], (long long)val * 1000003);
+					break;
+				case 5:
+				case 6:
+					StrPrintf(buf, sizeof(buf), fmt[i], (double)((float)val * 0.001f));
+					break;
+				default:
+					StrPrintf(buf, sizeof(buf), fmt[i], (int)val);
+					break;
+			}
+		}
+		uint32_t cycles = cycles_since(start);
+
+		usb_vcp_printf(VCP_PORT, "fmtbench %-6s %lu cycles/call\n",
+					   fmt[i], cycles / FMT_BENCH_CALLS);
+	}
+}
+
+// Set USB_SERIAL_BRIDGE to 1 (i.e. make BRIDGE=1) to build a USB to UART
+// adapter rather than the line echo demo.
+#if !defined(USB_SERIAL_BRIDGE)
+#define USB_SERIAL_BRIDGE	0
+#endif
+
+static swtimer_t heartbeat_timer;
+static swtimer_t cycles_timer;
+
+// cycles_now64 has to be called at least once per wrap of the cycle counter
+// (25.5 s at 168 MHz) to carry into the top half. systick_idle does that
+// whenever the CPU wakes up, but with the tickless timebase nothing else
+// guarantees that the CPU wakes up that often.
+#define CYCLES_CARRY_MS	10000
+
+static void cycles_carry(swtimer_t *timer, void *arg)
+{
+	(void)timer;
+	(void)arg;
+
+	cycles_now64();
+}
+
+// Blinks the LED to show that we're alive. Called every 100 ms from the
+// heartbeat timer.
+static void heartbeat(swtimer_t *timer, void *arg)
+{
+	static uint32_t blink;
+
+	(void)timer;
+	(void)arg;
+
+	if (blink <= 3) {
+		led_toggle(0);
+	}
+	blink = (blink + 1) % 10;
+}
+
+// Counts how many times the main loop wakes up in a second while idle, and
+// how many of those wakeups were caused by the timebase. With the original
+// 1 ms SysTick the timebase alone accounts for 1000. While USB is attached
+// the SOF interrupt wakes the CPU every 1 ms as well, so the total doesn't
+// show the difference.
+static void wakeup_bench(void)
+{
+	uint32_t start = systick_get_wakeups();
+	uint32_t start_timebase = systick_get_timebase_irqs();
+	msleep(1000);
+	usb_vcp_printf(VCP_PORT, "wakeups: %lu per second (%lu from the timebase)\n",
+				   systick_get_wakeups() - start,
+				   systick_get_timebase_irqs() - start_timebase);
+}
+
+static void timer_event(unsigned event)
+{
+	(void)event;
+	swtimer_run();
+}
+
+// Returns true if the line is exactly str. The line may be split in two.
+static bool line_is(const usb_vcp_line_t *line, const char *str)
+{
+	size_t len = strlen(str);
+
+	return line->len1 + line->len2 == len
+		&& memcmp(line->ptr1, str, line->len1) == 0
+		&& memcmp(line->ptr2, str + line->len1, line->len2) == 0;
+}
+
+// Handles a line received by echo_rx.
+static void process_line(const usb_vcp_line_t *line)
+{
+	static uint32_t line_count;
+
+	if (line_is(line, "txbench")) {
+		tx_bench();
+		return;
+	}
+	if (line_is(line, "txports")) {
+		tx_ports();
+		return;
+	}
+	if (line_is(line, "stats")) {
+		print_stats(VCP_PORT);
+		return;
+	}
+	if (line_is(line, "fmtbench")) {
+		fmt_bench();
+		return;
+	}
+	if (line_is(line, "wakeups")) {
+		wakeup_bench();
+		return;
+	}
+
+	LOG("line %lu: %u bytes at %lu ms\n", (unsigned long)++line_count,
+		(unsigned)(line->len1 + line->len2), (unsigned long)system_millis);
+
+	uart_send_strn("Line: ", 6);
+	uart_send_strn(line->ptr1, line->len1);
+	uart_send_strn(line->ptr2, line->len2);
+	uart_send_strn("\r\n", 2);
+
+	usb_vcp_send_strn(VCP_PORT, "Line: ", 6);
+	usb_vcp_send_strn(VCP_PORT, line->ptr1, line->len1);
+	usb_vcp_send_strn(VCP_PORT, line->ptr2, line->len2);
+	usb_vcp_send_strn(VCP_PORT, "\r\n", 2);
+}
+
+// Sends back the part of the line from offset onwards.
+static void echo_from(const usb_vcp_line_t *line, size_t offset)
+{
+	if (offset < line->len1) {
+		usb_vcp_send_strn(VCP_PORT, line->ptr1 + offset, line->len1 - offset);
+		offset = line->len1;
+	}
+	offset -= line->len1;
+	if (offset < line->len2) {
+		usb_vcp_send_strn(VCP_PORT, line->ptr2 + offset, line->len2 - offset);
+	}
+}
+
+// Handles EVENT_USB_RX for VCP_PORT. Received characters are echoed back,
+// and each line is processed in place in the receive buffer.
+static void echo_rx(unsigned event)
+{
+	static size_t echoed;	// Bytes of the current line sent back so far
+	usb_vcp_line_t line;
+
+	(void)event;
+
+	while (1) {
+		bool have_line = usb_vcp_peek_line(VCP_PORT, &line);
+
+		echo_from(&line, echoed);
+		echoed = line.len1 + line.len2;
+		if (!have_line) {
+			break;
+		}
+		if (line.eol == '\r') {
+			usb_vcp_send_strn(VCP_PORT, "\r\n", 2);
+		} else if (line.eol == '\n') {
+			usb_vcp_send_byte(VCP_PORT, '\n');
+		}
+		process_line(&line);
+		usb_vcp_release_line(VCP_PORT, &line);
+		echoed = 0;
+	}
+}
+
 int main(void)
 {
+	ramfunc_init();
+
 #if defined(BOARD_1BITSY)
 	// button_boot checks to see if the USER button is pushed during powerup
 	// and if so, reboots into DFU mode.
@@ -38,57 +327,36 @@ int main(void)
 #endif
 
 	led_init();
+	cycles_init();
 	systick_init();
 	uart_init();
 	usb_vcp_init();
 
-	uart_printf("\n*****\n");
-	uart_printf("***** Starting (UART) ...\n");
-	uart_printf("*****\n");
+	swtimer_init(&heartbeat_timer, heartbeat, NULL);
+	swtimer_start(&heartbeat_timer, 100, 100);
 
-	usb_vcp_printf("\n*****\n");
-	usb_vcp_printf("***** Starting (USB) ...\n");
-	usb_vcp_printf("*****\n");
+	swtimer_init(&cycles_timer, cycles_carry, NULL);
+	swtimer_start(&cycles_timer, CYCLES_CARRY_MS, CYCLES_CARRY_MS);
 
+	event_set_handler(EVENT_TIMER, timer_event);
 
-	uint32_t last_millis = system_millis;
-	uint32_t blink = 0;
+	if (USB_SERIAL_BRIDGE) {
+		// All of the data is moved from interrupt context, so all that's
+		// left for the main loop to do is blink the LED.
+		usb_vcp_set_bridge(VCP_PORT, true);
+	} else {
+		uart_printf("\n*****\n");
+		uart_printf("***** Starting (UART) ...\n");
+		uart_printf("*****\n");
 
-	while (1) {
+		usb_vcp_printf(VCP_PORT, "\n*****\n");
+		usb_vcp_printf(VCP_PORT, "***** Starting (USB) ...\n");
+		usb_vcp_printf(VCP_PORT, "*****\n");
 
-		char buf[128];
-		size_t len = 0;
-		while (1) {
-			if (len >= sizeof(buf)) {
-				break;
-			}
-			if (usb_vcp_avail()) {
-				char ch = usb_vcp_recv_byte();
-				usb_vcp_send_byte(ch);
-				if (ch == '\r') {
-					usb_vcp_send_byte('\n');
-				}
-				if (ch == '\r' || ch == '\n') {
-					break;
-				}
-				buf[len++] = ch;
-			}
-
-			if (system_millis - last_millis > 100) {
-				if (blink <= 3) {
-					led_toggle(0);
-				}
-				blink = (blink + 1) % 10;
-				last_millis = system_millis;
-			}
-			__WFI();
-		}
-		uart_send_strn("Line: ", 6);
-		uart_send_strn(buf, len);
-		uart_send_strn("\r\n", 2);
+		event_set_handler(EVENT_USB_RX(VCP_PORT), echo_rx);
+	}
 
-		usb_vcp_send_strn("Line: ", 6);
-		usb_vcp_send_strn(buf, len);
-		usb_vcp_send_strn("\r\n", 2);
+	while (1) {
+		event_dispatch();
 	}
 }
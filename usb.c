@@ -24,6 +24,8 @@
 
 #include "usb.h"
 
+#include <string.h>
+
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
@@ -32,20 +34,100 @@
 #include <libopencm3/stm32/desig.h>
 
 #include "CBUF.h"
+#include "cooked.h"
+#include "MPCBUF.h"
+#include "events.h"
+#include "sections.h"
 #include "StrPrintf.h"
+#include "uart.h"
+
+#if USB_VCP_NUM_PORTS < 1 || USB_VCP_NUM_PORTS > 2
+#error USB_VCP_NUM_PORTS must be 1 or 2
+#endif
+
+// Buffer sizes (per port) are set by the Makefile (USB_RX_BUF_SIZE and
+// USB_TX_BUF_SIZE). A bigger transmit buffer rides out longer stalls on the
+// host side before writes start to fail (and LOG() output is dropped).
+#if !defined(USB_VCP_RX_BUF_SIZE)
+#define USB_VCP_RX_BUF_SIZE	1024
+#endif
+#if !defined(USB_VCP_TX_BUF_SIZE)
+#define USB_VCP_TX_BUF_SIZE	16384
+#endif
+
+// usb_vcp_avail and usb_vcp_tx_space return 16 bit counts, so 32K is as big
+// as the buffers can be. The transmit side is also tied to 16 bit indices
+// since MPCBUF packs its commit index into the low 16 bits of m_state.
+#if (USB_VCP_RX_BUF_SIZE & (USB_VCP_RX_BUF_SIZE - 1)) != 0 \
+	|| USB_VCP_RX_BUF_SIZE < 64 || USB_VCP_RX_BUF_SIZE > 32768
+#error USB_VCP_RX_BUF_SIZE must be a power of 2 between 64 and 32768
+#endif
+#if (USB_VCP_TX_BUF_SIZE & (USB_VCP_TX_BUF_SIZE - 1)) != 0 \
+	|| USB_VCP_TX_BUF_SIZE < 64 || USB_VCP_TX_BUF_SIZE > 32768
+#error USB_VCP_TX_BUF_SIZE must be a power of 2 between 64 and 32768
+#endif
 
 typedef struct {
-	volatile	uint16_t	m_get_idx;
-	volatile	uint16_t	m_put_idx;
-				uint8_t		m_entry[1024];	// Size must be a power of 2
+	volatile	uint32_t	m_get_idx;
+	volatile	uint32_t	m_put_idx;
+				uint8_t		m_entry[USB_VCP_RX_BUF_SIZE];
 } buf_t;
 
-static buf_t	usb_serial_rx_buf;
-static buf_t	usb_serial_tx_buf;
-static bool   	usb_serial_need_empty_tx = false;
+// The transmit buffers can be written from any context (main loop or
+// interrupt handlers), so they're MPCBUFs.
+typedef struct {
+	volatile	uint32_t	m_state;
+	volatile	uint32_t	m_put_idx;
+	volatile	uint32_t	m_get_idx;
+				uint8_t		m_entry[USB_VCP_TX_BUF_SIZE];
+} mp_buf_t;
+
+// SERIAL_STATE bits. The DCD and DSR bits are reported whenever they
+// change, while the error bits are one-shot events which accumulate in
+// state_events until a notification carries them to the host.
+#define CDCACM_STATE_LINE_MASK	(USB_VCP_STATE_DCD | USB_VCP_STATE_DSR)
+
+// Everything we need to know about one CDC ACM function.
+typedef struct {
+	buf_t			rx_buf;
+	mp_buf_t		tx_buf;
+	uint32_t		rx_scanned;		// Bytes searched by usb_vcp_peek_line
+	bool			need_empty_tx;
+	volatile bool	tx_busy;
+	volatile bool	rx_nak;
+	volatile bool	is_connected;
+
+	// In bridge mode, data from the host goes straight to the UART Tx
+	// buffer, and data for the host comes straight from the UART Rx buffer.
+	bool			bridge;
+
+	volatile uint16_t	state;
+	volatile uint16_t	state_events;
+	uint16_t		state_sent;
+	uint8_t			notify_frames;
+
+	struct usb_cdc_line_coding line_coding;
+	usb_vcp_stats_t	stats;
+} usb_vcp_port_t;
+
+// The buffers are only touched by the CPU (the OTG_FS FIFOs are filled and
+// emptied by the CPU rather than DMA), so the ports live in CCM, which
+// keeps those accesses off the bus matrix. usb_vcp_init() clears them.
+static usb_vcp_port_t usb_vcp_port[USB_VCP_NUM_PORTS] CCM_DATA;
+
+static usb_cycle_stats_t usb_cycle_stats = {
+	CYCLE_STATS_INIT,
+	CYCLE_STATS_INIT,
+};
+
+// Setting USB_VCP_TX_SOF_PACED to 1 restores the original behaviour of
+// writing at most one packet per SOF. It's only useful for comparing
+// throughput against the completion driven transmitter.
+#if !defined(USB_VCP_TX_SOF_PACED)
+#define USB_VCP_TX_SOF_PACED	0
+#endif
 
 static usbd_device *g_usbd_dev = NULL;
-static bool g_usbd_is_connected = false;
 
 static char usb_serial[13];	// 12 digits plus a null terminator
 
@@ -59,9 +141,16 @@ static const struct usb_device_descriptor dev = {
 	.bLength = USB_DT_DEVICE_SIZE,
 	.bDescriptorType = USB_DT_DEVICE,
 	.bcdUSB = 0x0200,
+#if USB_VCP_NUM_PORTS > 1
+	// Each port is grouped using an Interface Association Descriptor.
+	.bDeviceClass = USB_CLASS_MISCELLANEOUS,
+	.bDeviceSubClass = 2,	// Common Class
+	.bDeviceProtocol = 1,	// Interface Association Descriptor
+#else
 	.bDeviceClass = USB_CLASS_CDC,
 	.bDeviceSubClass = 0,
 	.bDeviceProtocol = 0,
+#endif
 	.bMaxPacketSize0 = 64,
 	.idVendor = 0xf055,		// VID
 	.idProduct = 0x9902,	// PID
@@ -73,41 +162,66 @@ static const struct usb_device_descriptor dev = {
 };
 
 /*
- * This notification endpoint isn't implemented. According to CDC spec it's
- * optional, but its absence causes a NULL pointer dereference in the
- * Linux cdc_acm driver.
+ * Endpoints used by each port. Port 0 keeps the addresses used when there
+ * was only one port.
+ *
+ * The OTG_FS core on the STM32F4 only implements endpoints 1-3, which
+ * isn't enough for a second notification endpoint, so port 1 doesn't have
+ * one (notify is 0). Its communications interface is described with no
+ * endpoints rather than advertising one which would never answer, and it
+ * doesn't send SERIAL_STATE notifications. Hosts which insist on a
+ * notification endpoint (Linux's cdc_acm driver does) won't bind to port 1.
+ */
+static const struct {
+	uint8_t	data_out;
+	uint8_t	data_in;
+	uint8_t	notify;
+} cdcacm_ep[] = {
+	{ 0x01, 0x82, 0x83 },
+	{ 0x02, 0x81, 0 },
+};
+
+/*
+ * The notification endpoint is used to send SERIAL_STATE notifications.
+ * It has to be big enough to hold one in a single packet. bInterval is in
+ * frames, and notifications are coalesced so at most one is sent per
+ * interval.
  */
-static const struct usb_endpoint_descriptor comm_endp[] = {{
+#define CDCACM_NOTIFY_INTERVAL	32
+
+static struct usb_endpoint_descriptor comm_endp[USB_VCP_NUM_PORTS][1];
+static struct usb_endpoint_descriptor data_endp[USB_VCP_NUM_PORTS][2];
+
+static const struct usb_endpoint_descriptor comm_endp_template = {
 	.bLength = USB_DT_ENDPOINT_SIZE,
 	.bDescriptorType = USB_DT_ENDPOINT,
 	.bEndpointAddress = 0x83,
 	.bmAttributes = USB_ENDPOINT_ATTR_INTERRUPT,
-	.wMaxPacketSize = 8,
-	.bInterval = 32,
-} };
+	.wMaxPacketSize = 16,
+	.bInterval = CDCACM_NOTIFY_INTERVAL,
+};
 
-static const struct usb_endpoint_descriptor data_endp[] = {{
+static const struct usb_endpoint_descriptor data_endp_template = {
 	.bLength = USB_DT_ENDPOINT_SIZE,
 	.bDescriptorType = USB_DT_ENDPOINT,
 	.bEndpointAddress = 0x01,
 	.bmAttributes = USB_ENDPOINT_ATTR_BULK,
 	.wMaxPacketSize = 64,
 	.bInterval = 0,
-}, {
-	.bLength = USB_DT_ENDPOINT_SIZE,
-	.bDescriptorType = USB_DT_ENDPOINT,
-	.bEndpointAddress = 0x82,
-	.bmAttributes = USB_ENDPOINT_ATTR_BULK,
-	.wMaxPacketSize = 64,
-	.bInterval = 0,
-} };
+};
 
-static const struct {
+typedef struct {
 	struct usb_cdc_header_descriptor header;
 	struct usb_cdc_call_management_descriptor call_mgmt;
 	struct usb_cdc_acm_descriptor acm;
 	struct usb_cdc_union_descriptor cdc_union;
-} __attribute__((packed)) cdcacm_functional_descriptors = {
+} __attribute__((packed)) cdcacm_functional_descriptors_t;
+
+static cdcacm_functional_descriptors_t
+	cdcacm_functional_descriptors[USB_VCP_NUM_PORTS];
+
+static const cdcacm_functional_descriptors_t
+	cdcacm_functional_descriptors_template = {
 	.header = {
 		.bFunctionLength = sizeof(struct usb_cdc_header_descriptor),
 		.bDescriptorType = CS_INTERFACE,
@@ -137,7 +251,10 @@ static const struct {
 	 }
 };
 
-static const struct usb_interface_descriptor comm_iface[] = {{
+static struct usb_interface_descriptor comm_iface[USB_VCP_NUM_PORTS][1];
+static struct usb_interface_descriptor data_iface[USB_VCP_NUM_PORTS][1];
+
+static const struct usb_interface_descriptor comm_iface_template = {
 	.bLength = USB_DT_INTERFACE_SIZE,
 	.bDescriptorType = USB_DT_INTERFACE,
 	.bInterfaceNumber = 0,
@@ -147,14 +264,9 @@ static const struct usb_interface_descriptor comm_iface[] = {{
 	.bInterfaceSubClass = USB_CDC_SUBCLASS_ACM,
 	.bInterfaceProtocol = USB_CDC_PROTOCOL_AT,
 	.iInterface = 0,
+};
 
-	.endpoint = comm_endp,
-
-	.extra = &cdcacm_functional_descriptors,
-	.extralen = sizeof(cdcacm_functional_descriptors)
-} };
-
-static const struct usb_interface_descriptor data_iface[] = {{
+static const struct usb_interface_descriptor data_iface_template = {
 	.bLength = USB_DT_INTERFACE_SIZE,
 	.bDescriptorType = USB_DT_INTERFACE,
 	.bInterfaceNumber = 1,
@@ -164,23 +276,17 @@ static const struct usb_interface_descriptor data_iface[] = {{
 	.bInterfaceSubClass = 0,
 	.bInterfaceProtocol = 0,
 	.iInterface = 0,
+};
 
-	.endpoint = data_endp,
-} };
+static struct usb_iface_assoc_descriptor iface_assoc[USB_VCP_NUM_PORTS];
 
-static const struct usb_interface ifaces[] = {{
-	.num_altsetting = 1,
-	.altsetting = comm_iface,
-}, {
-	.num_altsetting = 1,
-	.altsetting = data_iface,
-} };
+static struct usb_interface ifaces[USB_VCP_NUM_PORTS * 2];
 
 static const struct usb_config_descriptor config = {
 	.bLength = USB_DT_CONFIGURATION_SIZE,
 	.bDescriptorType = USB_DT_CONFIGURATION,
 	.wTotalLength = 0,
-	.bNumInterfaces = 2,
+	.bNumInterfaces = USB_VCP_NUM_PORTS * 2,
 	.bConfigurationValue = 1,
 	.iConfiguration = 0,
 	.bmAttributes = 0x80,
@@ -190,6 +296,63 @@ static const struct usb_config_descriptor config = {
 	.interface = ifaces,
 };
 
+// Port n uses interfaces 2n (communications) and 2n + 1 (data). The
+// descriptors only differ in their interface and endpoint numbers, so
+// they're filled in from the templates above.
+static void cdcacm_fill_descriptors(void)
+{
+	for (unsigned port = 0; port < USB_VCP_NUM_PORTS; port++) {
+		uint8_t comm_num = port * 2;
+		uint8_t data_num = port * 2 + 1;
+
+		comm_endp[port][0] = comm_endp_template;
+		comm_endp[port][0].bEndpointAddress = cdcacm_ep[port].notify;
+
+		data_endp[port][0] = data_endp_template;
+		data_endp[port][0].bEndpointAddress = cdcacm_ep[port].data_out;
+		data_endp[port][1] = data_endp_template;
+		data_endp[port][1].bEndpointAddress = cdcacm_ep[port].data_in;
+
+		cdcacm_functional_descriptors_t *func =
+			&cdcacm_functional_descriptors[port];
+		*func = cdcacm_functional_descriptors_template;
+		func->call_mgmt.bDataInterface = data_num;
+		func->cdc_union.bControlInterface = comm_num;
+		func->cdc_union.bSubordinateInterface0 = data_num;
+
+		comm_iface[port][0] = comm_iface_template;
+		comm_iface[port][0].bInterfaceNumber = comm_num;
+		comm_iface[port][0].endpoint = comm_endp[port];
+		if (cdcacm_ep[port].notify == 0) {
+			comm_iface[port][0].bNumEndpoints = 0;
+		}
+		comm_iface[port][0].extra = func;
+		comm_iface[port][0].extralen = sizeof(*func);
+
+		data_iface[port][0] = data_iface_template;
+		data_iface[port][0].bInterfaceNumber = data_num;
+		data_iface[port][0].endpoint = data_endp[port];
+
+		struct usb_iface_assoc_descriptor *iad = &iface_assoc[port];
+		iad->bLength = USB_DT_INTERFACE_ASSOCIATION_SIZE;
+		iad->bDescriptorType = USB_DT_INTERFACE_ASSOCIATION;
+		iad->bFirstInterface = comm_num;
+		iad->bInterfaceCount = 2;
+		iad->bFunctionClass = USB_CLASS_CDC;
+		iad->bFunctionSubClass = USB_CDC_SUBCLASS_ACM;
+		iad->bFunctionProtocol = USB_CDC_PROTOCOL_AT;
+		iad->iFunction = 0;
+
+		ifaces[comm_num].num_altsetting = 1;
+		ifaces[comm_num].altsetting = comm_iface[port];
+		ifaces[data_num].num_altsetting = 1;
+		ifaces[data_num].altsetting = data_iface[port];
+		if (USB_VCP_NUM_PORTS > 1) {
+			ifaces[comm_num].iface_assoc = iad;
+		}
+	}
+}
+
 static const char *usb_strings[] = {
 	"Manufacturer",
 	"STM32F4 CDC Demo",
@@ -197,7 +360,7 @@ static const char *usb_strings[] = {
 };
 #define NUM_USB_STRINGS (sizeof(usb_strings) / sizeof(usb_strings[0]))
 
-static const struct usb_cdc_line_coding line_coding = {
+static const struct usb_cdc_line_coding default_line_coding = {
 	.dwDTERate = 115200,
 	.bCharFormat = USB_CDC_1_STOP_BITS,
 	.bParityType = USB_CDC_NO_PARITY,
@@ -209,19 +372,77 @@ uint8_t usbd_control_buffer[128];
 
 #define USB_CDC_REQ_GET_LINE_CODING			0x21 // Not defined in libopencm3
 
+// Map the endpoint passed to a data callback back to its port. libopencm3
+// passes the bare endpoint number (without the 0x80 direction bit) to both
+// OUT and IN callbacks, and port 0's IN endpoint has the same number as
+// port 1's OUT endpoint (and vice versa), so each direction has to be
+// looked up separately.
+static RAMFUNC unsigned cdcacm_port_from_out_ep(uint8_t ep)
+{
+	for (unsigned port = 0; port < USB_VCP_NUM_PORTS; port++) {
+		if ((ep & 0x7f) == (cdcacm_ep[port].data_out & 0x7f)) {
+			return port;
+		}
+	}
+	return 0;
+}
+
+static RAMFUNC unsigned cdcacm_port_from_in_ep(uint8_t ep)
+{
+	for (unsigned port = 0; port < USB_VCP_NUM_PORTS; port++) {
+		if ((ep & 0x7f) == (cdcacm_ep[port].data_in & 0x7f)) {
+			return port;
+		}
+	}
+	return 0;
+}
+
+// Reconfigures the UART to match the line coding requested by the host.
+static void cdcacm_apply_line_coding(usb_vcp_port_t *vcp)
+{
+	const struct usb_cdc_line_coding *lc = &vcp->line_coding;
+	uart_parity_t parity;
+	uart_stopbits_t stopbits;
+
+	if (lc->dwDTERate == 0) {
+		return;
+	}
+	switch (lc->bParityType) {
+		case USB_CDC_ODD_PARITY:	parity = UART_PARITY_ODD;	break;
+		case USB_CDC_EVEN_PARITY:	parity = UART_PARITY_EVEN;	break;
+		default:					parity = UART_PARITY_NONE;	break;
+	}
+	switch (lc->bCharFormat) {
+		case USB_CDC_1_5_STOP_BITS:	stopbits = UART_STOPBITS_1_5;	break;
+		case USB_CDC_2_STOP_BITS:	stopbits = UART_STOPBITS_2;		break;
+		default:					stopbits = UART_STOPBITS_1;		break;
+	}
+	uart_set_line_coding(lc->dwDTERate, lc->bDataBits, parity, stopbits);
+}
+
 static int cdcacm_control_request(usbd_device *usbd_dev,
 	struct usb_setup_data *req, uint8_t **buf, uint16_t *len,
 	void (**complete)(usbd_device *usbd_dev, struct usb_setup_data *req))
 {
 	(void)complete;
-	(void)buf;
 	(void)usbd_dev;
 
+	// The request is addressed to the port's communications interface.
+	unsigned port = req->wIndex / 2;
+	if (port >= USB_VCP_NUM_PORTS) {
+		return USBD_REQ_NOTSUPP;
+	}
+	usb_vcp_port_t *vcp = &usb_vcp_port[port];
+
 	switch (req->bRequest) {
 
 		case USB_CDC_REQ_SET_CONTROL_LINE_STATE: {	// 0x22
 			uint16_t rtsdtr = req->wValue;	// DTR is bit 0, RTS is bit 1
-			g_usbd_is_connected = rtsdtr & 1;
+			vcp->is_connected = rtsdtr & 1;
+			if (vcp->is_connected) {
+				// Let a newly opened port know the current line state.
+				vcp->state_sent = 0;
+			}
 			return USBD_REQ_HANDLED;
 		}
 
@@ -229,66 +450,270 @@ static int cdcacm_control_request(usbd_device *usbd_dev,
 			if (*len < sizeof(struct usb_cdc_line_coding)) {
 				return 0;
 			}
+			memcpy(&vcp->line_coding, *buf, sizeof(vcp->line_coding));
+			if (vcp->bridge) {
+				cdcacm_apply_line_coding(vcp);
+			}
 			return USBD_REQ_HANDLED;
 
 		case USB_CDC_REQ_GET_LINE_CODING:
-			*buf = (uint8_t *)&line_coding;
+			*buf = (uint8_t *)&vcp->line_coding;
 			return USBD_REQ_HANDLED;
 	}
 	return USBD_REQ_HANDLED;
 }
 
-static void cdcacm_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
+// Returns the amount of space available for data from the host.
+static RAMFUNC uint16_t cdcacm_rx_space(usb_vcp_port_t *vcp)
 {
-	uint16_t space = CBUF_ContigSpace(usb_serial_rx_buf);
+	if (vcp->bridge) {
+		return uart_tx_space();
+	}
+	return CBUF_Space(vcp->rx_buf);
+}
+
+static RAMFUNC uint16_t cdcacm_rx_to_buf(usb_vcp_port_t *vcp,
+										 usbd_device *usbd_dev, uint8_t ep)
+{
+	uint8_t *ptr1;
+	uint8_t *ptr2;
+	size_t len1;
+	size_t len2;
 	uint16_t len;
-	if (space >= 64) {
+
+	CBUF_PushReserve(vcp->rx_buf, 64, ptr1, len1, ptr2, len2);
+	if (len1 >= 64) {
 		// We can read directly into our buffer
-		len = usbd_ep_read_packet(usbd_dev, ep, 
-								  CBUF_GetPushEntryPtr(usb_serial_rx_buf), 64);
-		CBUF_AdvancePushIdxBy(usb_serial_rx_buf, len);
+		len = usbd_ep_read_packet(usbd_dev, ep, ptr1, 64);
 	} else {
-		// Do it character by character. This covers 2 situations:
-		// 1 - We're near the end of the buffer (so free space isn't contiguous)
-		// 2 - We don't have much free space left.
-		char buf[64];
+		// The packet has to be read in one go, so when the free space
+		// wraps (or there's less than a packet of it) we read into a
+		// bounce buffer and copy into the two spans.
+		uint8_t buf[64];
 		len = usbd_ep_read_packet(usbd_dev, ep, buf, 64);
-		for (int i = 0; i < len; i++) {
-			// If the Rx buffer fills, then we drop the new data.
-			if (CBUF_IsFull(usb_serial_rx_buf)) {
-				return;
-			}
-			CBUF_Push(usb_serial_rx_buf, buf[i]);
+		if (len > len1 + len2) {
+			// The endpoint is NAK'd before the buffer can fill, so this
+			// should never happen. If it does, we drop the new data.
+			vcp->stats.rx_dropped += len - (len1 + len2);
+			vcp->state_events |= USB_VCP_STATE_OVERRUN;
+			len = len1 + len2;
 		}
+		if (len < len1) {
+			len1 = len;
+		}
+		memcpy(ptr1, buf, len1);
+		memcpy(ptr2, buf + len1, len - len1);
+	}
+	CBUF_PushCommit(vcp->rx_buf, len);
+	return len;
+}
+
+static RAMFUNC uint16_t cdcacm_rx_to_uart(usb_vcp_port_t *vcp,
+										  usbd_device *usbd_dev, uint8_t ep)
+{
+	uint8_t buf[64];
+	uint16_t len = usbd_ep_read_packet(usbd_dev, ep, buf, 64);
+	uint16_t written = uart_write(buf, len);
+
+	// As above, the NAK should prevent this from ever happening.
+	if (written < len) {
+		vcp->stats.rx_dropped += len - written;
+		vcp->state_events |= USB_VCP_STATE_OVERRUN;
 	}
+	return written;
 }
 
-static void cdcacm_sof_callback(void) {
-	if (!g_usbd_is_connected) {
-		// Host isn't connected - nothing to do.
+static RAMFUNC void cdcacm_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
+{
+	CYCLES_TIME_SCOPE(usb_cycle_stats.rx_cb);
+	usb_vcp_port_t *vcp = &usb_vcp_port[cdcacm_port_from_out_ep(ep)];
+	uint16_t len;
+
+	if (vcp->bridge) {
+		len = cdcacm_rx_to_uart(vcp, usbd_dev, ep);
+	} else {
+		len = cdcacm_rx_to_buf(vcp, usbd_dev, ep);
+		event_post(EVENT_BIT(EVENT_USB_RX(vcp - usb_vcp_port)));
+	}
+	vcp->stats.rx_bytes += len;
+
+	// If there isn't room for another full packet, then NAK the endpoint so
+	// that the host holds on to its data. The NAK is cleared once enough
+	// data has been consumed (by usb_vcp_rx_drained(), or in bridge mode
+	// by the SOF callback once the UART has caught up).
+	if (cdcacm_rx_space(vcp) < 64) {
+		usbd_ep_nak_set(usbd_dev, ep, 1);
+		vcp->rx_nak = true;
+		vcp->stats.rx_naks++;
+	}
+}
+
+// Called after data has been removed from a port's rx_buf. Once there's
+// room for a full packet again, we let the host resume sending.
+static void usb_vcp_rx_drained(unsigned port) {
+	usb_vcp_port_t *vcp = &usb_vcp_port[port];
+
+	if (!vcp->rx_nak || cdcacm_rx_space(vcp) < 64) {
 		return;
 	}
+	// usbd_ep_nak_set isn't reentrant, so keep the USB interrupt out.
+	nvic_disable_irq(NVIC_OTG_FS_IRQ);
+	if (vcp->rx_nak) {
+		vcp->rx_nak = false;
+		usbd_ep_nak_set(g_usbd_dev, cdcacm_ep[port].data_out, 0);
+	}
+	nvic_enable_irq(NVIC_OTG_FS_IRQ);
+}
+
+// Queues the next packet from the port's tx_buf (or in bridge mode, from
+// the UART Rx buffer) on its IN endpoint. Returns true if a packet
+// (possibly a zero length one) was written, which means that the endpoint
+// is busy until its transfer complete callback fires.
+static RAMFUNC bool cdcacm_tx_next_packet(usb_vcp_port_t *vcp,
+										  usbd_device *usbd_dev, uint8_t ep) {
+	const uint8_t *data;
+	size_t len;
+
+	// A packet has to come from a single span. If the data wraps, the
+	// remainder goes out in the next packet.
+	if (vcp->bridge) {
+		len = uart_rx_peek(&data);
+	} else {
+		uint8_t *ptr1;
+		uint8_t *ptr2;
+		size_t len2;
 
-	uint16_t len = CBUF_ContigLen(usb_serial_tx_buf);
-	if (len == 0 && !usb_serial_need_empty_tx) {
+		MPCBUF_PopPeek(vcp->tx_buf, 64, ptr1, len, ptr2, len2);
+		(void)ptr2;
+		(void)len2;
+		data = ptr1;
+	}
+	if (len == 0 && !vcp->need_empty_tx) {
 		// Nothing to do.
-		return;
+		return false;
 	}
 	if (len > 64) {
 		len = 64;
 	}
-	uint8_t *pop_ptr = CBUF_GetPopEntryPtr(usb_serial_tx_buf);
-	uint16_t sent = usbd_ep_write_packet(g_usbd_dev, 0x82, pop_ptr, len);
+	uint16_t sent = usbd_ep_write_packet(usbd_dev, ep, data, len);
+	if (sent != len) {
+		// The endpoint was still busy. Try again later.
+		return false;
+	}
 
 	// If we just sent a packet of 64 bytes. If we get called again and
 	// there is no more data to send, then we need to send a zero byte
 	// packet to indicate to the host to release the data it has buffered.
-	usb_serial_need_empty_tx = (sent == 64);
-	CBUF_AdvancePopIdxBy(usb_serial_tx_buf, sent);
+	vcp->need_empty_tx = (sent == 64);
+	if (vcp->bridge) {
+		uart_rx_consume(sent);
+	} else {
+		MPCBUF_PopConsume(vcp->tx_buf, sent);
+	}
+
+	vcp->stats.tx_bytes += sent;
+	vcp->stats.tx_packets++;
+	return true;
+}
+
+// Called when the host has collected the packet written to a data IN
+// endpoint. We refill the endpoint right away so that back-to-back packets
+// go out in the same frame rather than waiting for the next SOF.
+static RAMFUNC void cdcacm_data_tx_cb(usbd_device *usbd_dev, uint8_t ep) {
+	unsigned port = cdcacm_port_from_in_ep(ep);
+	usb_vcp_port_t *vcp = &usb_vcp_port[port];
+
+	vcp->tx_busy = vcp->is_connected
+				&& cdcacm_tx_next_packet(vcp, usbd_dev, cdcacm_ep[port].data_in);
 }
 
-void otg_fs_isr(void)
+// Sends a SERIAL_STATE notification if the line state has changed or an
+// error has occurred since the last one. Called every frame, but only
+// sends once every CDCACM_NOTIFY_INTERVAL frames at most.
+static RAMFUNC void cdcacm_notify_serial_state(unsigned port, usbd_device *usbd_dev) {
+	usb_vcp_port_t *vcp = &usb_vcp_port[port];
+
+	if (cdcacm_ep[port].notify == 0) {
+		// See the comment above cdcacm_ep.
+		return;
+	}
+	if (vcp->notify_frames > 0) {
+		vcp->notify_frames--;
+		return;
+	}
+	if (vcp->bridge) {
+		uint8_t errors = uart_get_errors();
+		if (errors & UART_ERROR_OVERRUN) {
+			vcp->state_events |= USB_VCP_STATE_OVERRUN;
+		}
+		if (errors & UART_ERROR_FRAMING) {
+			vcp->state_events |= USB_VCP_STATE_FRAMING;
+		}
+		if (errors & UART_ERROR_PARITY) {
+			vcp->state_events |= USB_VCP_STATE_PARITY;
+		}
+	}
+	uint16_t state = (vcp->state & CDCACM_STATE_LINE_MASK)
+				   | vcp->state_events;
+	if (state == vcp->state_sent) {
+		// Nothing new to report.
+		return;
+	}
+
+	uint8_t buf[sizeof(struct usb_cdc_notification) + 2];
+	struct usb_cdc_notification *notif = (struct usb_cdc_notification *)buf;
+	notif->bmRequestType = 0xA1;
+	notif->bNotification = USB_CDC_NOTIFY_SERIAL_STATE;
+	notif->wValue = 0;
+	notif->wIndex = port * 2;	// Communications interface
+	notif->wLength = 2;
+	buf[sizeof(*notif) + 0] = state & 0xff;
+	buf[sizeof(*notif) + 1] = state >> 8;
+
+	if (usbd_ep_write_packet(usbd_dev, cdcacm_ep[port].notify,
+							 buf, sizeof(buf)) == 0) {
+		// The previous notification hasn't been collected yet.
+		return;
+	}
+	vcp->state_events = 0;
+	vcp->state_sent = state & CDCACM_STATE_LINE_MASK;
+	vcp->notify_frames = CDCACM_NOTIFY_INTERVAL - 1;
+	vcp->stats.notifications++;
+}
+
+// The SOF callback only needs to get the transmitters going when they're
+// idle. Once started, cdcacm_data_tx_cb keeps each one busy for as long as
+// there's data.
+static RAMFUNC void cdcacm_sof_callback(void) {
+	for (unsigned port = 0; port < USB_VCP_NUM_PORTS; port++) {
+		usb_vcp_port_t *vcp = &usb_vcp_port[port];
+
+#if USB_VCP_TX_SOF_PACED
+		vcp->tx_busy = false;
+#endif
+		if (vcp->bridge && vcp->rx_nak && uart_tx_space() >= 64) {
+			// The UART has drained enough for the host to resume sending.
+			vcp->rx_nak = false;
+			usbd_ep_nak_set(g_usbd_dev, cdcacm_ep[port].data_out, 0);
+		}
+		if (!vcp->is_connected) {
+			// Host isn't connected - nothing to do.
+			continue;
+		}
+		cdcacm_notify_serial_state(port, g_usbd_dev);
+		if (!vcp->tx_busy) {
+			vcp->tx_busy = cdcacm_tx_next_packet(vcp, g_usbd_dev,
+												 cdcacm_ep[port].data_in);
+		}
+	}
+}
+
+// The interrupt handler and the data callbacks run from SRAM (see
+// sections.h). usbd_poll itself is part of libopencm3, so it stays in flash.
+RAMFUNC void otg_fs_isr(void)
 {
+	CYCLES_TIME_SCOPE(usb_cycle_stats.isr);
+
 	if (g_usbd_dev) {
 		usbd_poll(g_usbd_dev);
 	}
@@ -298,10 +723,25 @@ static void cdcacm_set_config(usbd_device *usbd_dev, uint16_t wValue)
 {
 	(void)wValue;
 
-	usbd_ep_setup(usbd_dev, 0x01, USB_ENDPOINT_ATTR_BULK, 64,
-			cdcacm_data_rx_cb);
-	usbd_ep_setup(usbd_dev, 0x82, USB_ENDPOINT_ATTR_BULK, 64, NULL);
-	usbd_ep_setup(usbd_dev, 0x83, USB_ENDPOINT_ATTR_INTERRUPT, 16, NULL);
+	for (unsigned port = 0; port < USB_VCP_NUM_PORTS; port++) {
+		usb_vcp_port_t *vcp = &usb_vcp_port[port];
+
+		vcp->tx_busy = false;
+		vcp->need_empty_tx = false;
+		vcp->rx_nak = false;
+		vcp->state_sent = 0;
+		vcp->notify_frames = 0;
+
+		usbd_ep_setup(usbd_dev, cdcacm_ep[port].data_out,
+				USB_ENDPOINT_ATTR_BULK, 64, cdcacm_data_rx_cb);
+		usbd_ep_setup(usbd_dev, cdcacm_ep[port].data_in,
+				USB_ENDPOINT_ATTR_BULK, 64,
+				USB_VCP_TX_SOF_PACED ? NULL : cdcacm_data_tx_cb);
+		if (cdcacm_ep[port].notify != 0) {
+			usbd_ep_setup(usbd_dev, cdcacm_ep[port].notify,
+					USB_ENDPOINT_ATTR_INTERRUPT, 16, NULL);
+		}
+	}
 
 	usbd_register_control_callback(
 				usbd_dev,
@@ -310,55 +750,225 @@ static void cdcacm_set_config(usbd_device *usbd_dev, uint16_t wValue)
 				cdcacm_control_request);
 }
 
-bool usb_vcp_is_connected(void) {
-	return g_usbd_is_connected;
+void usb_vcp_set_bridge(unsigned port, bool enable) {
+	usb_vcp_port_t *vcp = &usb_vcp_port[port];
+
+	vcp->bridge = enable;
+	if (enable) {
+		cdcacm_apply_line_coding(vcp);
+	}
+}
+
+void usb_vcp_set_serial_state(unsigned port, uint16_t state) {
+	usb_vcp_port_t *vcp = &usb_vcp_port[port];
+
+	nvic_disable_irq(NVIC_OTG_FS_IRQ);
+	vcp->state = state & CDCACM_STATE_LINE_MASK;
+	vcp->state_events |= state & ~CDCACM_STATE_LINE_MASK;
+	nvic_enable_irq(NVIC_OTG_FS_IRQ);
 }
 
-uint16_t usb_vcp_avail(void) {
-	return CBUF_Len(usb_serial_rx_buf);
+bool usb_vcp_is_connected(unsigned port) {
+	return usb_vcp_port[port].is_connected;
 }
 
-int usb_vcp_recv_byte(void) {
-	if (CBUF_IsEmpty(usb_serial_rx_buf)) {
-		return -1;
+void usb_vcp_get_stats(unsigned port, usb_vcp_stats_t *stats) {
+	*stats = usb_vcp_port[port].stats;
+}
+
+void usb_get_cycle_stats(usb_cycle_stats_t *stats, bool reset) {
+	nvic_disable_irq(NVIC_OTG_FS_IRQ);
+	*stats = usb_cycle_stats;
+	if (reset) {
+		cycle_stats_reset(&usb_cycle_stats.isr);
+		cycle_stats_reset(&usb_cycle_stats.rx_cb);
 	}
-	return CBUF_Pop(usb_serial_rx_buf);
+	nvic_enable_irq(NVIC_OTG_FS_IRQ);
 }
 
-void usb_vcp_send_byte(uint8_t ch) {
-	if (!CBUF_IsFull(usb_serial_tx_buf)) {
-		CBUF_Push(usb_serial_tx_buf, ch);
+uint16_t usb_vcp_avail(unsigned port) {
+	return CBUF_Len(usb_vcp_port[port].rx_buf);
+}
+
+int usb_vcp_recv_byte(unsigned port) {
+	usb_vcp_port_t *vcp = &usb_vcp_port[port];
+
+	if (CBUF_IsEmpty(vcp->rx_buf)) {
+		return -1;
 	}
+	int ch = CBUF_Pop(vcp->rx_buf);
+	vcp->rx_scanned = 0;
+	usb_vcp_rx_drained(port);
+	return ch;
 }
 
-void usb_vcp_send_strn(const char *str, size_t len) {
-	for (const char *end = str + len; str < end; str++) {
-		usb_vcp_send_byte(*str);
+uint16_t usb_vcp_tx_space(unsigned port) {
+	return MPCBUF_Space(usb_vcp_port[port].tx_buf);
+}
+
+void usb_vcp_send_byte(unsigned port, uint8_t ch) {
+	usb_vcp_write_record(port, &ch, 1);
+}
+
+size_t usb_vcp_read(unsigned port, void *data, size_t len) {
+	usb_vcp_port_t *vcp = &usb_vcp_port[port];
+	uint8_t *dst = data;
+	uint8_t *ptr1;
+	uint8_t *ptr2;
+	size_t len1;
+	size_t len2;
+
+	len = CBUF_PopPeek(vcp->rx_buf, len, ptr1, len1, ptr2, len2);
+	memcpy(dst, ptr1, len1);
+	memcpy(dst + len1, ptr2, len2);
+	CBUF_PopConsume(vcp->rx_buf, len);
+	vcp->rx_scanned = 0;
+
+	usb_vcp_rx_drained(port);
+	return len;
+}
+
+// Reserves between min_len and len bytes in the port's tx_buf, copies the
+// data in, and commits it.
+static size_t usb_vcp_push(unsigned port, const void *data, size_t min_len, size_t len) {
+	usb_vcp_port_t *vcp = &usb_vcp_port[port];
+	const uint8_t *src = data;
+	uint8_t *ptr1;
+	uint8_t *ptr2;
+	size_t len1;
+	size_t len2;
+
+	len = MPCBUF_PushReserve(vcp->tx_buf, min_len, len, ptr1, len1, ptr2, len2);
+	if (len == 0) {
+		return 0;
 	}
+	memcpy(ptr1, src, len1);
+	memcpy(ptr2, src + len1, len2);
+	MPCBUF_PushCommit(vcp->tx_buf);
+	return len;
+}
+
+size_t usb_vcp_write(unsigned port, const void *data, size_t len) {
+	return usb_vcp_push(port, data, 0, len);
+}
+
+bool usb_vcp_write_record(unsigned port, const void *data, size_t len) {
+	return len == 0 || usb_vcp_push(port, data, len, len) == len;
+}
+
+void usb_vcp_send_strn(unsigned port, const char *str, size_t len) {
+	usb_vcp_write(port, str, len);
 }
 
-void usb_vcp_send_strn_cooked(const char *str, size_t len) {
-	for (const char *end = str + len; str < end; str++) {
-		if (*str == '\n') {
-			usb_vcp_send_byte('\r');
+static void usb_vcp_write_run(void *arg, const char *str, size_t len) {
+	usb_vcp_write(*(unsigned *)arg, str, len);
+}
+
+void usb_vcp_send_strn_cooked(unsigned port, const char *str, size_t len) {
+	cooked_write(usb_vcp_write_run, &port, str, len);
+}
+
+// Returns 1 for each byte of v which is zero (in the top bit of the byte).
+// Bytes above a zero byte may also be flagged, but the lowest flagged byte
+// is always the first zero.
+#define SWAR_ZERO_BYTES(v)	(((v) - 0x01010101u) & ~(v) & 0x80808080u)
+
+// Returns the index of the first CR or LF in data, or len if there isn't
+// one. After getting aligned, this checks 4 bytes at a time.
+static size_t find_eol(const uint8_t *data, size_t len) {
+	size_t i = 0;
+
+	for (; i < len && ((uintptr_t)&data[i] & 3) != 0; i++) {
+		if (data[i] == '\r' || data[i] == '\n') {
+			return i;
+		}
+	}
+	for (; i + 4 <= len; i += 4) {
+		uint32_t word;
+		memcpy(&word, &data[i], sizeof(word));
+		uint32_t found = SWAR_ZERO_BYTES(word ^ 0x0d0d0d0du) |
+						 SWAR_ZERO_BYTES(word ^ 0x0a0a0a0au);
+		if (found) {
+			// Little endian, so the first byte is the least significant.
+			return i + __builtin_ctz(found) / 8;
+		}
+	}
+	for (; i < len; i++) {
+		if (data[i] == '\r' || data[i] == '\n') {
+			return i;
 		}
-		usb_vcp_send_byte(*str);
 	}
+	return len;
 }
 
-static int usb_putc(void *out_param, int ch) {
-	(void)out_param;
-	if (ch == '\n') {
-		usb_vcp_send_byte('\r');
+bool usb_vcp_peek_line(unsigned port, usb_vcp_line_t *line) {
+	usb_vcp_port_t *vcp = &usb_vcp_port[port];
+	uint8_t *ptr1;
+	uint8_t *ptr2;
+	size_t len1;
+	size_t len2;
+	size_t len;
+	size_t eol;
+
+	len = CBUF_PopPeek(vcp->rx_buf, CBUF_Size(vcp->rx_buf), ptr1, len1, ptr2, len2);
+
+	// Anything before rx_scanned was searched by an earlier call.
+	size_t start = vcp->rx_scanned;
+	eol = len;
+	if (start < len1) {
+		eol = start + find_eol(ptr1 + start, len1 - start);
+		if (eol == len1) {
+			eol = len;
+		}
+		start = len1;
+	}
+	if (eol == len && start < len) {
+		eol = start + find_eol(ptr2 + (start - len1), len2 - (start - len1));
+	}
+
+	line->ptr1 = (const char *)ptr1;
+	line->ptr2 = (const char *)ptr2;
+	line->eol = 0;
+	line->consume = 0;
+	if (eol < len) {
+		line->eol = eol < len1 ? ptr1[eol] : ptr2[eol - len1];
+		line->consume = eol + 1;
+		vcp->rx_scanned = 0;
+	} else {
+		vcp->rx_scanned = len;
+
+		// If the host has been NAK'd, the rest of the line will never
+		// arrive, so hand over what we've got.
+		if (CBUF_Space(vcp->rx_buf) < 64) {
+			line->consume = len;
+		}
 	}
-	usb_vcp_send_byte(ch);
-	return 1;
+	line->len1 = eol < len1 ? eol : len1;
+	line->len2 = eol - line->len1;
+
+	return line->consume != 0;
+}
+
+void usb_vcp_release_line(unsigned port, const usb_vcp_line_t *line) {
+	usb_vcp_port_t *vcp = &usb_vcp_port[port];
+
+	CBUF_PopConsume(vcp->rx_buf, line->consume);
+	vcp->rx_scanned = 0;
+	usb_vcp_rx_drained(port);
+}
+
+// StrPrintf hands us whole runs of output (literal text, formatted fields
+// and padding), which go into the ring buffer a memcpy at a time.
+static int usb_put_chunk(void *out_param, const char *str, int len) {
+	unsigned port = *(unsigned *)out_param;
+	usb_vcp_send_strn_cooked(port, str, len);
+	return len;
 }
 
-void usb_vcp_printf(const char *fmt, ...) {
+void usb_vcp_printf(unsigned port, const char *fmt, ...) {
 	va_list args;
 	va_start(args, fmt);
-	vStrXPrintf(usb_putc, NULL, fmt, args);
+	vStrXPrintfChunk(usb_put_chunk, &port, fmt, args);
 	va_end(args);
 }
 
@@ -412,6 +1022,13 @@ void usb_vcp_init(void) {
 	gpio_set_af(GPIOA, GPIO_AF10, GPIO9 | GPIO11 | GPIO12);
 
 	fill_usb_serial();
+	cdcacm_fill_descriptors();
+
+	memset(usb_vcp_port, 0, sizeof(usb_vcp_port));
+	for (unsigned port = 0; port < USB_VCP_NUM_PORTS; port++) {
+		usb_vcp_port[port].line_coding = default_line_coding;
+		usb_vcp_port[port].state = CDCACM_STATE_LINE_MASK;
+	}
 
 	g_usbd_dev = usbd_init(&otgfs_usb_driver, &dev, &config,
 			usb_strings, NUM_USB_STRINGS,
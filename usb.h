@@ -22,16 +22,114 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+#include "cycles.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Number of CDC ACM ports (each with its own rings and endpoints) exposed
+// in one composite device. When there's more than one, they're grouped
+// using Interface Association Descriptors.
+#if !defined(USB_VCP_NUM_PORTS)
+#define USB_VCP_NUM_PORTS	1
+#endif
+
+typedef struct {
+	uint32_t	tx_bytes;		// Bytes written to the IN endpoint
+	uint32_t	tx_packets;		// Packets (including ZLPs) written to the IN endpoint
+	uint32_t	rx_bytes;		// Bytes received from the OUT endpoint
+	uint32_t	rx_naks;		// Number of times the OUT endpoint was NAK'd
+	uint32_t	rx_dropped;		// Bytes dropped because the rx buffer was full
+	uint32_t	notifications;	// SERIAL_STATE notifications sent
+} usb_vcp_stats_t;
+
+// Cost of the USB interrupt handling, which is shared by all of the ports.
+typedef struct {
+	cycle_stats_t	isr;		// otg_fs_isr
+	cycle_stats_t	rx_cb;		// cdcacm_data_rx_cb
+} usb_cycle_stats_t;
+
+// Bits for usb_vcp_set_serial_state(). These match the CDC SERIAL_STATE
+// notification. DCD and DSR are line states (both asserted by default),
+// and the rest are one-shot events.
+#define USB_VCP_STATE_DCD		0x0001
+#define USB_VCP_STATE_DSR		0x0002
+#define USB_VCP_STATE_BREAK		0x0004
+#define USB_VCP_STATE_RING		0x0008
+#define USB_VCP_STATE_FRAMING	0x0010
+#define USB_VCP_STATE_PARITY	0x0020
+#define USB_VCP_STATE_OVERRUN	0x0040
+
 void usb_vcp_init(void);
 
-bool usb_vcp_is_connected(void);
+// All of the remaining functions take the port number (0 to
+// USB_VCP_NUM_PORTS - 1) of the CDC ACM function to operate on.
+
+bool usb_vcp_is_connected(unsigned port);
+void usb_vcp_get_stats(unsigned port, usb_vcp_stats_t *stats);
+
+// Copies the interrupt timing statistics, and then restarts them if reset
+// is true.
+void usb_get_cycle_stats(usb_cycle_stats_t *stats, bool reset);
+
+// Bridge mode turns a port into a USB to UART adapter: data flows
+// between the host and USART2 from interrupt context, and the host's
+// SET_LINE_CODING requests reconfigure the UART. It should be enabled
+// (on at most one port) before the host opens the port.
+void usb_vcp_set_bridge(unsigned port, bool enable);
+
+// Sets the DCD/DSR line state reported to the host, and/or reports one of
+// the event bits. Notifications are sent on the interrupt endpoint, at
+// most once per bInterval.
+void usb_vcp_set_serial_state(unsigned port, uint16_t state);
+
+uint16_t usb_vcp_avail(unsigned port);
+int usb_vcp_recv_byte(unsigned port);
+uint16_t usb_vcp_tx_space(unsigned port);
+void usb_vcp_send_byte(unsigned port, uint8_t ch);
+size_t usb_vcp_read(unsigned port, void *data, size_t len);
+
+// The transmit functions may be called from any context, including
+// interrupt handlers. The data from each usb_vcp_write (or _write_record)
+// call is kept together in the transmit buffer, even if another context
+// writes to the same port part way through. usb_vcp_write writes as much
+// as fits, and returns how much that was, while usb_vcp_write_record
+// writes all of the data, or nothing (and returns false) if there isn't
+// room.
+size_t usb_vcp_write(unsigned port, const void *data, size_t len);
+bool usb_vcp_write_record(unsigned port, const void *data, size_t len);
+void usb_vcp_send_strn(unsigned port, const char *str, size_t len);
+void usb_vcp_send_strn_cooked(unsigned port, const char *str, size_t len);
+
+void usb_vcp_printf(unsigned port, const char *fmt, ...);
+
+// A line of received data, described in place in the port's receive
+// buffer. Since the buffer is circular, the line may be split into two
+// spans (len2 is 0 when it isn't). The CR or LF which ended the line isn't
+// included in the spans.
+typedef struct {
+	const char	*ptr1;
+	size_t		len1;
+	const char	*ptr2;
+	size_t		len2;
+	char		eol;		// '\r' or '\n', or 0 if the line isn't complete
+	size_t		consume;	// Bytes removed by usb_vcp_release_line
+} usb_vcp_line_t;
 
-uint16_t usb_vcp_avail(void);
-int usb_vcp_recv_byte(void);
-void usb_vcp_send_byte(uint8_t ch);
-void usb_vcp_send_strn(const char *str, size_t len);
-void usb_vcp_send_strn_cooked(const char *str, size_t len);
+// Looks for the next line in the port's receive buffer, without copying
+// it. Returns true if there's a line, which stays in the buffer until it's
+// passed to usb_vcp_release_line. If the buffer fills up without a CR or LF
+// it's returned as an incomplete line (eol is 0), since no more data can
+// arrive until it's released.
+//
+// When false is returned, the spans still describe the data received so
+// far (for echoing, say) but it mustn't be released.
+bool usb_vcp_peek_line(unsigned port, usb_vcp_line_t *line);
+void usb_vcp_release_line(unsigned port, const usb_vcp_line_t *line);
 
-void usb_vcp_printf(const char *fmt, ...);
+#ifdef __cplusplus
+}
+#endif
 
 #endif  // USB_H